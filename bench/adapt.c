@@ -0,0 +1,127 @@
+/*
+
+the adaptive concurrency limit of adapt.h against a simulated host, next to
+fixed limits.
+
+the host has CPUS cpus and an endless backlog of tasks. for the first half
+of the run the tasks are cpu bound, 200ms of cpu each: past CPUS running
+tasks they share the cpus, and past THRASH they also thrash and everything
+slows down. for the second half the tasks wait 200ms on a device that serves
+up to DEVICE of them at once, and need no cpu.
+
+cpu pressure is simulated like the kernel's: the share of time tasks waited
+for a cpu, averaged over 10s.
+
+	policy:   fixed -j, or adaptive with or without pressure
+	tasks/s:  throughput of the phase
+	runtime:  average runtime of a task, ms
+	limit:    average limit over the phase
+
+usage: bench_adapt [seconds]
+
+*/
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "src/util.h"
+#include "src/adapt.h"
+
+#define CPUS   8
+#define THRASH 24
+#define DEVICE 48
+#define WORK   200.0 /* ms a task takes alone */
+#define MAXRUN 256
+
+struct sim {
+	double left[MAXRUN]; /* ms of work left of each running task */
+	uint64_t start[MAXRUN];
+	size_t n;
+	double pressure; /* 10s average, percent */
+	/* per phase */
+	uint64_t done[2];
+	double runtime[2];
+	double limitsum[2];
+	uint64_t steps[2];
+};
+
+/* how much work a running task gets done in a ms, with n running */
+static
+double speed(int phase, size_t n) {
+	if (phase == 0) {
+		double s = n > CPUS ? (double)CPUS/n : 1;
+		if (n > THRASH) s /= 1 + 2.0*(n - THRASH)/THRASH;
+		return s;
+	}
+	return n > DEVICE ? (double)DEVICE/n : 1;
+}
+
+/* fixed > 0 is a fixed limit, 0 adaptive without pressure, -1 adaptive with it */
+static
+void run(const char* name, int fixed, uint64_t ms) {
+	struct sim s = {0};
+	struct adapt a;
+	adapt_init(&a, 1, MAXRUN, CPUS, 0);
+
+	for (uint64_t now = 0; now < ms; now += 1) {
+		int phase = now >= ms/2;
+		size_t limit = fixed > 0 ? (size_t)fixed : adapt_limit(&a);
+
+		while (s.n < limit && s.n < MAXRUN) {
+			s.left[s.n] = WORK;
+			s.start[s.n] = now;
+			s.n += 1;
+		}
+		/* the backlog never runs out, a reached limit always holds tasks back */
+		if (fixed <= 0 && s.n >= limit) adapt_heldback(&a);
+
+		double v = speed(phase, s.n);
+		double waiting = phase == 0 && s.n > CPUS ? 100.0*(s.n - CPUS)/s.n : 0;
+		s.pressure += (waiting - s.pressure)/10000;
+
+		for (size_t i = 0; i < s.n;) {
+			s.left[i] -= v;
+			if (s.left[i] > 0) {
+				i += 1;
+				continue;
+			}
+			uint64_t rt = now + 1 - s.start[i];
+			s.done[phase] += 1;
+			s.runtime[phase] += rt;
+			if (fixed <= 0) adapt_done(&a, rt);
+			s.n -= 1;
+			s.left[i] = s.left[s.n];
+			s.start[i] = s.start[s.n];
+		}
+
+		if (fixed <= 0) adapt_tick(&a, now + 1, fixed < 0 ? s.pressure : -1);
+		s.limitsum[phase] += limit;
+		s.steps[phase] += 1;
+	}
+
+	for (int p = 0; p < 2; p += 1) {
+		printf("%-18s %-6s %10.1f %10.0f %8.1f\n", p == 0 ? name : "", p == 0 ? "cpu" : "device",
+			s.done[p]*1000.0/s.steps[p], s.done[p] > 0 ? s.runtime[p]/s.done[p] : 0,
+			s.limitsum[p]/s.steps[p]);
+	}
+}
+
+int main(int argc, char* argv[]) {
+	uint64_t seconds = argc > 1 ? strtoull(argv[1], NULL, 10) : 120;
+	ASSERT(seconds >= 2, "need at least two seconds");
+
+	printf("%d cpus, thrashing past %d tasks, device of %d, %llus simulated\n\n",
+		CPUS, THRASH, DEVICE, (unsigned long long)seconds);
+	printf("%-18s %-6s %10s %10s %8s\n", "policy", "phase", "tasks/s", "runtime", "limit");
+	int fixed[] = {CPUS, THRASH, 2*DEVICE};
+	for (size_t i = 0; i < sizeof(fixed)/sizeof(fixed[0]); i += 1) {
+		char name[32];
+		snprintf(name, sizeof(name), "fixed -j %d", fixed[i]);
+		run(name, fixed[i], seconds*1000);
+	}
+	run("adaptive", 0, seconds*1000);
+	run("adaptive + psi", -1, seconds*1000);
+	return 0;
+}
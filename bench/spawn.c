@@ -0,0 +1,171 @@
+/*
+
+launch latency of task_run()'s fork path against the zygote, as the daemon grows.
+
+	spawn: how long the caller is blocked starting the task
+	e2e:   from the request until the exit of `true` is seen
+	burst: BURST tasks started back to back before any exit is read, the
+	       way dispatch starts the dependents of a task. per task, from the
+	       first request until every exit is seen. the zygote has to keep
+	       answering while the exits it reports pile up unread
+
+the zygote is started before the ballast is allocated, the same way unqud
+starts it before it holds any tasks.
+
+usage: bench_spawn [iterations]
+
+*/
+
+#define _GNU_SOURCE
+#include <poll.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "src/util.h"
+#include "src/spawn.h"
+
+static
+uint64_t now_ns(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec*1000000000 + ts.tv_nsec;
+}
+
+static
+int cmp_u64(const void* a, const void* b) {
+	uint64_t x = *(const uint64_t*)a;
+	uint64_t y = *(const uint64_t*)b;
+	return x < y ? -1 : x > y;
+}
+
+static
+void report(const char* name, size_t ballast, uint64_t* ns, int n) {
+	uint64_t sum = 0;
+	for (int i = 0; i < n; i += 1) sum += ns[i];
+	qsort(ns, n, sizeof(*ns), cmp_u64);
+	printf("%-18s %6zuM %10.1f %10.1f %10.1f\n", name, ballast,
+		sum/1e3/n, ns[n/2]/1e3, ns[n*99/100]/1e3);
+}
+
+/* argv "true", the daemon's environment, no cwd and no resolved path */
+static const char* trueargv[] = {"true", NULL};
+static struct spawnargs args = {.argv = trueargv};
+
+static
+void bench_fork(size_t ballast, int n, uint64_t* spawn, uint64_t* e2e) {
+	for (int i = 0; i < n; i += 1) {
+		uint64_t t0 = now_ns();
+		pid_t pid = fork();
+		if (pid == 0) spawn_exec(&args, -1);
+		ASSERT(pid > 0, "fork failed");
+		setpgid(pid, pid);
+		uint64_t t1 = now_ns();
+		ASSERT(waitpid(pid, NULL, 0) == pid, "waitpid failed");
+		uint64_t t2 = now_ns();
+		spawn[i] = t1 - t0;
+		e2e[i] = t2 - t0;
+	}
+	report("fork spawn", ballast, spawn, n);
+	report("fork e2e", ballast, e2e, n);
+}
+
+static
+void bench_zygote(const char* name, struct zygote* z, size_t ballast, int n, uint64_t* spawn, uint64_t* e2e) {
+	char spawnname[64];
+	char e2ename[64];
+	snprintf(spawnname, sizeof(spawnname), "%s spawn", name);
+	snprintf(e2ename, sizeof(e2ename), "%s e2e", name);
+
+	for (int i = 0; i < n; i += 1) {
+		int pidfd;
+		uint64_t t0 = now_ns();
+		pid_t pid = zygote_spawn(z, &args, -1, &pidfd);
+		ASSERT(pid > 0, "zygote spawn failed");
+		uint64_t t1 = now_ns();
+
+		struct zyexit ex;
+		int got = 0;
+		while (got == 0) {
+			struct pollfd pfd = {.fd = z->ev, .events = POLLIN};
+			poll(&pfd, 1, -1);
+			got = zygote_exits(z, &ex, 1);
+			ASSERT(got >= 0, "zygote died");
+		}
+		uint64_t t2 = now_ns();
+		ASSERT(ex.pid == pid, "unexpected exit");
+		if (pidfd != -1) close(pidfd);
+		spawn[i] = t1 - t0;
+		e2e[i] = t2 - t0;
+	}
+	report(spawnname, ballast, spawn, n);
+	report(e2ename, ballast, e2e, n);
+}
+
+#define BURST 4000
+#define BURST_TIMEOUT_S 60 /* a zygote that stops answering hangs the burst, the alarm ends it */
+
+static
+void bench_burst(const char* name, struct zygote* z, size_t ballast) {
+	static pid_t pids[BURST];
+	alarm(BURST_TIMEOUT_S);
+	uint64_t t0 = now_ns();
+	for (int i = 0; i < BURST; i += 1) {
+		int pidfd;
+		pids[i] = zygote_spawn(z, &args, -1, &pidfd);
+		ASSERT(pids[i] > 0, "zygote spawn failed");
+		if (pidfd != -1) close(pidfd);
+	}
+	int seen = 0;
+	while (seen < BURST) {
+		struct zyexit ex[256];
+		struct pollfd pfd = {.fd = z->ev, .events = POLLIN};
+		poll(&pfd, 1, -1);
+		int got = zygote_exits(z, ex, sizeof(ex)/sizeof(ex[0]));
+		ASSERT(got >= 0, "zygote died");
+		seen += got;
+	}
+	uint64_t ns = now_ns() - t0;
+	alarm(0);
+	uint64_t per = ns/BURST;
+	report(name, ballast, &per, 1);
+}
+
+int main(int argc, char* argv[]) {
+	int n = argc > 1 ? atoi(argv[1]) : 500;
+	if (n <= 0) n = 500;
+	static const size_t ballasts[] = {0, 256, 1024};
+
+	/* the spawned tasks log to stderr */
+	ASSERT(freopen("/dev/null", "w", stderr) != NULL, "can't silence stderr");
+
+	struct zygote cold;
+	struct zygote warm;
+	ASSERT(zygote_start(&cold, 0), "zygote failed to start");
+	ASSERT(zygote_start(&warm, 8), "zygote failed to start");
+
+	uint64_t* spawn = malloc(n*sizeof(uint64_t));
+	uint64_t* e2e = malloc(n*sizeof(uint64_t));
+	ASSERT(spawn != NULL && e2e != NULL, "out of memory");
+
+	printf("%-18s %7s %10s %10s %10s\n", "", "daemon", "mean us", "p50 us", "p99 us");
+	char* ballast = NULL;
+	for (size_t i = 0; i < sizeof(ballasts)/sizeof(ballasts[0]); i += 1) {
+		/* touch every page, so the daemon's page tables are as big as its heap */
+		free(ballast);
+		ballast = malloc(ballasts[i] << 20);
+		ASSERT(ballasts[i] == 0 || ballast != NULL, "out of memory");
+		memset(ballast, 1, ballasts[i] << 20);
+
+		bench_fork(ballasts[i], n, spawn, e2e);
+		bench_zygote("zygote", &cold, ballasts[i], n, spawn, e2e);
+		bench_zygote("zygote+warm", &warm, ballasts[i], n, spawn, e2e);
+		bench_burst("zygote burst", &cold, ballasts[i]);
+		bench_burst("zygote+warm burst", &warm, ballasts[i]);
+	}
+
+	zygote_stop(&cold);
+	zygote_stop(&warm);
+	return 0;
+}
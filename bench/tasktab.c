@@ -0,0 +1,156 @@
+/*
+
+scanning the task table by state, the way kill selectors do, before and after
+the hot/cold split.
+
+	aos:     state and pid inside each task, as before the split
+	columns: the dense state column of struct tasktab
+
+95% of the tasks have exited, 4% are waiting to run and 1% are running, the
+scan counts the running ones. cache misses come from perf_event_open(2) and
+are "-" where it isn't allowed.
+
+usage: bench_tasktab [tasks]
+
+*/
+
+#define _GNU_SOURCE
+#include <linux/perf_event.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "src/util.h"
+#include "src/tasktab.h"
+
+#define ROUNDS 10
+
+/* the task as it was before the split */
+struct aostask {
+	struct task cold;
+	state_t state;
+	pid_t pid;
+};
+
+static
+uint64_t now_ns(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec*1000000000 + ts.tv_nsec;
+}
+
+static
+int perf_open(void) {
+	struct perf_event_attr attr = {
+		.type = PERF_TYPE_HARDWARE,
+		.size = sizeof(attr),
+		.config = PERF_COUNT_HW_CACHE_MISSES,
+		.disabled = 1,
+		.exclude_kernel = 1,
+		.exclude_hv = 1,
+	};
+	return (int)syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+static
+void perf_start(int fd) {
+	if (fd == -1) return;
+	ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+	ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+}
+
+static
+long long perf_stop(int fd) {
+	long long n = -1;
+	if (fd == -1) return -1;
+	ioctl(fd, PERF_EVENT_IOC_DISABLE, 0);
+	if (read(fd, &n, sizeof(n)) != sizeof(n)) return -1;
+	return n;
+}
+
+static
+state_t pick_state(size_t i) {
+	switch (i % 100) {
+	case 0: return TS_ACTIVE;
+	case 1: case 2: case 3: case 4: return TS_INACTIVE;
+	default: return TS_EXITED;
+	}
+}
+
+static
+size_t scan_aos(struct aostask* tasks, size_t n, uint32_t states) {
+	size_t hits = 0;
+	for (size_t i = 0; i < n; i += 1)
+		hits += (states & (UINT32_C(1) << tasks[i].state)) != 0;
+	return hits;
+}
+
+static
+size_t scan_columns(struct tasktab* tab, uint32_t states) {
+	size_t hits = 0;
+	for (size_t i = 0; i < tab->count; i += 1)
+		hits += (states & (UINT32_C(1) << tab->state[i])) != 0;
+	return hits;
+}
+
+static
+void report(const char* name, size_t n, size_t bytes, uint64_t ns, long long misses) {
+	printf("%-8s %10.2f %10.1f", name, (double)ns/n, bytes/1048576.0);
+	if (misses >= 0) printf(" %12.4f\n", (double)misses/n);
+	else printf(" %12s\n", "-");
+}
+
+int main(int argc, char* argv[]) {
+	size_t n = argc > 1 ? strtoull(argv[1], NULL, 10) : 1000000;
+	ASSERT(n > 0, "need at least one task");
+
+	struct aostask* aos = calloc(n, sizeof(*aos));
+	ASSERT(aos != NULL, "out of memory");
+	struct tasktab tab = {0};
+	for (size_t i = 0; i < n; i += 1) {
+		struct task t = {.pidfd = -1, .cgfd = -1, .argv = 1};
+		uint32_t id = tasktab_add(&tab, &t);
+		task_setstate(&tab, tasktab_get(&tab, id), pick_state(i));
+		aos[i] = (struct aostask) {.cold = *tasktab_get(&tab, id), .state = pick_state(i), .pid = -1};
+	}
+
+	int perf = perf_open();
+	uint32_t running = UINT32_C(1) << TS_ACTIVE;
+	uint64_t best[2] = {UINT64_MAX, UINT64_MAX};
+	long long misses[2] = {-1, -1};
+	size_t found[2];
+
+	for (int round = 0; round < ROUNDS; round += 1) {
+		perf_start(perf);
+		uint64_t t0 = now_ns();
+		found[0] = scan_aos(aos, n, running);
+		uint64_t t1 = now_ns();
+		long long m = perf_stop(perf);
+		if (t1 - t0 < best[0]) {
+			best[0] = t1 - t0;
+			misses[0] = m;
+		}
+
+		perf_start(perf);
+		t0 = now_ns();
+		found[1] = scan_columns(&tab, running);
+		t1 = now_ns();
+		m = perf_stop(perf);
+		if (t1 - t0 < best[1]) {
+			best[1] = t1 - t0;
+			misses[1] = m;
+		}
+	}
+	ASSERT(found[0] == found[1] && found[1] == tab.nstate[TS_ACTIVE], "scans disagree");
+
+	printf("%zu tasks, %zu %s, best of %d rounds, struct task is %zu bytes\n\n",
+		n, found[1], state2str(TS_ACTIVE), ROUNDS, sizeof(struct task));
+	printf("%-8s %10s %10s %12s\n", "layout", "ns/task", "MB read", "misses/task");
+	report("aos", n, n*sizeof(*aos), best[0], misses[0]);
+	report("columns", n, n*sizeof(*tab.state), best[1], misses[1]);
+	return 0;
+}
@@ -7,6 +7,14 @@
 // Folder must end with forward slash /
 #define BUILD "build/"
 #define SRC "src/"
+#define BENCH "bench/"
+
+/* ./nob bench builds these from BENCH<name>.c into BUILD"bench_"<name> */
+static const char* benches[] = {
+	"spawn",
+	"tasktab",
+	"adapt",
+};
 
 int main(int argc, char** argv) {
 	NOB_GO_REBUILD_URSELF(argc, argv);
@@ -29,6 +37,25 @@ int main(int argc, char** argv) {
 	nob_cc_output(&cmd, BUILD"unqu");
 	if (!cmd_run_sync_and_reset(&cmd)) return 1;
 
+	nob_cc(&cmd);
+	nob_cc_flags(&cmd);
+	cmd_append(&cmd, "-pthread");
+	nob_cc_inputs(&cmd, SRC"unqux.c");
+	nob_cc_output(&cmd, BUILD"unqux");
+	cmd_append(&cmd, "-ldl");
+	if (!cmd_run_sync_and_reset(&cmd)) return 1;
+
+	if (argc > 0 && strcmp(argv[0], "bench") == 0) {
+		for (size_t i = 0; i < ARRAY_LEN(benches); i += 1) {
+			nob_cc(&cmd);
+			nob_cc_flags(&cmd);
+			cmd_append(&cmd, "-O2");
+			nob_cc_inputs(&cmd, temp_sprintf(BENCH"%s.c", benches[i]));
+			nob_cc_output(&cmd, temp_sprintf(BUILD"bench_%s", benches[i]));
+			if (!cmd_run_sync_and_reset(&cmd)) return 1;
+		}
+	}
+
 	nob_log(NOB_INFO, "progname = %s", progname);
 	nob_log(NOB_INFO, "done.");
 
@@ -0,0 +1,138 @@
+/*
+
+adaptive concurrency
+--------------------
+
+instead of a fixed -j, the limit on running tasks follows what the host can
+take. it's an AIMD controller run once a window:
+	- the limit goes down by a quarter if the host is saturated: the
+	  average runtime of the tasks that finished in the window inflated
+	  past twice the baseline, or pressure stall information says tasks
+	  stalled on cpu, memory or io for too much of the last 10s.
+	- otherwise it goes up by one, if it held tasks back in the window.
+	  a limit nobody runs into has no reason to grow.
+
+the baseline is the lowest average runtime seen, the runtime of tasks that
+don't compete with each other. it creeps up by 2% a window, so a workload
+whose tasks got longer isn't taken for a saturated host forever.
+
+the controller is only arithmetic, time and pressure are handed to it, so
+bench/adapt.c can run it against a simulated host.
+
+*/
+
+#pragma once
+
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#define ADAPT_WINDOW_MS  1000
+#define ADAPT_INFLATION  2.0  /* runtime over baseline that counts as saturated */
+#define ADAPT_PRESSURE   30.0 /* percent of time stalled that counts as saturated */
+#define ADAPT_DECREASE   0.75
+#define ADAPT_DRIFT      1.02
+
+struct adapt {
+	double limit;
+	double min;
+	double max;
+	uint64_t windowstart; /* ms */
+	uint32_t done; /* tasks that finished in the window */
+	double runtime; /* their total runtime, ms */
+	bool heldback; /* a task was ready while the limit was reached */
+	/* what the last window saw */
+	double rate; /* tasks finished a second */
+	double baseline; /* ms, 0 until a task finished */
+	double inflation;
+	double pressure; /* percent, negative if there's no pressure information */
+	uint64_t increases;
+	uint64_t decreases;
+};
+
+void adapt_init(struct adapt* a, double min, double max, double start, uint64_t now) {
+	*a = (struct adapt) {.min = min, .max = max, .windowstart = now, .inflation = 1, .pressure = -1};
+	a->limit = start < min ? min : start > max ? max : start;
+}
+
+/* the limit as a number of tasks */
+size_t adapt_limit(struct adapt* a) {
+	return (size_t)a->limit;
+}
+
+/* a task finished after running ms */
+void adapt_done(struct adapt* a, uint64_t ms) {
+	a->done += 1;
+	a->runtime += ms;
+}
+
+/* a ready task didn't start because of the limit */
+void adapt_heldback(struct adapt* a) {
+	a->heldback = true;
+}
+
+/* close the window if it's over and move the limit, pressure is negative if unknown */
+bool adapt_tick(struct adapt* a, uint64_t now, double pressure) {
+	if (now - a->windowstart < ADAPT_WINDOW_MS) return false;
+
+	a->rate = a->done*1000.0/(now - a->windowstart);
+	if (a->done > 0) {
+		double avg = a->runtime/a->done;
+		a->baseline = a->baseline == 0 || avg < a->baseline ? avg : a->baseline*ADAPT_DRIFT;
+		if (a->baseline > avg) a->baseline = avg;
+		a->inflation = avg/a->baseline;
+	}
+	a->pressure = pressure;
+
+	if (a->inflation > ADAPT_INFLATION || a->pressure > ADAPT_PRESSURE) {
+		a->limit *= ADAPT_DECREASE;
+		if (a->limit < a->min) a->limit = a->min;
+		a->decreases += 1;
+	} else if (a->heldback && a->limit < a->max) {
+		a->limit += 1;
+		if (a->limit > a->max) a->limit = a->max;
+		a->increases += 1;
+	}
+
+	a->windowstart = now;
+	a->done = 0;
+	a->runtime = 0;
+	a->heldback = false;
+	return true;
+}
+
+/* pressure stall information of the host, linux 4.20 */
+struct psi {
+	int fd[3]; /* cpu, memory, io, -1 where it isn't available */
+};
+
+void psi_open(struct psi* p) {
+	const char* files[] = {"/proc/pressure/cpu", "/proc/pressure/memory", "/proc/pressure/io"};
+	for (int i = 0; i < 3; i += 1)
+		p->fd[i] = open(files[i], O_RDONLY | O_CLOEXEC);
+}
+
+/* the highest "some avg10" of the resources, the percent of the last 10s some
+   task stalled on it, negative if none is available
+*/
+double psi_read(struct psi* p) {
+	double worst = -1;
+	for (int i = 0; i < 3; i += 1) {
+		char buf[256];
+		if (p->fd[i] == -1) continue;
+		ssize_t n = pread(p->fd[i], buf, sizeof(buf) - 1, 0);
+		if (n <= 0) continue;
+		buf[n] = '\0';
+		double avg10;
+		if (sscanf(buf, "some avg10=%lf", &avg10) == 1 && avg10 > worst) worst = avg10;
+	}
+	return worst;
+}
+
+void psi_close(struct psi* p) {
+	for (int i = 0; i < 3; i += 1)
+		if (p->fd[i] != -1) close(p->fd[i]);
+}
@@ -0,0 +1,91 @@
+/*
+
+declared capacity
+-----------------
+
+a task can declare the cpus and memory it needs with submit --cpus and --mem,
+and only starts while that much of the daemon's capacity is free. tasks that
+declare nothing need nothing and start as before.
+
+ready tasks are tried in the order they became ready, and the first that
+doesn't fit gets a reservation, the easy backfilling of batch schedulers:
+	- its shadow time is when enough running tasks will have ended for it
+	  to fit. a task is expected to end by its timeout, a task without one
+	  isn't expected to end.
+	- the extra capacity is what will be left at the shadow time once it
+	  started.
+a task behind it may still start, if it fits now and either ends before the
+shadow time, by its timeout, or fits in the extra capacity. so small tasks
+fill the gaps behind a big one, but never delay it.
+
+*/
+
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#define NO_END UINT64_MAX
+
+struct res {
+	uint64_t cpus; /* thousandths of a cpu */
+	uint64_t mem; /* bytes */
+};
+
+/* resources a running task gives back at end, NO_END if it isn't known */
+struct release {
+	uint64_t end;
+	struct res res;
+};
+
+struct capacity {
+	struct res total;
+	struct res used;
+	uint64_t held; /* tasks that didn't fit when they were ready */
+	uint64_t backfilled; /* tasks started behind one that didn't fit */
+};
+
+bool res_fits(struct res need, struct res free) {
+	return need.cpus <= free.cpus && need.mem <= free.mem;
+}
+
+struct res capacity_free(struct capacity* c) {
+	return (struct res) {.cpus = c->total.cpus - c->used.cpus, .mem = c->total.mem - c->used.mem};
+}
+
+void capacity_take(struct capacity* c, struct res r) {
+	c->used.cpus += r.cpus;
+	c->used.mem += r.mem;
+}
+
+void capacity_give(struct capacity* c, struct res r) {
+	c->used.cpus -= r.cpus;
+	c->used.mem -= r.mem;
+}
+
+static
+int release_cmp(const void* a, const void* b) {
+	uint64_t x = ((const struct release*)a)->end;
+	uint64_t y = ((const struct release*)b)->end;
+	return x < y ? -1 : x > y;
+}
+
+/* the shadow time of a task that needs need, and the extra capacity at it, from the
+   n running tasks in rel, which get sorted. the shadow is NO_END if the task only fits
+   once tasks without an expected end are gone
+*/
+void capacity_reserve(struct capacity* c, struct res need, struct release* rel, size_t n,
+                      uint64_t* shadow, struct res* extra) {
+	qsort(rel, n, sizeof(*rel), release_cmp);
+	struct res free = capacity_free(c);
+	*shadow = NO_END;
+	for (size_t i = 0; i < n && !res_fits(need, free); i += 1) {
+		free.cpus += rel[i].res.cpus;
+		free.mem += rel[i].res.mem;
+		*shadow = rel[i].end;
+	}
+	/* with every task gone it fits, it was checked against the total when submitted */
+	extra->cpus = free.cpus >= need.cpus ? free.cpus - need.cpus : 0;
+	extra->mem = free.mem >= need.mem ? free.mem - need.mem : 0;
+}
@@ -0,0 +1,227 @@
+/*
+
+cgroup v2 leaves for tasks
+--------------------------
+
+every task gets its own leaf cgroup under the daemon's subtree, so the whole
+process tree of a task can be killed with one write to cgroup.kill, accounted
+for through cpu.stat, memory.peak and io.stat, and limited with cpu.max and
+memory.max.
+
+the daemon's subtree is:
+	- unqud.<pid> under the root, if the daemon runs in the root cgroup
+	- the daemon's own cgroup otherwise. the daemon moves itself into a
+	  `daemon` leaf, cgroups with processes can't hand controllers down.
+
+when the hierarchy isn't there or isn't delegated to us, cg_init() fails
+and tasks run without cgroups.
+
+*/
+
+#pragma once
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "util.h"
+
+struct cgroot {
+	int fd; /* the daemon's subtree, -1 if cgroups aren't used */
+	bool owned; /* we created the subtree and remove it on exit */
+	char path[4096];
+};
+
+struct cgstats {
+	uint64_t cpu_usec;
+	uint64_t mem_peak; /* bytes, 0 without the memory controller */
+	uint64_t io_rbytes;
+	uint64_t io_wbytes;
+};
+
+/* write a string to file under dirfd, returns false and keeps errno on failure */
+bool cg_write(int dirfd, const char* file, const char* s) {
+	int fd = openat(dirfd, file, O_WRONLY | O_CLOEXEC);
+	if (fd == -1) return false;
+	ssize_t n = write(fd, s, strlen(s));
+	int saved = errno;
+	close(fd);
+	errno = saved;
+	return n == (ssize_t)strlen(s);
+}
+
+/* read file under dirfd into buf, null-terminated. returns the length or -1 */
+ssize_t cg_read(int dirfd, const char* file, char* buf, size_t sz) {
+	int fd = openat(dirfd, file, O_RDONLY | O_CLOEXEC);
+	if (fd == -1) return -1;
+	ssize_t n = read(fd, buf, sz - 1);
+	close(fd);
+	if (n == -1) return -1;
+	buf[n] = '\0';
+	return n;
+}
+
+static
+bool cg_mountpoint(char* out, size_t sz) {
+	FILE* f = fopen("/proc/self/mountinfo", "r");
+	if (f == NULL) return false;
+
+	/* <id> <parent> <dev> <root> <mount point> <options> [optional...] - <fstype> ... */
+	char line[4096];
+	bool found = false;
+	while (!found && fgets(line, sizeof(line), f) != NULL) {
+		char* sep = strstr(line, " - ");
+		if (sep == NULL || strncmp(sep + 3, "cgroup2 ", 8) != 0) continue;
+		char mnt[4096];
+		if (sscanf(line, "%*s %*s %*s %*s %4095s", mnt) != 1) continue;
+		found = (size_t)snprintf(out, sz, "%s", mnt) < sz;
+	}
+	fclose(f);
+	return found;
+}
+
+static
+bool cg_self(char* out, size_t sz) {
+	FILE* f = fopen("/proc/self/cgroup", "r");
+	if (f == NULL) return false;
+
+	char line[4096];
+	bool found = false;
+	while (!found && fgets(line, sizeof(line), f) != NULL) {
+		if (strncmp(line, "0::", 3) != 0) continue;
+		line[strcspn(line, "\n")] = '\0';
+		found = (size_t)snprintf(out, sz, "%s", line + 3) < sz;
+	}
+	fclose(f);
+	return found;
+}
+
+bool cg_init(struct cgroot* cg) {
+	char mnt[4096];
+	char self[4096];
+	char pid[32];
+
+	cg->fd = -1;
+	cg->owned = false;
+	if (!cg_mountpoint(mnt, sizeof(mnt)) || !cg_self(self, sizeof(self))) return false;
+	snprintf(pid, sizeof(pid), "%d", getpid());
+
+	if (strcmp(self, "/") == 0) {
+		if ((size_t)snprintf(cg->path, sizeof(cg->path), "%s/" UNQUD ".%s", mnt, pid) >= sizeof(cg->path))
+			return false;
+		if (mkdir(cg->path, 0755) == -1) return false;
+		cg->owned = true;
+	} else {
+		char leaf[sizeof(cg->path)];
+		if ((size_t)snprintf(cg->path, sizeof(cg->path), "%s%s", mnt, self) >= sizeof(cg->path) ||
+		    (size_t)snprintf(leaf, sizeof(leaf), "%s/daemon", cg->path) >= sizeof(leaf))
+			return false;
+		if (mkdir(leaf, 0755) == -1 && errno != EEXIST) return false;
+		int fd = open(leaf, O_DIRECTORY | O_CLOEXEC);
+		if (fd == -1) return false;
+		bool moved = cg_write(fd, "cgroup.procs", pid);
+		close(fd);
+		if (!moved) return false;
+	}
+
+	cg->fd = open(cg->path, O_DIRECTORY | O_CLOEXEC);
+	if (cg->fd == -1) return false;
+
+	/* best effort, the parent may not have handed all of them down to us */
+	static const char* controllers[] = {"+cpu", "+memory", "+io", "+pids"};
+	for (size_t i = 0; i < sizeof(controllers)/sizeof(controllers[0]); i += 1)
+		cg_write(cg->fd, "cgroup.subtree_control", controllers[i]);
+	return true;
+}
+
+void cg_fini(struct cgroot* cg) {
+	if (cg->fd == -1) return;
+	close(cg->fd);
+	cg->fd = -1;
+	if (cg->owned) rmdir(cg->path);
+}
+
+static
+void cg_name(char* out, size_t sz, uint32_t id) {
+	snprintf(out, sz, "task-%u", id);
+}
+
+/* create the leaf for task id with the given limits, 0 for none.
+   returns the leaf's dirfd or -1, in which case the task runs without a cgroup
+*/
+int cg_create(struct cgroot* cg, uint32_t id, uint32_t millicpus, uint64_t memmax) {
+	if (cg->fd == -1) return -1;
+
+	char name[32];
+	cg_name(name, sizeof(name), id);
+	if (mkdirat(cg->fd, name, 0755) == -1 && errno != EEXIST) {
+		logerr("cgroup %s: %s", name, strerror(errno));
+		return -1;
+	}
+	int fd = openat(cg->fd, name, O_DIRECTORY | O_CLOEXEC);
+	if (fd == -1) return -1;
+
+	char buf[64];
+	if (millicpus > 0) {
+		/* quota per 100ms period */
+		snprintf(buf, sizeof(buf), "%llu 100000", (unsigned long long)millicpus*100);
+		if (!cg_write(fd, "cpu.max", buf))
+			logerr("cgroup %s: cpu.max: %s", name, strerror(errno));
+	}
+	if (memmax > 0) {
+		snprintf(buf, sizeof(buf), "%llu", (unsigned long long)memmax);
+		if (!cg_write(fd, "memory.max", buf))
+			logerr("cgroup %s: memory.max: %s", name, strerror(errno));
+	}
+	return fd;
+}
+
+/* kill every process in the leaf at once, needs linux 5.14 */
+bool cg_kill(int fd) {
+	return cg_write(fd, "cgroup.kill", "1");
+}
+
+/* value of key in "key value" (cpu.stat) or "key=value" (io.stat) lists */
+static
+uint64_t cg_field(const char* buf, const char* key) {
+	size_t len = strlen(key);
+	for (const char* p = buf; (p = strstr(p, key)) != NULL; p += len) {
+		bool atstart = p == buf || p[-1] == '\n' || p[-1] == ' ';
+		if (atstart && (p[len] == ' ' || p[len] == '='))
+			return strtoull(p + len + 1, NULL, 10);
+	}
+	return 0;
+}
+
+void cg_stats(int fd, struct cgstats* st) {
+	char buf[4096];
+	*st = (struct cgstats) {0};
+
+	if (cg_read(fd, "cpu.stat", buf, sizeof(buf)) > 0)
+		st->cpu_usec = cg_field(buf, "usage_usec");
+	if (cg_read(fd, "memory.peak", buf, sizeof(buf)) > 0)
+		st->mem_peak = strtoull(buf, NULL, 10);
+
+	/* one line per device: <maj:min> rbytes=N wbytes=N ... */
+	if (cg_read(fd, "io.stat", buf, sizeof(buf)) > 0) {
+		for (char* line = buf; *line != '\0';) {
+			char* nl = strchr(line, '\n');
+			if (nl != NULL) *nl = '\0';
+			st->io_rbytes += cg_field(line, "rbytes");
+			st->io_wbytes += cg_field(line, "wbytes");
+			if (nl == NULL) break;
+			line = nl + 1;
+		}
+	}
+}
+
+/* remove the leaf for task id, fails with EBUSY while it still has processes */
+bool cg_remove(struct cgroot* cg, uint32_t id) {
+	char name[32];
+	cg_name(name, sizeof(name), id);
+	return unlinkat(cg->fd, name, AT_REMOVEDIR) == 0 || errno == ENOENT;
+}
@@ -0,0 +1,175 @@
+/*
+
+resolved executable cache
+-------------------------
+
+execvp(3) searches PATH on every spawn, calling execve on each directory in
+turn until one doesn't fail with ENOENT. instead the daemon resolves a command
+name once, and the task's process execs the resolved path directly.
+
+tasks have working directories of their own, so PATH with a relative
+directory in it is never cached.
+
+names that aren't on PATH are cached as well. inotify watches every directory
+on PATH, and a cached name is dropped when an entry of that name is created,
+removed, renamed or has its mode changed in any of them, so a new binary
+earlier on PATH shadows the cached one just like it would with execvp. names
+with a slash in them aren't searched for and aren't cached.
+
+directories on PATH that don't exist when the daemon starts aren't watched,
+binaries that show up in them later aren't seen until the cached name is
+dropped for another reason.
+
+*/
+
+#pragma once
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "strmap.h"
+#include "util.h"
+
+struct execent {
+	char* name;
+	char* path; /* NULL if name isn't on PATH */
+};
+
+struct execcache {
+	int fd; /* inotify, -1 if there's none and nothing is cached */
+	char* pathvar; /* copy of PATH, split in place into dirs */
+	char** dirs;
+	size_t ndirs;
+	struct strmap names; /* name -> struct execent* */
+	uint64_t hits;
+	uint64_t misses;
+};
+
+#define EXECCACHE_EVENTS (IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_ATTRIB | \
+	IN_DELETE_SELF | IN_MOVE_SELF | IN_ONLYDIR)
+
+bool execcache_init(struct execcache* ec) {
+	*ec = (struct execcache) {.fd = -1};
+
+	/* the same default as execvp */
+	const char* path = getenv("PATH");
+	if (path == NULL) path = "/bin:/usr/bin";
+
+	for (const char* dir = path;; dir += 1) {
+		if (*dir != '/') {
+			loginfo("PATH has relative directories, it is searched on every spawn");
+			return true;
+		}
+		dir = strchr(dir, ':');
+		if (dir == NULL) break;
+	}
+
+	ec->fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if (ec->fd == -1) return false;
+
+	ec->pathvar = strdup(path);
+	ASSERT(ec->pathvar != NULL, "out of memory");
+	size_t n = 1;
+	for (const char* p = path; *p != '\0'; p += 1) n += *p == ':';
+	ec->dirs = malloc(n * sizeof(*ec->dirs));
+	ASSERT(ec->dirs != NULL, "out of memory");
+
+	for (char* dir = ec->pathvar;;) {
+		char* colon = strchr(dir, ':');
+		if (colon != NULL) *colon = '\0';
+		ec->dirs[ec->ndirs++] = dir;
+		if (inotify_add_watch(ec->fd, ec->dirs[ec->ndirs - 1], EXECCACHE_EVENTS) == -1 && errno != ENOENT)
+			logerr("PATH: watch %s: %s", ec->dirs[ec->ndirs - 1], strerror(errno));
+		if (colon == NULL) break;
+		dir = colon + 1;
+	}
+	return true;
+}
+
+static
+void execent_free(struct execent* e) {
+	free(e->name);
+	free(e->path);
+	free(e);
+}
+
+void execcache_flush(struct execcache* ec) {
+	strmap_foreach(&ec->names, s) execent_free(s->val);
+	free(ec->names.slots);
+	ec->names = (struct strmap) {0};
+}
+
+void execcache_fini(struct execcache* ec) {
+	if (ec->fd == -1) return;
+	execcache_flush(ec);
+	close(ec->fd);
+	free(ec->dirs);
+	free(ec->pathvar);
+	ec->fd = -1;
+}
+
+/* the same search execvp does, the result is malloc'ed */
+static
+char* execcache_search(struct execcache* ec, const char* name) {
+	struct stat st;
+	for (size_t i = 0; i < ec->ndirs; i += 1) {
+		size_t len = strlen(ec->dirs[i]) + 1 + strlen(name) + 1;
+		char* path = malloc(len);
+		ASSERT(path != NULL, "out of memory");
+		snprintf(path, len, "%s/%s", ec->dirs[i], name);
+		if (stat(path, &st) == 0 && S_ISREG(st.st_mode) && access(path, X_OK) == 0)
+			return path;
+		free(path);
+	}
+	return NULL;
+}
+
+/* path to exec for the command name, NULL if the task should fall back to execvp */
+const char* execcache_resolve(struct execcache* ec, const char* name) {
+	if (ec->fd == -1 || *name == '\0' || strchr(name, '/') != NULL) return NULL;
+
+	struct execent* e = strmap_get(&ec->names, name);
+	if (e != NULL) {
+		ec->hits += 1;
+		return e->path;
+	}
+	ec->misses += 1;
+
+	e = malloc(sizeof(*e));
+	ASSERT(e != NULL, "out of memory");
+	e->name = strdup(name);
+	ASSERT(e->name != NULL, "out of memory");
+	e->path = execcache_search(ec, name);
+	strmap_put(&ec->names, e->name, e);
+	return e->path;
+}
+
+/* drop the names that changed on PATH, call when fd is readable */
+void execcache_update(struct execcache* ec) {
+	char buf[4096] attr(aligned(__alignof__(struct inotify_event)));
+	for (;;) {
+		ssize_t n = read(ec->fd, buf, sizeof(buf));
+		if (n == -1 && errno == EINTR) continue;
+		if (n <= 0) return;
+
+		for (char* p = buf; p < buf + n;) {
+			struct inotify_event* ev = (struct inotify_event*)p;
+			p += sizeof(*ev) + ev->len;
+
+			/* missed events, or a whole directory went away */
+			if ((ev->mask & (IN_Q_OVERFLOW | IN_DELETE_SELF | IN_MOVE_SELF | IN_IGNORED)) != 0) {
+				execcache_flush(ec);
+				continue;
+			}
+			if (ev->len == 0) continue;
+			struct execent* e = strmap_del(&ec->names, ev->name);
+			if (e != NULL) execent_free(e);
+		}
+	}
+}
@@ -0,0 +1,163 @@
+/*
+
+interned strings
+----------------
+
+the strings of tasks, argv, environment, working directory and queue, are
+copied into an arena once and shared by every task that uses them. a task
+holds 4 byte handles instead of pointers.
+
+an interned string is any run of bytes. argv and the environment are vectors:
+their strings are interned one by one, and the vector is interned as the array
+of their handles. so 100k tasks submitted with the same environment share one
+copy of it, and argvs that differ still share the strings they have in common.
+
+tasks are never removed, and neither are their strings.
+
+*/
+
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "strmap.h"
+#include "util.h"
+
+typedef uint32_t istr; /* handle of an interned string, 0 for none */
+
+#define ARENA_CHUNK (64*1024)
+
+struct arenachunk {
+	struct arenachunk* next;
+	size_t used;
+	size_t size;
+	char data[];
+};
+
+struct arena {
+	struct arenachunk* head;
+	size_t bytes; /* allocated from the system, chunk headers included */
+};
+
+/* n bytes aligned to 8, never freed */
+void* arena_alloc(struct arena* a, size_t n) {
+	n = (n + 7) & ~(size_t)7;
+	struct arenachunk* c = a->head;
+	if (c == NULL || c->size - c->used < n) {
+		/* big allocations get a chunk of their own, behind the current one */
+		size_t size = n > ARENA_CHUNK/4 ? n : ARENA_CHUNK;
+		c = malloc(sizeof(*c) + size);
+		ASSERT(c != NULL, "out of memory");
+		c->used = 0;
+		c->size = size;
+		a->bytes += sizeof(*c) + size;
+		if (a->head != NULL && size != ARENA_CHUNK) {
+			c->next = a->head->next;
+			a->head->next = c;
+		} else {
+			c->next = a->head;
+			a->head = c;
+		}
+	}
+	void* p = c->data + c->used;
+	c->used += n;
+	return p;
+}
+
+struct strtab {
+	struct arena arena;
+	struct strmap index; /* bytes -> handle */
+	struct {
+		const char** items; /* handle - 1 -> bytes, the length is the uint32_t before them */
+		size_t count;
+		size_t capacity;
+	} strs;
+	uint64_t requested; /* bytes asked to be interned, what they'd take without sharing */
+};
+
+/* intern len bytes, they're null-terminated in the table */
+istr intern(struct strtab* tab, const char* s, size_t len) {
+	ASSERT(len < UINT32_MAX, "string too long to intern");
+	tab->requested += len + 1;
+
+	void* h = strmap_getn(&tab->index, s, len);
+	if (h != NULL) return (istr)(uintptr_t)h;
+
+	char* p = arena_alloc(&tab->arena, sizeof(uint32_t) + len + 1);
+	uint32_t len32 = (uint32_t)len;
+	memcpy(p, &len32, sizeof(len32));
+	p += sizeof(len32);
+	memcpy(p, s, len);
+	p[len] = '\0';
+
+	da_append(&tab->strs, p);
+	ASSERT(tab->strs.count < UINT32_MAX, "ran out of string handles");
+	strmap_putn(&tab->index, p, len, (void*)(uintptr_t)tab->strs.count);
+	return (istr)tab->strs.count;
+}
+
+istr intern_str(struct strtab* tab, const char* s) {
+	return intern(tab, s, strlen(s));
+}
+
+/* the interned bytes, NULL for handle 0 */
+const char* istr_get(struct strtab* tab, istr h) {
+	ASSERT(h <= tab->strs.count, "bad string handle");
+	return h == 0 ? NULL : tab->strs.items[h - 1];
+}
+
+uint32_t istr_len(struct strtab* tab, istr h) {
+	if (h == 0) return 0;
+	uint32_t len;
+	memcpy(&len, istr_get(tab, h) - sizeof(len), sizeof(len));
+	return len;
+}
+
+/* intern n null-terminated strings laid out one after the other, and the vector of them */
+istr intern_vec(struct strtab* tab, const char* block, uint32_t n) {
+	istr* items = malloc((n + 1)*sizeof(*items));
+	ASSERT(items != NULL, "out of memory");
+	for (uint32_t i = 0; i < n; i += 1) {
+		size_t len = strlen(block);
+		items[i] = intern(tab, block, len);
+		block += len + 1;
+	}
+	istr v = intern(tab, (const char*)items, n*sizeof(*items));
+	free(items);
+	return v;
+}
+
+/* intern the n strings of v, and the vector of them */
+istr intern_strv(struct strtab* tab, char* const* v, uint32_t n) {
+	istr* items = malloc((n + 1)*sizeof(*items));
+	ASSERT(items != NULL, "out of memory");
+	for (uint32_t i = 0; i < n; i += 1) items[i] = intern_str(tab, v[i]);
+	istr h = intern(tab, (const char*)items, n*sizeof(*items));
+	free(items);
+	return h;
+}
+
+uint32_t ivec_len(struct strtab* tab, istr v) {
+	return istr_len(tab, v) / sizeof(istr);
+}
+
+/* the handle of the string at index i of vector v */
+istr ivec_at(struct strtab* tab, istr v, uint32_t i) {
+	istr h;
+	ASSERT(i < ivec_len(tab, v), "vector index out of range");
+	memcpy(&h, istr_get(tab, v) + i*sizeof(h), sizeof(h));
+	return h;
+}
+
+/* the string at index i of vector v */
+const char* ivec_get(struct strtab* tab, istr v, uint32_t i) {
+	return istr_get(tab, ivec_at(tab, v, i));
+}
+
+/* bytes the table takes, arena, index and handles */
+size_t strtab_bytes(struct strtab* tab) {
+	return tab->arena.bytes + tab->index.capacity*sizeof(struct strslot) +
+		tab->strs.capacity*sizeof(*tab->strs.items);
+}
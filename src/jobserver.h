@@ -0,0 +1,134 @@
+/*
+
+jobserver
+---------
+
+with -J n the daemon is the gnu make jobserver of every task: it makes a
+named fifo with n tokens in it, one byte each. tasks inherit a read and a
+write end of it and run with
+
+	MAKEFLAGS=... -jn --jobserver-auth=<read fd>,<write fd>
+
+so a make -j a task runs reads a token from the fifo before it starts a job
+beyond its first one, and writes it back when the job is done. the daemon takes a token from the same fifo for each task it starts and
+gives it back when the task exits. so the tasks and the jobs of the builds
+they run together never run more than n at once, however deeply parallel
+builds are nested.
+
+tokens in the fifo are free, the rest are held by tasks or their jobs. a
+job killed while it held a token never gives it back, so whenever no task
+runs the fifo is topped up to n again.
+
+make understands the auth since 4.2. the ends are inherited rather than the
+fifo named with fifo:<path>, which only make 4.4 and ninja 1.13 read and which
+older makes take for a fatal error.
+
+*/
+
+#pragma once
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "util.h"
+
+#define JOBSERVER_MAX_TOKENS 4096 /* a fifo holds 64k, this is plenty */
+
+struct jobserver {
+	int fd; /* both ends of the fifo, -1 without a jobserver */
+	int ends[2]; /* the read and the write end tasks inherit, close on exec in the daemon */
+	char* path;
+	size_t tokens;
+	size_t held; /* tokens taken by tasks the daemon started */
+	uint64_t missed; /* tasks that started without a token, the jobs had them all */
+};
+
+static
+bool jobserver_put(struct jobserver* js, size_t n) {
+	char buf[256];
+	memset(buf, '+', sizeof(buf));
+	while (n > 0) {
+		ssize_t wn = write(js->fd, buf, n < sizeof(buf) ? n : sizeof(buf));
+		if (wn == -1 && errno == EINTR) continue;
+		if (wn <= 0) return false;
+		n -= wn;
+	}
+	return true;
+}
+
+/* make the fifo at path with n tokens, false if it can't be made */
+bool jobserver_init(struct jobserver* js, const char* path, size_t n) {
+	*js = (struct jobserver) {.fd = -1, .ends = {-1, -1}, .tokens = n};
+	unlink(path);
+	if (mkfifo(path, 0600) == -1) return false;
+	/* opened for writing too, so it never reads as closed and never blocks the open.
+	   the tasks get ends of their own, a make that sets its end blocking doesn't make
+	   the daemon's block
+	*/
+	js->fd = open(path, O_RDWR | O_NONBLOCK | O_CLOEXEC);
+	if (js->fd != -1) js->ends[0] = open(path, O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+	if (js->fd != -1) js->ends[1] = open(path, O_WRONLY | O_CLOEXEC);
+	if (js->ends[0] == -1 || js->ends[1] == -1 || !jobserver_put(js, n)) {
+		int err = errno;
+		for (int i = 0; i < 2; i += 1)
+			if (js->ends[i] != -1) close(js->ends[i]);
+		if (js->fd != -1) close(js->fd);
+		js->fd = -1;
+		unlink(path);
+		errno = err;
+		return false;
+	}
+	js->path = strdup(path);
+	ASSERT(js->path != NULL, "out of memory");
+	return true;
+}
+
+/* tokens in the fifo now */
+size_t jobserver_free(struct jobserver* js) {
+	int n = 0;
+	if (js->fd == -1 || ioctl(js->fd, FIONREAD, &n) == -1 || n < 0) return 0;
+	return (size_t)n;
+}
+
+/* take a token for a task, false if the jobs took the last one first */
+bool jobserver_take(struct jobserver* js) {
+	char c;
+	ssize_t rn;
+	while ((rn = read(js->fd, &c, 1)) == -1 && errno == EINTR)
+		;
+	if (rn != 1) {
+		js->missed += 1;
+		return false;
+	}
+	js->held += 1;
+	return true;
+}
+
+/* give back the token of a task */
+void jobserver_give(struct jobserver* js) {
+	js->held -= 1;
+	if (!jobserver_put(js, 1)) perror("jobserver");
+}
+
+/* with no task running nobody holds a token, put back the ones jobs lost */
+void jobserver_refill(struct jobserver* js) {
+	size_t free = jobserver_free(js);
+	if (js->held > 0 || free >= js->tokens) return;
+	if (!jobserver_put(js, js->tokens - free)) perror("jobserver");
+}
+
+void jobserver_close(struct jobserver* js) {
+	if (js->fd == -1) return;
+	close(js->ends[0]);
+	close(js->ends[1]);
+	close(js->fd);
+	unlink(js->path);
+	js->fd = -1;
+}
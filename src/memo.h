@@ -0,0 +1,318 @@
+/*
+
+memoized results
+----------------
+
+a task submitted with --memo is declared deterministic: the same argv,
+environment, working directory and input files always give the same output.
+its key is a hash of all of those, taken when the task is about to run, so
+inputs written by its dependencies are seen. inputs are hashed by size and
+mtime, or by their contents if the task asks for it. the hash is two 64 bit
+lanes, good against accidents, not against someone crafting collisions.
+
+the cache is a directory the daemon owns:
+	<key>.out, <key>.err  captured stdout and stderr of a run that exited 0
+	index                 a line per entry, <key> <bytes> <last use>
+	run.<id>.out, .err    output of a memoized task while it runs
+
+a memoized task writes its output there instead of to the daemon's stdout and
+stderr, and the output is copied to those when it exits. a hit copies the
+cached output the same way and the task exits 0 without running.
+
+entries are evicted least recently used first, to keep the cache under its
+budget. they're kept on a list in the order of their last use, so an eviction
+takes the head. the index isn't written as entries are added, hit or evicted,
+it's rewritten when the daemon syncs the cache now and then and when the cache
+is closed. entries added since the last sync are lost if the daemon dies.
+
+*/
+
+#pragma once
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "strmap.h"
+#include "util.h"
+#include "wheel.h"
+
+#define MEMO_KEYLEN 32 /* hex digits */
+
+struct memohash {
+	uint64_t a;
+	uint64_t b;
+};
+
+void memohash_init(struct memohash* h) {
+	h->a = 14695981039346656037ULL;
+	h->b = 0x9e3779b97f4a7c15ULL;
+}
+
+void memohash_update(struct memohash* h, const void* p, size_t n) {
+	const unsigned char* s = p;
+	for (size_t i = 0; i < n; i += 1) {
+		h->a = (h->a ^ s[i]) * 1099511628211ULL;
+		h->b = (h->b + s[i]) * 0xbf58476d1ce4e5b9ULL;
+		h->b ^= h->b >> 29;
+	}
+}
+
+/* strings are hashed with their length, so a list of them has one hash */
+void memohash_str(struct memohash* h, const char* s) {
+	uint64_t len = s != NULL ? strlen(s) : UINT64_MAX;
+	memohash_update(h, &len, sizeof(len));
+	if (s != NULL) memohash_update(h, s, len);
+}
+
+void memohash_hex(struct memohash* h, char key[MEMO_KEYLEN + 1]) {
+	snprintf(key, MEMO_KEYLEN + 1, "%016llx%016llx", (unsigned long long)h->a, (unsigned long long)h->b);
+}
+
+struct memoent {
+	struct tlist link; /* must be first, on the lru list of the cache */
+	char key[MEMO_KEYLEN + 1];
+	uint64_t bytes; /* of the captured output */
+	uint64_t used; /* sequence number of the last use */
+};
+
+struct memocache {
+	const char* dirname; /* as configured, opened on first use */
+	char* dir; /* absolute, NULL until opened */
+	int dirfd; /* -1 until opened */
+	bool failed; /* couldn't be opened, tasks run without it */
+	struct tlist lru; /* of the entries, least recently used first */
+	size_t count; /* entries */
+	struct strmap index; /* key -> struct memoent* */
+	uint64_t bytes;
+	uint64_t budget;
+	uint64_t seq;
+	bool dirty; /* the index on disk is stale */
+	uint64_t hits;
+	uint64_t misses;
+	uint64_t evicted;
+};
+
+void memo_init(struct memocache* mc, const char* dir, uint64_t budget) {
+	*mc = (struct memocache) {.dirname = dir, .dirfd = -1, .budget = budget};
+	tlist_init(&mc->lru);
+}
+
+/* e was just used, it goes to the tail of the lru list */
+static
+void memo_touch(struct memocache* mc, struct memoent* e) {
+	tlist_remove(&e->link);
+	tlist_append(&mc->lru, &e->link);
+}
+
+static
+void memo_add(struct memocache* mc, const char* key, uint64_t bytes, uint64_t used) {
+	struct memoent* e = strmap_getn(&mc->index, key, MEMO_KEYLEN);
+	if (e == NULL) {
+		e = malloc(sizeof(*e));
+		ASSERT(e != NULL, "out of memory");
+		memcpy(e->key, key, MEMO_KEYLEN + 1);
+		e->bytes = 0;
+		tlist_init(&e->link);
+		mc->count += 1;
+		strmap_putn(&mc->index, e->key, MEMO_KEYLEN, e);
+	}
+	mc->bytes = mc->bytes - e->bytes + bytes;
+	e->bytes = bytes;
+	e->used = used;
+	if (used > mc->seq) mc->seq = used;
+	memo_touch(mc, e);
+}
+
+static
+void memo_unlink(struct memocache* mc, const char* key) {
+	char name[MEMO_KEYLEN + 8];
+	snprintf(name, sizeof(name), "%s.out", key);
+	unlinkat(mc->dirfd, name, 0);
+	snprintf(name, sizeof(name), "%s.err", key);
+	unlinkat(mc->dirfd, name, 0);
+}
+
+/* write the index to a new file and move it over the old one */
+static
+bool memo_writeindex(struct memocache* mc) {
+	int fd = openat(mc->dirfd, "index.tmp", O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (fd == -1) return false;
+	FILE* f = fdopen(fd, "w");
+	if (f == NULL) {
+		close(fd);
+		return false;
+	}
+	for (struct tlist* l = mc->lru.next; l != &mc->lru; l = l->next) {
+		struct memoent* e = (struct memoent*)l;
+		fprintf(f, "%s %llu %llu\n", e->key, (unsigned long long)e->bytes, (unsigned long long)e->used);
+	}
+	bool ok = fflush(f) == 0 && !ferror(f);
+	fclose(f);
+	if (!ok || renameat(mc->dirfd, "index.tmp", mc->dirfd, "index") == -1) return false;
+	mc->dirty = false;
+	return true;
+}
+
+/* drop the least recently used entries until the cache fits its budget */
+static
+void memo_evict(struct memocache* mc) {
+	while (mc->bytes > mc->budget && !tlist_empty(&mc->lru)) {
+		struct memoent* e = (struct memoent*)mc->lru.next;
+		memo_unlink(mc, e->key);
+		strmap_deln(&mc->index, e->key, MEMO_KEYLEN);
+		tlist_remove(&e->link);
+		mc->count -= 1;
+		mc->bytes -= e->bytes;
+		mc->evicted += 1;
+		mc->dirty = true;
+		free(e);
+	}
+}
+
+static
+int memo_cmpused(const void* a, const void* b) {
+	uint64_t x = (*(struct memoent* const*)a)->used, y = (*(struct memoent* const*)b)->used;
+	return (x > y) - (x < y);
+}
+
+/* put the lru list in the order of the use times, the index is written in that order
+   but one written by hand or by an older daemon may not be
+*/
+static
+void memo_sortlru(struct memocache* mc) {
+	if (mc->count < 2) return;
+	struct memoent** ents = malloc(mc->count*sizeof(*ents));
+	ASSERT(ents != NULL, "out of memory");
+	size_t n = 0;
+	for (struct tlist* l = mc->lru.next; l != &mc->lru; l = l->next) ents[n++] = (struct memoent*)l;
+	qsort(ents, n, sizeof(*ents), memo_cmpused);
+	tlist_init(&mc->lru);
+	for (size_t i = 0; i < n; i += 1) tlist_append(&mc->lru, &ents[i]->link);
+	free(ents);
+}
+
+/* open the directory and load its index, only the first call does anything */
+bool memo_open(struct memocache* mc) {
+	if (mc->dir != NULL) return true;
+	if (mc->failed) return false;
+
+	if (mkdir(mc->dirname, 0755) == -1 && errno != EEXIST) goto fail;
+	/* tasks have working directories of their own, their output paths must be absolute */
+	mc->dir = realpath(mc->dirname, NULL);
+	if (mc->dir == NULL) goto fail;
+	mc->dirfd = open(mc->dir, O_DIRECTORY | O_CLOEXEC);
+	if (mc->dirfd == -1) goto fail;
+
+	int fd = openat(mc->dirfd, "index", O_RDONLY | O_CLOEXEC);
+	FILE* f = fd != -1 ? fdopen(fd, "r") : NULL;
+	if (f != NULL) {
+		char key[MEMO_KEYLEN + 1], name[MEMO_KEYLEN + 8];
+		unsigned long long bytes, used;
+		while (fscanf(f, "%32s %llu %llu", key, &bytes, &used) == 3) {
+			/* an entry whose output is gone was never complete */
+			snprintf(name, sizeof(name), "%s.out", key);
+			if (strlen(key) != MEMO_KEYLEN || faccessat(mc->dirfd, name, F_OK, 0) == -1) continue;
+			memo_add(mc, key, bytes, used);
+		}
+		fclose(f);
+	} else if (fd != -1) {
+		close(fd);
+	}
+	memo_sortlru(mc);
+	memo_evict(mc);
+	loginfo("memo cache %s, %zu entries, %llu bytes", mc->dir, mc->count, (unsigned long long)mc->bytes);
+	return true;
+fail:
+	logerr("memo cache %s: %s", mc->dirname, strerror(errno));
+	free(mc->dir);
+	mc->dir = NULL;
+	mc->failed = true;
+	return false;
+}
+
+/* the entry for key, NULL on a miss. a hit is its most recent use */
+struct memoent* memo_get(struct memocache* mc, const char* key) {
+	struct memoent* e = strmap_getn(&mc->index, key, MEMO_KEYLEN);
+	if (e == NULL) {
+		mc->misses += 1;
+		return NULL;
+	}
+	mc->hits += 1;
+	mc->seq += 1;
+	e->used = mc->seq;
+	memo_touch(mc, e);
+	mc->dirty = true;
+	return e;
+}
+
+/* absolute path of the output file ext, "out" or "err", of the running task id */
+void memo_runpath(struct memocache* mc, uint32_t id, const char* ext, char* buf, size_t size) {
+	snprintf(buf, size, "%s/run.%u.%s", mc->dir, id, ext);
+}
+
+/* keep the output of task id, which succeeded, as the entry for key */
+void memo_put(struct memocache* mc, const char* key, uint32_t id) {
+	char from[32], to[MEMO_KEYLEN + 8];
+	uint64_t bytes = 0;
+	const char* exts[] = {"out", "err"};
+	for (size_t i = 0; i < 2; i += 1) {
+		snprintf(from, sizeof(from), "run.%u.%s", id, exts[i]);
+		snprintf(to, sizeof(to), "%s.%s", key, exts[i]);
+		struct stat st;
+		if (fstatat(mc->dirfd, from, &st, 0) == -1 || renameat(mc->dirfd, from, mc->dirfd, to) == -1) {
+			logerr("memo cache %s: %s", from, strerror(errno));
+			return;
+		}
+		bytes += st.st_size;
+	}
+	mc->seq += 1;
+	memo_add(mc, key, bytes, mc->seq);
+	mc->dirty = true;
+	memo_evict(mc);
+}
+
+/* remove the output of task id, which didn't succeed */
+void memo_discard(struct memocache* mc, uint32_t id) {
+	char name[32];
+	snprintf(name, sizeof(name), "run.%u.out", id);
+	unlinkat(mc->dirfd, name, 0);
+	snprintf(name, sizeof(name), "run.%u.err", id);
+	unlinkat(mc->dirfd, name, 0);
+}
+
+/* copy the file name in the cache to fd */
+void memo_copy(struct memocache* mc, const char* name, int fd) {
+	int in = openat(mc->dirfd, name, O_RDONLY | O_CLOEXEC);
+	if (in == -1) return;
+	char buf[64*1024];
+	ssize_t n;
+	while ((n = read(in, buf, sizeof(buf))) > 0) {
+		for (ssize_t off = 0; off < n;) {
+			ssize_t w = write(fd, buf + off, n - off);
+			if (w == -1 && errno == EINTR) continue;
+			if (w == -1) goto done;
+			off += w;
+		}
+	}
+done:
+	close(in);
+}
+
+/* write the index if it changed since it was last written */
+void memo_sync(struct memocache* mc) {
+	if (mc->dir == NULL || !mc->dirty) return;
+	if (!memo_writeindex(mc)) logerr("memo cache index: %s", strerror(errno));
+}
+
+void memo_fini(struct memocache* mc) {
+	if (mc->dir == NULL) return;
+	memo_sync(mc);
+	close(mc->dirfd);
+	free(mc->dir);
+}
@@ -0,0 +1,73 @@
+/*
+
+task plugins
+------------
+
+a plugin is a shared object that exports the entry point of a task:
+
+	int unqu_task(int argc, char** argv);
+
+unqux loads it with dlopen(3) under a name, and runs a task whose command
+is that name by calling the entry point with its argv, on a thread of its
+pool. the return value is the exit code of the task, masked to 8 bits like
+exit(3)'s. the entry point is called from many threads at once and must be
+safe to.
+
+*/
+
+#pragma once
+
+#include <dlfcn.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+#include "util.h"
+
+#define PLUGIN_ENTRY "unqu_task"
+
+typedef int (*plugin_entry)(int argc, char** argv);
+
+struct plugin {
+	const char* name;
+	void* handle;
+	plugin_entry entry;
+};
+
+struct plugins {
+	struct plugin* items;
+	size_t count;
+	size_t capacity;
+};
+
+/* load the plugin at path as name, false with the reason in err if it can't be */
+bool plugins_add(struct plugins* ps, const char* name, const char* path, char* err, size_t errlen) {
+	for (size_t i = 0; i < ps->count; i += 1) {
+		if (strcmp(ps->items[i].name, name) == 0) {
+			snprintf(err, errlen, "there's a plugin called %s already", name);
+			return false;
+		}
+	}
+	/* now, so a plugin that can't be linked fails at startup and not on its first task */
+	void* h = dlopen(path, RTLD_NOW | RTLD_LOCAL);
+	if (h == NULL) {
+		snprintf(err, errlen, "%s", dlerror());
+		return false;
+	}
+	/* the pointer conversion is POSIX's, not C's */
+	plugin_entry entry;
+	*(void**)&entry = dlsym(h, PLUGIN_ENTRY);
+	if (entry == NULL) {
+		snprintf(err, errlen, "%s doesn't export " PLUGIN_ENTRY, path);
+		dlclose(h);
+		return false;
+	}
+	da_append(ps, ((struct plugin) {.name = name, .handle = h, .entry = entry}));
+	return true;
+}
+
+/* the entry point of the plugin called name, NULL if there's none */
+plugin_entry plugins_find(struct plugins* ps, const char* name) {
+	for (size_t i = 0; i < ps->count; i += 1)
+		if (strcmp(ps->items[i].name, name) == 0) return ps->items[i].entry;
+	return NULL;
+}
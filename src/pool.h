@@ -0,0 +1,152 @@
+/*
+
+work-stealing thread pool
+-------------------------
+
+a fixed number of threads, each with a deque of jobs of its own. jobs are
+handed out round-robin, onto the bottom of the deques. a thread takes the
+newest job from the bottom of its own deque, and once that is empty steals
+the oldest one from the top of another's, so a thread stuck on a long job
+doesn't keep the jobs queued behind it from the idle ones.
+
+each deque has a lock of its own, a thread and a thief only contend for the
+same deque. one more lock and a condition variable count the jobs that
+weren't taken yet, threads sleep on it while there are none. the threads
+live as long as the process.
+
+*/
+
+#pragma once
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include "util.h"
+
+typedef void (*pool_run)(void* job, void* ctx);
+
+struct pooldeque {
+	pthread_mutex_t mu;
+	void** items; /* ring, top at head */
+	size_t head;
+	size_t count;
+	size_t capacity;
+};
+
+struct pool {
+	size_t nthreads;
+	pthread_t* threads;
+	struct pooldeque* deques; /* one per thread */
+	pool_run run;
+	void* ctx;
+	pthread_mutex_t mu;
+	pthread_cond_t cv;
+	size_t pending; /* jobs on the deques that no thread claimed yet */
+	size_t next; /* deque the next job goes to */
+};
+
+struct poolthread {
+	struct pool* p;
+	size_t i;
+};
+
+static
+void pooldeque_push(struct pooldeque* d, void* job) {
+	pthread_mutex_lock(&d->mu);
+	if (d->count == d->capacity) {
+		size_t cap = d->capacity == 0 ? DA_INIT_CAP : d->capacity*2;
+		void** items = malloc(cap*sizeof(*items));
+		ASSERT(items != NULL, "out of memory");
+		for (size_t i = 0; i < d->count; i += 1)
+			items[i] = d->items[(d->head + i) % d->capacity];
+		free(d->items);
+		d->items = items;
+		d->head = 0;
+		d->capacity = cap;
+	}
+	d->items[(d->head + d->count) % d->capacity] = job;
+	d->count += 1;
+	pthread_mutex_unlock(&d->mu);
+}
+
+/* the newest job, for the thread that owns the deque */
+static
+void* pooldeque_pop(struct pooldeque* d) {
+	void* job = NULL;
+	pthread_mutex_lock(&d->mu);
+	if (d->count > 0) {
+		d->count -= 1;
+		job = d->items[(d->head + d->count) % d->capacity];
+	}
+	pthread_mutex_unlock(&d->mu);
+	return job;
+}
+
+/* the oldest job, for a thief */
+static
+void* pooldeque_steal(struct pooldeque* d) {
+	void* job = NULL;
+	pthread_mutex_lock(&d->mu);
+	if (d->count > 0) {
+		job = d->items[d->head];
+		d->head = (d->head + 1) % d->capacity;
+		d->count -= 1;
+	}
+	pthread_mutex_unlock(&d->mu);
+	return job;
+}
+
+static
+void* pool_thread(void* arg) {
+	struct poolthread* t = arg;
+	struct pool* p = t->p;
+	size_t self = t->i;
+	free(t);
+
+	for (;;) {
+		pthread_mutex_lock(&p->mu);
+		while (p->pending == 0) pthread_cond_wait(&p->cv, &p->mu);
+		/* a job is claimed, it's on some deque until a thread takes it */
+		p->pending -= 1;
+		pthread_mutex_unlock(&p->mu);
+
+		void* job = pooldeque_pop(&p->deques[self]);
+		for (size_t i = 1; job == NULL; i += 1)
+			job = pooldeque_steal(&p->deques[(self + i) % p->nthreads]);
+		p->run(job, p->ctx);
+	}
+	return NULL;
+}
+
+/* start n threads that run jobs with run(job, ctx), false if a thread couldn't be made */
+bool pool_start(struct pool* p, size_t n, pool_run run, void* ctx) {
+	*p = (struct pool) {.nthreads = n, .run = run, .ctx = ctx};
+	p->threads = calloc(n, sizeof(*p->threads));
+	p->deques = calloc(n, sizeof(*p->deques));
+	ASSERT(p->threads != NULL && p->deques != NULL, "out of memory");
+	pthread_mutex_init(&p->mu, NULL);
+	pthread_cond_init(&p->cv, NULL);
+	for (size_t i = 0; i < n; i += 1) pthread_mutex_init(&p->deques[i].mu, NULL);
+	for (size_t i = 0; i < n; i += 1) {
+		struct poolthread* t = malloc(sizeof(*t));
+		ASSERT(t != NULL, "out of memory");
+		*t = (struct poolthread) {.p = p, .i = i};
+		if (pthread_create(&p->threads[i], NULL, pool_thread, t) != 0) {
+			free(t);
+			p->nthreads = i;
+			return false;
+		}
+	}
+	return true;
+}
+
+/* queue a job, from the one thread that hands them out */
+void pool_submit(struct pool* p, void* job) {
+	pooldeque_push(&p->deques[p->next], job);
+	p->next = (p->next + 1) % p->nthreads;
+	pthread_mutex_lock(&p->mu);
+	p->pending += 1;
+	pthread_cond_signal(&p->cv);
+	pthread_mutex_unlock(&p->mu);
+}
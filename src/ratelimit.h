@@ -0,0 +1,63 @@
+/*
+
+rate limits
+-----------
+
+every uid that connects to the daemon gets a token bucket: a request takes a
+token, and tokens come back at `rate` per second up to `burst`. a client out
+of tokens is answered busy without its request being read, see wire.h, with
+how long it has to wait for the next token.
+
+uids are taken from SO_PEERCRED, a script can't get a new bucket by
+reconnecting or forking.
+
+*/
+
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <sys/types.h>
+#include "util.h"
+
+struct bucket {
+	uid_t uid;
+	double tokens;
+	uint64_t last; /* ms the tokens were counted at */
+};
+
+struct ratelimit {
+	double rate; /* tokens per second, 0 for no limit */
+	double burst;
+	struct {
+		struct bucket* items;
+		size_t count;
+		size_t capacity;
+	} buckets; /* one per uid, there are only ever a handful */
+	uint64_t limited; /* requests turned away */
+};
+
+/* take a token for a request of uid at now ms, returns 0 if it got one or the ms until it would */
+uint64_t ratelimit_take(struct ratelimit* rl, uid_t uid, uint64_t now) {
+	if (rl->rate <= 0) return 0;
+
+	struct bucket* b = NULL;
+	for (size_t i = 0; i < rl->buckets.count && b == NULL; i += 1)
+		if (rl->buckets.items[i].uid == uid) b = &rl->buckets.items[i];
+	if (b == NULL) {
+		da_append(&rl->buckets, ((struct bucket) {.uid = uid, .tokens = rl->burst, .last = now}));
+		b = &rl->buckets.items[rl->buckets.count - 1];
+	}
+
+	b->tokens += (now - b->last)*rl->rate/1000;
+	if (b->tokens > rl->burst) b->tokens = rl->burst;
+	b->last = now;
+	if (b->tokens >= 1) {
+		b->tokens -= 1;
+		return 0;
+	}
+	rl->limited += 1;
+	uint64_t wait = (uint64_t)((1 - b->tokens)*1000/rl->rate);
+	return wait > 0 ? wait : 1;
+}
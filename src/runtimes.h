@@ -0,0 +1,222 @@
+/*
+
+recorded runtimes
+-----------------
+
+how long commands ran the last times they ran to completion, as a moving
+average that weighs recent runs more, so a command that got slower is
+estimated slower after a few runs. runs are recorded under two keys:
+	- the whole argv, for commands that run again as they are.
+	- the normalized command, for ones that run with other arguments
+	  every time: the name of the program, then a signature of each
+	  argument. options are kept up to their '=', numbers become #
+	  and anything else becomes * with the extension of its file name,
+	  so `cc -O2 -c a.c -o a.o` is `cc -O2 -c *.c -o *.o`.
+an estimate comes from the whole argv if it ran before, from the normalized
+command otherwise. the spread of the runs is kept the same way, as the moving
+average of how far runs were off the mean, like tcp's rtt variation. the mean
+plus twice that is taken for a runtime few runs go past, about the 95th
+percentile of normally spread runs.
+
+the averages are kept in a file, so they outlive the daemon:
+	unqu runtimes 2
+	<e or n> <runs> <mean ms> <deviation ms> <len>:<key of len bytes>
+keys are their strings each followed by a null byte. at most
+RUNTIMES_MAX_EXACT argvs are kept, past that only normalized commands are.
+
+*/
+
+#pragma once
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "strmap.h"
+#include "util.h"
+
+#define RUNTIMES_WEIGHT 0.3 /* of a new run in the moving average */
+#define RUNTIMES_MAX_EXACT 65536
+#define RUNTIMES_MAX_EXT 8 /* longer extensions aren't extensions */
+
+struct runstat {
+	uint64_t runs;
+	double mean; /* ms */
+	double dev; /* ms, average distance from the mean */
+	uint32_t len;
+	char key[]; /* the map points at it */
+};
+
+struct runkeys {
+	char* items;
+	size_t count;
+	size_t capacity;
+};
+
+struct runtimes {
+	struct strmap exact; /* whole argv -> struct runstat* */
+	struct strmap norm; /* normalized command -> struct runstat* */
+	const char* path; /* file they're kept in, NULL to keep them in memory */
+	bool dirty; /* the file is behind */
+	struct runkeys key; /* scratch */
+};
+
+static
+void runkeys_append(struct runkeys* k, const char* s, size_t len) {
+	da_reserve(k, k->count + len + 1);
+	memcpy(k->items + k->count, s, len);
+	k->items[k->count + len] = '\0';
+	k->count += len + 1;
+}
+
+/* the whole argv as a key, into rt's scratch */
+static
+void runtimes_exactkey(struct runtimes* rt, const char* const* argv, size_t argc) {
+	rt->key.count = 0;
+	for (size_t i = 0; i < argc; i += 1) runkeys_append(&rt->key, argv[i], strlen(argv[i]));
+}
+
+/* the normalized command as a key, into rt's scratch */
+static
+void runtimes_normkey(struct runtimes* rt, const char* const* argv, size_t argc) {
+	rt->key.count = 0;
+	const char* name = strrchr(argv[0], '/');
+	name = name != NULL ? name + 1 : argv[0];
+	runkeys_append(&rt->key, name, strlen(name));
+
+	for (size_t i = 1; i < argc; i += 1) {
+		const char* a = argv[i];
+		if (a[0] == '-' && a[1] != '\0' && strspn(a + 1, "0123456789.") != strlen(a + 1)) {
+			const char* eq = strchr(a, '=');
+			runkeys_append(&rt->key, a, eq != NULL ? (size_t)(eq - a + 1) : strlen(a));
+		} else if (a[0] != '\0' && strspn(a, "-+0123456789.") == strlen(a)) {
+			runkeys_append(&rt->key, "#", 1);
+		} else {
+			const char* base = strrchr(a, '/');
+			const char* ext = strrchr(base != NULL ? base : a, '.');
+			char sig[RUNTIMES_MAX_EXT + 2] = "*";
+			if (ext != NULL && ext[1] != '\0' && strlen(ext) <= RUNTIMES_MAX_EXT) strcat(sig, ext);
+			runkeys_append(&rt->key, sig, strlen(sig));
+		}
+	}
+}
+
+static
+struct runstat* runtimes_add(struct strmap* m, const char* key, size_t len) {
+	struct runstat* s = malloc(sizeof(*s) + len);
+	ASSERT(s != NULL, "out of memory");
+	*s = (struct runstat) {.len = (uint32_t)len};
+	memcpy(s->key, key, len);
+	strmap_putn(m, s->key, len, s);
+	return s;
+}
+
+static
+void runtimes_update(struct runtimes* rt, struct strmap* m, uint64_t ms) {
+	struct runstat* s = strmap_getn(m, rt->key.items, rt->key.count);
+	if (s == NULL && m == &rt->exact && m->count >= RUNTIMES_MAX_EXACT) return;
+	if (s == NULL) s = runtimes_add(m, rt->key.items, rt->key.count);
+	s->runs += 1;
+	double d = ms - s->mean;
+	if (s->runs == 1) {
+		s->mean = ms;
+	} else {
+		s->mean += d*RUNTIMES_WEIGHT;
+		s->dev += ((d < 0 ? -d : d) - s->dev)*RUNTIMES_WEIGHT;
+	}
+	rt->dirty = true;
+}
+
+/* a run of argv took ms */
+void runtimes_record(struct runtimes* rt, const char* const* argv, size_t argc, uint64_t ms) {
+	runtimes_exactkey(rt, argv, argc);
+	runtimes_update(rt, &rt->exact, ms);
+	runtimes_normkey(rt, argv, argc);
+	runtimes_update(rt, &rt->norm, ms);
+}
+
+static
+struct runstat* runtimes_find(struct runtimes* rt, const char* const* argv, size_t argc) {
+	runtimes_exactkey(rt, argv, argc);
+	struct runstat* s = strmap_getn(&rt->exact, rt->key.items, rt->key.count);
+	if (s != NULL) return s;
+	runtimes_normkey(rt, argv, argc);
+	return strmap_getn(&rt->norm, rt->key.items, rt->key.count);
+}
+
+/* expected ms argv runs for, negative if neither it nor its normalized command ran to completion */
+double runtimes_estimate(struct runtimes* rt, const char* const* argv, size_t argc) {
+	struct runstat* s = runtimes_find(rt, argv, argc);
+	return s != NULL ? s->mean : -1;
+}
+
+/* ms few runs of argv go past, negative if it ran to completion fewer than minruns times */
+double runtimes_high(struct runtimes* rt, const char* const* argv, size_t argc, uint64_t minruns) {
+	struct runstat* s = runtimes_find(rt, argv, argc);
+	if (s == NULL || s->runs < minruns) return -1;
+	return s->mean + 2*s->dev;
+}
+
+/* load the runtimes kept in path, which may not exist yet */
+void runtimes_init(struct runtimes* rt, const char* path) {
+	*rt = (struct runtimes) {.path = path};
+	FILE* f = fopen(path, "re");
+	if (f == NULL) {
+		if (errno != ENOENT) logerr("runtimes %s: %s", path, strerror(errno));
+		return;
+	}
+	int version;
+	char kind;
+	unsigned long long runs;
+	double mean, dev;
+	unsigned len;
+	if (fscanf(f, "unqu runtimes %d\n", &version) != 1 || version != 2) {
+		logerr("runtimes %s: not a runtimes file of this version, starting over", path);
+		fclose(f);
+		return;
+	}
+	while (fscanf(f, "%c %llu %lf %lf %u:", &kind, &runs, &mean, &dev, &len) == 5 && (kind == 'e' || kind == 'n')) {
+		rt->key.count = 0;
+		da_reserve(&rt->key, len + 1);
+		if (fread(rt->key.items, 1, len, f) != len || fgetc(f) != '\n') break;
+		struct strmap* m = kind == 'e' ? &rt->exact : &rt->norm;
+		if (len == 0 || strmap_getn(m, rt->key.items, len) != NULL) continue;
+		if (m == &rt->exact && m->count >= RUNTIMES_MAX_EXACT) continue;
+		struct runstat* s = runtimes_add(m, rt->key.items, len);
+		s->runs = runs;
+		s->mean = mean;
+		s->dev = dev;
+	}
+	fclose(f);
+	loginfo("runtimes of %zu commands, %zu normalized, from %s", rt->exact.count, rt->norm.count, path);
+}
+
+static
+void runtimes_writemap(FILE* f, struct strmap* m, char kind) {
+	for (size_t i = 0; i < m->capacity; i += 1) {
+		if (!strslot_live(&m->slots[i])) continue;
+		struct runstat* s = m->slots[i].val;
+		fprintf(f, "%c %llu %.3f %.3f %u:", kind, (unsigned long long)s->runs, s->mean, s->dev, s->len);
+		fwrite(s->key, 1, s->len, f);
+		fputc('\n', f);
+	}
+}
+
+/* write the runtimes to a new file and move it over the old one, if they changed */
+bool runtimes_save(struct runtimes* rt) {
+	if (rt->path == NULL || !rt->dirty) return true;
+	char tmp[strlen(rt->path) + sizeof(".tmp")];
+	snprintf(tmp, sizeof(tmp), "%s.tmp", rt->path);
+	FILE* f = fopen(tmp, "we");
+	if (f == NULL) return false;
+	fprintf(f, "unqu runtimes 2\n");
+	runtimes_writemap(f, &rt->exact, 'e');
+	runtimes_writemap(f, &rt->norm, 'n');
+	bool ok = fflush(f) == 0 && !ferror(f);
+	fclose(f);
+	if (!ok || rename(tmp, rt->path) == -1) return false;
+	rt->dirty = false;
+	return true;
+}
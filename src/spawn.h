@@ -0,0 +1,566 @@
+/*
+
+spawning tasks
+--------------
+
+spawn_exec() is what a task's process runs between fork and exec, whoever
+forked it.
+
+the zygote is a small helper process forked off the daemon before the daemon
+grows, which does the forking on its behalf: fork() has to copy the page
+tables of the process calling it, and those of a daemon holding millions of
+tasks are anything but small. it also keeps a pool of warm children, already
+forked and blocked on a socket, so most spawns are a message and an exec.
+
+there are two stream sockets between the daemon and the zygote:
+	req: the daemon sends a request, the zygote replies with the pid
+	     and a pidfd of the task. strictly request/reply.
+	ev:  the zygote reports exits of tasks as <pid> <wait status>. it
+	     never blocks on it: exits are queued and written as the daemon
+	     reads them, so a daemon that starts tasks back to back and
+	     waits on req doesn't wait on a zygote stuck writing to ev.
+	     the stream may hold part of an exit, the daemon keeps it
+
+a request is a struct spawnreq and its buffer, with the task's cgroup.procs as
+SCM_RIGHTS if hasfd is set. requests are the only place the strings of a task
+are copied, a task forked by the daemon execs straight from its string table.
+the zygote forwards requests to warm children in the same format.
+
+*/
+
+#pragma once
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include "util.h"
+
+extern char** environ;
+
+/* linux/ioprio.h, which older headers don't have */
+#ifndef IOPRIO_CLASS_IDLE
+#define IOPRIO_CLASS_IDLE 3
+#define IOPRIO_WHO_PROCESS 1
+#define IOPRIO_PRIO_VALUE(class, data) (((class) << 13) | (data))
+#endif
+
+/* what a task's process needs to exec, the strings belong to the caller */
+struct spawnargs {
+	const char** argv; /* null-terminated */
+	const char** envp; /* null-terminated, NULL to keep the daemon's environment */
+	const char* cwd; /* NULL to stay in the daemon's working directory */
+	const char* path; /* where argv[0] was found on PATH, NULL to search for it */
+	const char* stdoutpath; /* file to write stdout to, NULL to keep the daemon's */
+	const char* stderrpath; /* file to write stderr to, NULL to keep the daemon's */
+	const cpu_set_t* cpus; /* cpus to run on, NULL to keep the daemon's affinity */
+	bool background; /* only run on cpu and disk time nothing else wants */
+	const int* jobfds; /* the two ends of the jobserver to keep open across exec, NULL for none */
+};
+
+/* run by the task's process: own process group, own cgroup, then exec */
+void spawn_exec(struct spawnargs* a, int procsfd) attr(noreturn);
+
+void spawn_exec(struct spawnargs* a, int procsfd) {
+	/* the zygote ignores these, and ignored signals stay ignored across exec */
+	signal(SIGINT, SIG_DFL);
+	signal(SIGPIPE, SIG_DFL);
+
+	setpgid(0, 0);
+	/* writing 0 moves the writer, before it can fork anything that would escape */
+	if (procsfd != -1 && write(procsfd, "0", 1) != 1) perror("cgroup.procs");
+	/* a task that can't be pinned still runs, just anywhere */
+	if (a->cpus != NULL && sched_setaffinity(0, sizeof(*a->cpus), a->cpus) == -1) perror("sched_setaffinity");
+	if (a->background) {
+		/* the lowest nice is the next best thing where SCHED_IDLE isn't allowed */
+		struct sched_param sp = {0};
+		if (sched_setscheduler(0, SCHED_IDLE, &sp) == -1 && setpriority(PRIO_PROCESS, 0, 19) == -1)
+			perror("setpriority");
+		if (syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0, IOPRIO_PRIO_VALUE(IOPRIO_CLASS_IDLE, 0)) == -1)
+			perror("ioprio_set");
+	}
+
+	/* the same fds in the daemon and the zygote, which inherits them */
+	for (int i = 0; a->jobfds != NULL && i < 2; i += 1)
+		if (fcntl(a->jobfds[i], F_SETFD, 0) == -1) perror("jobserver");
+
+	if (a->cwd != NULL && chdir(a->cwd) == -1) {
+		perror(a->cwd);
+		_exit(127);
+	}
+	/* execvp searches the PATH of the environment it execs with */
+	if (a->envp != NULL) environ = (char**)a->envp;
+
+	char** argv = (char**)a->argv;
+	loginfo("executing %d: '%s'", getpid(), argv[0]);
+	/* after the log line, which is the daemon's. the files are opened here so the zygote
+	   doesn't need them passed
+	*/
+	const char* paths[] = {a->stdoutpath, a->stderrpath};
+	for (int fd = STDOUT_FILENO; fd <= STDERR_FILENO; fd += 1) {
+		const char* p = paths[fd - STDOUT_FILENO];
+		if (p == NULL) continue;
+		int f = open(p, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+		if (f == -1 || dup2(f, fd) == -1) {
+			perror(p);
+			_exit(127);
+		}
+		close(f);
+	}
+
+	/* the resolved path may be stale, execvp has the final say */
+	if (a->path != NULL) execv(a->path, argv);
+	execvp(argv[0], argv);
+	perror("execvp");
+	_exit(127);
+}
+
+///////////////////////////////////
+
+#define ZYGOTE_MAX_WARM 64
+
+/* struct spawnargs on the wire, followed by a buffer of len bytes:
+	<argv: argc null-terminated strings>
+	<environment: envc null-terminated strings, if hasenv>
+	<cwd\0: empty to stay in the daemon's working directory>
+	<path\0: empty to search PATH>
+	<stdoutpath\0, stderrpath\0: empty to keep the daemon's>
+	<cpu_set_t, if hascpus>
+	<2 x int: the ends of the jobserver, if hasjobfds>
+*/
+struct spawnreq {
+	uint32_t argc;
+	uint32_t envc;
+	uint32_t len;
+	uint8_t hasenv;
+	uint8_t hasfd;
+	uint8_t hascpus;
+	uint8_t background;
+	uint8_t hasjobfds;
+} attr(packed);
+
+struct spawnbuf {
+	char* items;
+	size_t count;
+	size_t capacity;
+};
+
+static
+void spawnbuf_appendn(struct spawnbuf* b, const void* p, size_t len) {
+	da_reserve(b, b->count + len);
+	memcpy(b->items + b->count, p, len);
+	b->count += len;
+}
+
+static
+void spawnbuf_append(struct spawnbuf* b, const char* s) {
+	spawnbuf_appendn(b, s, strlen(s) + 1);
+}
+
+/* flatten a into r and a buffer that is reused by the next call */
+static
+char* spawn_pack(struct spawnargs* a, struct spawnreq* r) {
+	static struct spawnbuf b = {0};
+	b.count = 0;
+
+	*r = (struct spawnreq) {.hasenv = a->envp != NULL, .hascpus = a->cpus != NULL,
+		.background = a->background, .hasjobfds = a->jobfds != NULL};
+	for (; a->argv[r->argc] != NULL; r->argc += 1)
+		spawnbuf_append(&b, a->argv[r->argc]);
+	for (; a->envp != NULL && a->envp[r->envc] != NULL; r->envc += 1)
+		spawnbuf_append(&b, a->envp[r->envc]);
+	spawnbuf_append(&b, a->cwd != NULL ? a->cwd : "");
+	spawnbuf_append(&b, a->path != NULL ? a->path : "");
+	spawnbuf_append(&b, a->stdoutpath != NULL ? a->stdoutpath : "");
+	spawnbuf_append(&b, a->stderrpath != NULL ? a->stderrpath : "");
+	if (a->cpus != NULL) spawnbuf_appendn(&b, a->cpus, sizeof(*a->cpus));
+	if (a->jobfds != NULL) spawnbuf_appendn(&b, a->jobfds, 2*sizeof(*a->jobfds));
+	r->len = b.count;
+	return b.items;
+}
+
+/* point a into buf, vec has room for argc + 1 + envc + 1 pointers. the cpu set is copied
+   to cpus and the ends of the jobserver to jobfds, the buffer doesn't keep them aligned
+*/
+static
+void spawn_unpack(struct spawnreq* r, char* buf, const char** vec, cpu_set_t* cpus, int jobfds[2],
+                  struct spawnargs* a) {
+	a->argv = vec;
+	for (uint32_t i = 0; i < r->argc; i += 1, buf += strlen(buf) + 1)
+		*vec++ = buf;
+	*vec++ = NULL;
+	a->envp = r->hasenv ? vec : NULL;
+	for (uint32_t i = 0; i < r->envc; i += 1, buf += strlen(buf) + 1)
+		*vec++ = buf;
+	*vec = NULL;
+	a->cwd = *buf != '\0' ? buf : NULL;
+	buf += strlen(buf) + 1;
+	a->path = *buf != '\0' ? buf : NULL;
+	buf += strlen(buf) + 1;
+	a->stdoutpath = *buf != '\0' ? buf : NULL;
+	buf += strlen(buf) + 1;
+	a->stderrpath = *buf != '\0' ? buf : NULL;
+	buf += strlen(buf) + 1;
+	a->background = r->background;
+	a->cpus = NULL;
+	if (r->hascpus) {
+		memcpy(cpus, buf, sizeof(*cpus));
+		a->cpus = cpus;
+		buf += sizeof(*cpus);
+	}
+	a->jobfds = NULL;
+	if (r->hasjobfds) {
+		memcpy(jobfds, buf, 2*sizeof(*jobfds));
+		a->jobfds = jobfds;
+	}
+}
+
+/* exec the task of a request the zygote got */
+static
+void zy_exec(struct spawnreq* r, char* buf, int procsfd) attr(noreturn);
+
+static
+void zy_exec(struct spawnreq* r, char* buf, int procsfd) {
+	const char* vec[r->argc + 1 + r->envc + 1];
+	cpu_set_t cpus;
+	int jobfds[2];
+	struct spawnargs a;
+	spawn_unpack(r, buf, vec, &cpus, jobfds, &a);
+	spawn_exec(&a, procsfd);
+}
+
+struct zyexit {
+	int32_t pid;
+	int32_t status;
+} attr(packed);
+
+struct zygote {
+	pid_t pid; /* -1 if there's no zygote */
+	int req;
+	int ev;
+	char partial[sizeof(struct zyexit)]; /* what was read of an exit that didn't come in whole */
+	size_t npartial;
+};
+
+static
+bool zy_readall(int fd, void* buf, size_t n) {
+	size_t got = 0;
+	while (got < n) {
+		ssize_t rn = read(fd, (char*)buf + got, n - got);
+		if (rn == -1 && errno == EINTR) continue;
+		if (rn <= 0) return false;
+		got += rn;
+	}
+	return true;
+}
+
+static
+bool zy_writeall(int fd, const void* buf, size_t n) {
+	size_t done = 0;
+	while (done < n) {
+		ssize_t wn = write(fd, (const char*)buf + done, n - done);
+		if (wn == -1 && errno == EINTR) continue;
+		if (wn <= 0) return false;
+		done += wn;
+	}
+	return true;
+}
+
+/* send buf with fd attached, fd is not sent if it is -1 */
+static
+bool zy_sendfd(int sock, const void* buf, size_t n, int fd) {
+	char cbuf[CMSG_SPACE(sizeof(int))];
+	struct iovec iov = {.iov_base = (void*)buf, .iov_len = n};
+	struct msghdr msg = {.msg_iov = &iov, .msg_iovlen = 1};
+	if (fd != -1) {
+		memset(cbuf, 0, sizeof(cbuf));
+		msg.msg_control = cbuf;
+		msg.msg_controllen = sizeof(cbuf);
+		struct cmsghdr* c = CMSG_FIRSTHDR(&msg);
+		c->cmsg_level = SOL_SOCKET;
+		c->cmsg_type = SCM_RIGHTS;
+		c->cmsg_len = CMSG_LEN(sizeof(int));
+		memcpy(CMSG_DATA(c), &fd, sizeof(int));
+	}
+	ssize_t wn;
+	do wn = sendmsg(sock, &msg, 0); while (wn == -1 && errno == EINTR);
+	if (wn == -1) return false;
+	return zy_writeall(sock, (const char*)buf + wn, n - wn);
+}
+
+/* receive exactly n bytes into buf, *fd is the attached fd or -1 */
+static
+bool zy_recvfd(int sock, void* buf, size_t n, int* fd) {
+	char cbuf[CMSG_SPACE(sizeof(int))];
+	struct iovec iov = {.iov_base = buf, .iov_len = n};
+	struct msghdr msg = {.msg_iov = &iov, .msg_iovlen = 1, .msg_control = cbuf, .msg_controllen = sizeof(cbuf)};
+
+	*fd = -1;
+	ssize_t rn;
+	do rn = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC); while (rn == -1 && errno == EINTR);
+	if (rn <= 0) return false;
+	struct cmsghdr* c = CMSG_FIRSTHDR(&msg);
+	if (c != NULL && c->cmsg_level == SOL_SOCKET && c->cmsg_type == SCM_RIGHTS)
+		memcpy(fd, CMSG_DATA(c), sizeof(int));
+	return zy_readall(sock, (char*)buf + rn, n - rn);
+}
+
+/* read a request and its buffer, buf is malloc'ed */
+static
+bool zy_recvreq(int sock, struct spawnreq* req, char** buf, int* procsfd) {
+	if (!zy_recvfd(sock, req, sizeof(*req), procsfd)) return false;
+	*buf = malloc(req->len);
+	ASSERT(*buf != NULL, "out of memory");
+	if (!zy_readall(sock, *buf, req->len)) {
+		free(*buf);
+		if (*procsfd != -1) close(*procsfd);
+		return false;
+	}
+	return true;
+}
+
+static
+bool zy_sendreq(int sock, struct spawnreq* req, const char* buf, int procsfd) {
+	req->hasfd = procsfd != -1;
+	return zy_sendfd(sock, req, sizeof(*req), procsfd) && zy_writeall(sock, buf, req->len);
+}
+
+/* a warm child: wait for one request and become it */
+static
+void zy_warm(int sock) attr(noreturn);
+
+static
+void zy_warm(int sock) {
+	struct spawnreq req;
+	char* buf;
+	int procsfd;
+	if (!zy_recvreq(sock, &req, &buf, &procsfd)) _exit(0);
+	close(sock);
+	zy_exec(&req, buf, procsfd);
+}
+
+struct zywarm {
+	pid_t pid;
+	int sock;
+};
+
+static int zy_sigfd = -1;
+
+static
+void zy_sigchld(UNUSED int sig) {
+	int saved = errno;
+	(void)!write(zy_sigfd, "", 1);
+	errno = saved;
+}
+
+static
+void zy_main(int req, int ev, int nwarm) attr(noreturn);
+
+static
+void zy_main(int req, int ev, int nwarm) {
+	struct zywarm pool[ZYGOTE_MAX_WARM];
+	int npool = 0;
+	/* exits the daemon hasn't read yet, from sent on */
+	struct {
+		struct zyexit* items;
+		size_t count;
+		size_t capacity;
+	} exits = {0};
+	size_t sent = 0;
+	fcntl(ev, F_SETFL, O_NONBLOCK);
+
+	int sigfd[2];
+	if (pipe(sigfd) == -1) {
+		perror("zygote: pipe");
+		_exit(1);
+	}
+	fcntl(sigfd[0], F_SETFL, O_NONBLOCK);
+	fcntl(sigfd[1], F_SETFL, O_NONBLOCK);
+	fcntl(sigfd[0], F_SETFD, FD_CLOEXEC);
+	fcntl(sigfd[1], F_SETFD, FD_CLOEXEC);
+	zy_sigfd = sigfd[1];
+
+	struct sigaction act = {0};
+	sigemptyset(&act.sa_mask);
+	/* ^C is for the daemon, the zygote goes away when the daemon does */
+	act.sa_handler = SIG_IGN;
+	sigaction(SIGINT, &act, NULL);
+	sigaction(SIGPIPE, &act, NULL);
+	act.sa_handler = &zy_sigchld;
+	act.sa_flags = SA_NOCLDSTOP;
+	sigaction(SIGCHLD, &act, NULL);
+
+	for (;;) {
+		/* refill the pool while there's nothing else to do */
+		while (npool < nwarm) {
+			int sv[2];
+			if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sv) == -1) break;
+			pid_t pid = fork();
+			if (pid == 0) {
+				/* only the zygote may hold the other ends, or a warm child never sees it die */
+				close(sv[0]);
+				close(req);
+				close(ev);
+				for (int i = 0; i < npool; i += 1) close(pool[i].sock);
+				zy_warm(sv[1]);
+			}
+			close(sv[1]);
+			if (pid == -1) {
+				close(sv[0]);
+				break;
+			}
+			pool[npool++] = (struct zywarm) {.pid = pid, .sock = sv[0]};
+		}
+
+		struct pollfd pfds[] = {
+			{.fd = req, .events = POLLIN},
+			{.fd = sigfd[0], .events = POLLIN},
+			{.fd = sent < exits.count*sizeof(*exits.items) ? ev : -1, .events = POLLOUT},
+		};
+		if (poll(pfds, 3, -1) == -1) {
+			if (errno == EINTR) continue;
+			perror("zygote: poll");
+			_exit(1);
+		}
+
+		if ((pfds[1].revents & POLLIN) == POLLIN) {
+			char drain[64];
+			while (read(sigfd[0], drain, sizeof(drain)) > 0)
+				;
+			int status;
+			pid_t pid;
+			while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+				bool warm = false;
+				for (int i = 0; i < npool; i += 1) {
+					if (pool[i].pid != pid) continue;
+					close(pool[i].sock);
+					pool[i] = pool[--npool];
+					warm = true;
+					break;
+				}
+				if (!warm) da_append(&exits, ((struct zyexit) {.pid = pid, .status = status}));
+			}
+		}
+
+		/* as much of the exits as the daemon takes, the rest waits for POLLOUT */
+		size_t pending = exits.count*sizeof(*exits.items);
+		while (sent < pending) {
+			ssize_t wn = write(ev, (char*)exits.items + sent, pending - sent);
+			if (wn == -1 && errno == EINTR) continue;
+			if (wn == -1 && errno == EAGAIN) break;
+			/* the daemon went away */
+			if (wn <= 0) _exit(0);
+			sent += wn;
+		}
+		if (sent == pending) {
+			exits.count = 0;
+			sent = 0;
+		}
+
+		if (pfds[0].revents == 0) continue;
+
+		struct spawnreq r;
+		char* buf;
+		int procsfd;
+		/* the daemon went away */
+		if (!zy_recvreq(req, &r, &buf, &procsfd)) _exit(0);
+
+		pid_t pid = -1;
+		while (npool > 0 && pid == -1) {
+			struct zywarm w = pool[--npool];
+			if (zy_sendreq(w.sock, &r, buf, procsfd)) pid = w.pid;
+			close(w.sock);
+		}
+		if (pid == -1) {
+			pid = fork();
+			if (pid == 0) zy_exec(&r, buf, procsfd);
+		}
+		if (pid > 0) setpgid(pid, pid);
+		free(buf);
+		if (procsfd != -1) close(procsfd);
+
+		int pidfd = pid > 0 ? (int)syscall(SYS_pidfd_open, pid, 0) : -1;
+		int32_t reply = pid;
+		bool ok = zy_sendfd(req, &reply, sizeof(reply), pidfd);
+		if (pidfd != -1) close(pidfd);
+		if (!ok) _exit(1);
+	}
+}
+
+/* fork the zygote with nwarm warm children, call this while the process is still small */
+bool zygote_start(struct zygote* z, int nwarm) {
+	int req[2];
+	int ev[2];
+
+	z->pid = -1;
+	if (nwarm > ZYGOTE_MAX_WARM) nwarm = ZYGOTE_MAX_WARM;
+	if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, req) == -1) return false;
+	if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, ev) == -1) {
+		close(req[0]);
+		close(req[1]);
+		return false;
+	}
+
+	pid_t pid = fork();
+	if (pid == -1) return false;
+	if (pid == 0) {
+		close(req[0]);
+		close(ev[0]);
+		zy_main(req[1], ev[1], nwarm);
+	}
+	close(req[1]);
+	close(ev[1]);
+	fcntl(ev[0], F_SETFL, O_NONBLOCK);
+	z->pid = pid;
+	z->npartial = 0;
+	z->req = req[0];
+	z->ev = ev[0];
+	return true;
+}
+
+/* start a task through the zygote, returns its pid or -1. *pidfd is -1 if the kernel has no pidfd_open */
+pid_t zygote_spawn(struct zygote* z, struct spawnargs* a, int procsfd, int* pidfd) {
+	struct spawnreq r;
+	char* buf = spawn_pack(a, &r);
+	int32_t pid;
+	*pidfd = -1;
+	if (!zy_sendreq(z->req, &r, buf, procsfd) || !zy_recvfd(z->req, &pid, sizeof(pid), pidfd))
+		return -1;
+	return pid;
+}
+
+/* read the exits reported by the zygote so far, at most max of them.
+   returns how many were read, -1 if the zygote is gone
+*/
+int zygote_exits(struct zygote* z, struct zyexit* out, int max) {
+	char* buf = (char*)out;
+	size_t have = z->npartial;
+	memcpy(buf, z->partial, have);
+	ssize_t n;
+	do n = read(z->ev, buf + have, max*sizeof(*out) - have); while (n == -1 && errno == EINTR);
+	if (n == 0 || (n == -1 && errno != EAGAIN)) return -1;
+	if (n > 0) have += n;
+
+	/* the zygote writes as much as fits, an exit may be cut short */
+	size_t whole = have/sizeof(*out);
+	z->npartial = have - whole*sizeof(*out);
+	memcpy(z->partial, buf + whole*sizeof(*out), z->npartial);
+	return whole;
+}
+
+void zygote_stop(struct zygote* z) {
+	if (z->pid == -1) return;
+	close(z->req);
+	close(z->ev);
+	z->pid = -1;
+}
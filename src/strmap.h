@@ -0,0 +1,129 @@
+/*
+
+string keyed hash map
+---------------------
+
+open addressing with linear probing and tombstones. keys are byte strings,
+the *n functions take a length and the others a null-terminated string. keys
+aren't copied, a key must stay valid and unchanged for as long as it is in the
+map, usually because the value owns it.
+
+*/
+
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "util.h"
+
+#define STRMAP_TOMB ((const char*)1)
+
+struct strslot {
+	const char* key; /* NULL if empty, STRMAP_TOMB if deleted */
+	size_t len;
+	uint64_t hash;
+	void* val;
+};
+
+struct strmap {
+	struct strslot* slots;
+	size_t count;
+	size_t tombs;
+	size_t capacity; /* always a power of two */
+};
+
+/* FNV-1a */
+uint64_t strhash(const char* s, size_t len) {
+	uint64_t h = 0xcbf29ce484222325u;
+	for (size_t i = 0; i < len; i += 1) {
+		h ^= (uint8_t)s[i];
+		h *= 0x100000001b3u;
+	}
+	return h;
+}
+
+static inline
+bool strslot_live(struct strslot* s) {
+	return s->key != NULL && s->key != STRMAP_TOMB;
+}
+
+/* the slot holding key, or the slot it would go in */
+static
+struct strslot* strmap_find(struct strmap* m, const char* key, size_t len, uint64_t hash) {
+	size_t mask = m->capacity - 1;
+	struct strslot* tomb = NULL;
+	for (size_t i = hash & mask;; i = (i + 1) & mask) {
+		struct strslot* s = &m->slots[i];
+		if (s->key == NULL) return tomb != NULL ? tomb : s;
+		if (s->key == STRMAP_TOMB) {
+			if (tomb == NULL) tomb = s;
+		} else if (s->hash == hash && s->len == len && memcmp(s->key, key, len) == 0) {
+			return s;
+		}
+	}
+}
+
+static
+void strmap_grow(struct strmap* m) {
+	struct strmap old = *m;
+	/* only grow if it's live keys filling the table, not tombstones */
+	m->capacity = old.capacity == 0 ? DA_INIT_CAP : (old.count*4 >= old.capacity ? old.capacity*2 : old.capacity);
+	m->slots = calloc(m->capacity, sizeof(*m->slots));
+	ASSERT(m->slots != NULL, "out of memory");
+	m->count = 0;
+	m->tombs = 0;
+	for (size_t i = 0; i < old.capacity; i += 1) {
+		if (!strslot_live(&old.slots[i])) continue;
+		struct strslot* s = &old.slots[i];
+		*strmap_find(m, s->key, s->len, s->hash) = *s;
+		m->count += 1;
+	}
+	free(old.slots);
+}
+
+void* strmap_getn(struct strmap* m, const char* key, size_t len) {
+	if (m->count == 0) return NULL;
+	struct strslot* s = strmap_find(m, key, len, strhash(key, len));
+	return strslot_live(s) ? s->val : NULL;
+}
+
+/* add or replace key, returns the value it replaced or NULL */
+void* strmap_putn(struct strmap* m, const char* key, size_t len, void* val) {
+	if ((m->count + m->tombs + 1)*2 > m->capacity) strmap_grow(m);
+
+	uint64_t hash = strhash(key, len);
+	struct strslot* s = strmap_find(m, key, len, hash);
+	if (strslot_live(s)) {
+		void* old = s->val;
+		s->key = key;
+		s->val = val;
+		return old;
+	}
+	if (s->key == STRMAP_TOMB) m->tombs -= 1;
+	*s = (struct strslot) {.key = key, .len = len, .hash = hash, .val = val};
+	m->count += 1;
+	return NULL;
+}
+
+/* remove key, returns its value or NULL if it wasn't there */
+void* strmap_deln(struct strmap* m, const char* key, size_t len) {
+	if (m->count == 0) return NULL;
+	struct strslot* s = strmap_find(m, key, len, strhash(key, len));
+	if (!strslot_live(s)) return NULL;
+	void* val = s->val;
+	s->key = STRMAP_TOMB;
+	s->val = NULL;
+	m->count -= 1;
+	m->tombs += 1;
+	return val;
+}
+
+#define strmap_get(m, key) strmap_getn((m), (key), strlen(key))
+#define strmap_put(m, key, val) strmap_putn((m), (key), strlen(key), (val))
+#define strmap_del(m, key) strmap_deln((m), (key), strlen(key))
+
+#define strmap_foreach(m, s) \
+	for (struct strslot* s = (m)->slots; s != NULL && s < (m)->slots + (m)->capacity; s += 1) \
+		if (strslot_live(s))
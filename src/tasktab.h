@@ -0,0 +1,307 @@
+/*
+
+the task table
+--------------
+
+tasks are indexed by id - 1 and never removed. the table is split by how
+often a field is touched:
+	- hot: the state and the pid of every task sit in dense columns of
+	  their own. scans over the whole table, like kill selectors, read a
+	  byte per task and 64 tasks per cache line.
+	- cold: the rest of a task is in its struct task, which is only read
+	  for the tasks a scan picked out, or the one a timer or exit is for.
+	- rare: what only some tasks have, dependents, failed attempts, cgroup
+	  stats, hedging, pinning and the period of a template, is in side
+	  tables keyed by id, so it doesn't make every struct task bigger.
+	  limits are interned, tasks submitted alike share them.
+
+every state change goes through task_setstate(), which keeps a count of the
+tasks in each state.
+
+*/
+
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include "capacity.h"
+#include "cgroup.h"
+#include "intern.h"
+#include "util.h"
+#include "wheel.h"
+#include "wire.h"
+
+/* an edge of the dependency graph, stored on the dependency */
+struct edge {
+	uint32_t id;  /* the dependent task */
+	uint8_t kind; /* DEP_AFTEROK or DEP_AFTERANY */
+};
+
+struct edges {
+	struct edge* items;
+	size_t count;
+	size_t capacity;
+};
+
+/* a failed attempt of a task that was retried */
+struct attempt {
+	int exitcode;
+	bool timedout;
+	uint64_t ms; /* how long it ran */
+};
+
+/* limits of a task, interned, tasks with the same limits share them */
+struct tasklimits {
+	uint64_t timeout; /* SIGTERM after running this many ms, 0 for no limit */
+	uint64_t grace; /* SIGKILL this many ms after the SIGTERM */
+	uint64_t memlimit; /* memory.max in bytes, 0 for no limit */
+	uint32_t cpulimit; /* cpu.max in thousandths of a cpu, 0 for no limit */
+};
+
+/* the runs of a task that may run twice at once, see qu_hedgedone() */
+struct hedge {
+	struct timer* timer; /* while TS_ACTIVE, fires when the run counts as straggling */
+	uint32_t copy; /* the copy started next to the current run, 0 for none */
+	uint32_t copyof; /* the task this one is a copy of, 0 if it isn't one */
+	bool lost; /* its copy finished first, the task takes the copy's result */
+};
+
+/* a template, a copy of it starts every `every` ms. every copy runs as the same task */
+struct recur {
+	uint64_t every;
+	uint32_t copy; /* the task its copies run as, 0 before the first start */
+};
+
+/* failed attempts of a task that was retried */
+struct attempts {
+	struct attempt* items;
+	size_t count;
+	size_t capacity;
+};
+
+/* the cold part of a task, its state and pid are in the table's columns, and what
+   few tasks have in its side tables
+*/
+struct task {
+	uint32_t id;
+	int pidfd; /* only valid while TS_ACTIVE, -1 if the kernel has no pidfd_open */
+	int cgfd; /* the task's cgroup leaf while TS_ACTIVE, -1 if it has none */
+	int exitcode; /* only relevant if state is TS_EXITED, 128+signo if killed by a signal */
+	istr argv; /* vector */
+	istr env; /* vector, 0 to run with the daemon's environment */
+	istr envover; /* vector of NAME=value and NAME applied on top of env, 0 for none */
+	istr cwd; /* 0 to run in the daemon's working directory */
+	istr queue; /* 0 for the default queue */
+	istr key; /* idempotency key, 0 for none */
+	istr inputs; /* vector of absolute paths, 0 for none */
+	istr memokey; /* memo key of the running attempt, 0 if its output isn't captured */
+	istr limits; /* interned struct tasklimits, 0 for none */
+	istr retry; /* interned struct wire_retry, 0 to never retry */
+	istr tokens; /* struct tokenneed array of the named resources it needs, 0 for none */
+	uint32_t ndeps; /* dependencies that haven't finished yet */
+	uint32_t cpus; /* thousandths of a cpu it needs to start, see capacity.h */
+	uint16_t cores; /* cpus to pin the task to, see topo.h, 0 for a share of a node */
+	uint8_t memo; /* MEMO_* */
+	uint8_t woken; /* 1 + the resource it waited on that reserved tokens for it, 0 if none did. see tokens.h */
+	uint8_t killsig; /* signal kill sent the running attempt, one that ends it over any other, 0 for none */
+	bool cached; /* exited 0 with a memoized result, without running */
+	bool background; /* SCHED_IDLE and idle io, runs past the concurrency limit */
+	bool hedge; /* may run twice at once, a run that straggles gets a copy next to it */
+	bool jstoken; /* holds a token of the jobserver while TS_ACTIVE, see jobserver.h */
+	bool worker; /* run by a worker that leases it, not as a process, see workers.h */
+	bool timedout;
+	bool killed; /* ended by kill, never retried */
+	uint64_t mem; /* bytes of memory it needs to start */
+	uint64_t deadline; /* ms on the daemon's clock it should have finished by, 0 for none */
+	uint64_t started; /* ms on the daemon's clock the current attempt started */
+	uint64_t ended; /* ms on the daemon's clock the last attempt ended */
+	struct timer* timer; /* start timer while TS_SCHEDULED, timeout timer while TS_ACTIVE */
+};
+
+/* open addressing task id -> index map of a side table */
+struct sideslot {
+	uint32_t id; /* 0 if the slot is empty */
+	uint32_t at;
+};
+
+struct sidemap {
+	struct sideslot* slots;
+	size_t count;
+	size_t capacity; /* always a power of two */
+};
+
+/* a side table of T by task id. entries are added on first use and, like tasks, never removed */
+#define SIDE_TABLE(T) struct { \
+	struct sidemap map; \
+	T* items; \
+	size_t count; \
+	size_t capacity; \
+}
+
+struct tasktab {
+	uint8_t* state; /* hot, state_t of each task */
+	pid_t* pid; /* hot, also the task's process group, -1 if it never ran */
+	struct task* items; /* cold */
+	size_t count;
+	size_t capacity;
+	size_t nstate[TS_COUNT]; /* tasks in each state */
+
+	/* rare */
+	SIDE_TABLE(struct edges) succ; /* tasks that depend on this one, released when it finishes */
+	SIDE_TABLE(struct attempts) attempts; /* of the tasks that were retried */
+	SIDE_TABLE(struct cgstats) stats; /* for the whole process tree, of the tasks that ran in a cgroup */
+	SIDE_TABLE(struct hedge) hedges; /* of the tasks that may run twice and their copies */
+	SIDE_TABLE(istr) placement; /* indices of its cpus in the topology while TS_ACTIVE, of the pinned tasks */
+	SIDE_TABLE(struct recur) recur; /* of the templates */
+};
+
+static inline
+size_t sidemap_hash(uint32_t id, size_t capacity) {
+	return (id * 2654435761u) & (capacity - 1);
+}
+
+/* index of the entry of task id, -1 if it has none */
+ssize_t sidemap_find(struct sidemap* m, uint32_t id) {
+	if (m->count == 0) return -1;
+	size_t i = sidemap_hash(id, m->capacity);
+	while (m->slots[i].id != id) {
+		if (m->slots[i].id == 0) return -1;
+		i = (i + 1) & (m->capacity - 1);
+	}
+	return m->slots[i].at;
+}
+
+void sidemap_put(struct sidemap* m, uint32_t id, uint32_t at) {
+	ASSERT(id > 0, "task ids start at 1");
+	if ((m->count + 1)*2 > m->capacity) {
+		struct sidemap old = *m;
+		m->capacity = old.capacity == 0 ? DA_INIT_CAP : old.capacity*2;
+		m->slots = calloc(m->capacity, sizeof(*m->slots));
+		ASSERT(m->slots != NULL, "out of memory");
+		m->count = 0;
+		for (size_t i = 0; i < old.capacity; i += 1)
+			if (old.slots[i].id != 0) sidemap_put(m, old.slots[i].id, old.slots[i].at);
+		free(old.slots);
+	}
+
+	size_t i = sidemap_hash(id, m->capacity);
+	while (m->slots[i].id != 0)
+		i = (i + 1) & (m->capacity - 1);
+	m->slots[i] = (struct sideslot) {.id = id, .at = at};
+	m->count += 1;
+}
+
+static inline
+void* side_item(void* items, size_t size, ssize_t at) {
+	return at == -1 ? NULL : (char*)items + at*size;
+}
+
+void* side_slot(struct sidemap* m, void** items, size_t* count, size_t* capacity, size_t size, uint32_t id) {
+	ssize_t at = sidemap_find(m, id);
+	if (at != -1) return (char*)*items + at*size;
+	if (*count == *capacity) {
+		*capacity = *capacity == 0 ? DA_INIT_CAP : *capacity*2;
+		*items = realloc(*items, *capacity*size);
+		ASSERT(*items != NULL, "out of memory");
+	}
+	void* item = (char*)*items + *count*size;
+	memset(item, 0, size);
+	sidemap_put(m, id, *count);
+	*count += 1;
+	return item;
+}
+
+/* the entry of task id in side table s, NULL if it has none */
+#define side_get(s, id) side_item((s)->items, sizeof(*(s)->items), sidemap_find(&(s)->map, (id)))
+
+/* the entry of task id in side table s, a zeroed one is added if it has none. it
+   moves when the table grows, as a task does
+*/
+#define side_at(s, id) side_slot(&(s)->map, (void**)&(s)->items, &(s)->count, &(s)->capacity, \
+	sizeof(*(s)->items), (id))
+
+#define side_bytes(s) ((s)->map.capacity*sizeof(*(s)->map.slots) + (s)->capacity*sizeof(*(s)->items))
+
+/* add a task in TS_INACTIVE, returns its id */
+uint32_t tasktab_add(struct tasktab* tab, struct task* task) {
+	ASSERT(tab->count < UINT32_MAX, "ran out of task ids");
+	if (tab->count == tab->capacity) {
+		tab->capacity = tab->capacity == 0 ? DA_INIT_CAP : tab->capacity*2;
+		tab->state = realloc(tab->state, tab->capacity*sizeof(*tab->state));
+		tab->pid = realloc(tab->pid, tab->capacity*sizeof(*tab->pid));
+		tab->items = realloc(tab->items, tab->capacity*sizeof(*tab->items));
+		ASSERT(tab->state != NULL && tab->pid != NULL && tab->items != NULL, "out of memory");
+	}
+	task->id = tab->count + 1;
+	tab->state[tab->count] = TS_INACTIVE;
+	tab->pid[tab->count] = -1;
+	tab->items[tab->count] = *task;
+	tab->count += 1;
+	tab->nstate[TS_INACTIVE] += 1;
+	return task->id;
+}
+
+/* the task with the given id, NULL if there's none */
+struct task* tasktab_get(struct tasktab* tab, uint32_t id) {
+	if (id == 0 || id > tab->count) return NULL;
+	return &tab->items[id - 1];
+}
+
+/* bytes the table and its side tables take, not counting what the tasks point to */
+size_t tasktab_bytes(struct tasktab* tab) {
+	return tab->capacity*(sizeof(*tab->state) + sizeof(*tab->pid) + sizeof(*tab->items)) +
+		side_bytes(&tab->succ) + side_bytes(&tab->attempts) + side_bytes(&tab->stats) +
+		side_bytes(&tab->hedges) + side_bytes(&tab->placement) + side_bytes(&tab->recur);
+}
+
+/* the limits of a task, none if it has none */
+struct tasklimits task_limits(struct strtab* strs, struct task* task) {
+	struct tasklimits l = {0};
+	if (task->limits != 0) memcpy(&l, istr_get(strs, task->limits), sizeof(l));
+	return l;
+}
+
+static inline
+state_t task_state(struct tasktab* tab, struct task* task) {
+	return tab->state[task->id - 1];
+}
+
+static inline
+void task_setstate(struct tasktab* tab, struct task* task, state_t state) {
+	uint8_t* st = &tab->state[task->id - 1];
+	tab->nstate[*st] -= 1;
+	tab->nstate[state] += 1;
+	*st = (uint8_t)state;
+}
+
+static inline
+pid_t task_pid(struct tasktab* tab, struct task* task) {
+	return tab->pid[task->id - 1];
+}
+
+static inline
+void task_setpid(struct tasktab* tab, struct task* task, pid_t pid) {
+	tab->pid[task->id - 1] = pid;
+}
+
+bool task_isnew(struct tasktab* tab, struct task* task) {
+	return task_pid(tab, task) == -1 && task_state(tab, task) == TS_INACTIVE;
+}
+
+bool task_isdone(struct tasktab* tab, struct task* task) {
+	state_t st = task_state(tab, task);
+	return st == TS_EXITED || st == TS_CANCELLED || st == TS_TIMEDOUT;
+}
+
+bool task_isok(struct tasktab* tab, struct task* task) {
+	return task_state(tab, task) == TS_EXITED && task->exitcode == 0;
+}
+
+/* the capacity the task declared it needs */
+struct res task_res(struct task* task) {
+	/* a background task only gets the cpu time nobody else wants, it doesn't take any */
+	return (struct res) {.cpus = task->background ? 0 : task->cpus, .mem = task->mem};
+}
@@ -0,0 +1,131 @@
+/*
+
+named resources
+---------------
+
+counting semaphores for what tasks share outside of the host, like a database
+or licenses. the daemon is started with the tokens of each resource, -R db=1,
+and a task declares the ones it needs, submit --resource db. a task only
+starts once every token it needs is free and takes them all at once, so no
+task holds some tokens while it waits for others and tasks can't deadlock on
+them. they're given back when the task exits.
+
+a task that finds a resource short waits on it, in the order tasks came to
+it. while tasks wait on a resource, a task that needs it queues behind them
+even if its tokens are free, so a task that needs many tokens isn't starved
+by ones that need few. when tokens are given back, waiters are woken from the
+head for as many as are free. the tokens of a woken task are reserved for it
+until it starts or is cancelled, so no other task takes them in the meantime.
+
+*/
+
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "util.h"
+
+#define TOKENS_MAX 255 /* resources the daemon can be started with, 1 + an index fits a byte */
+
+/* tokens of a resource a task needs, a task keeps an interned array of them */
+struct tokenneed {
+	uint32_t token; /* index in struct tokens */
+	uint32_t n;
+};
+
+struct token {
+	const char* name;
+	uint32_t total;
+	uint32_t used;
+	uint32_t reserved; /* of the ones not used, held for tasks that were woken and haven't started */
+	struct {
+		uint32_t* items; /* ids of the tasks waiting on it, from head */
+		size_t head;
+		size_t count;
+		size_t capacity;
+	} waiters;
+};
+
+struct tokens {
+	struct token* items;
+	size_t count;
+	size_t capacity;
+	uint64_t waits; /* times a task waited on a resource */
+};
+
+/* add a resource of n tokens, false if there's one by that name or too many */
+bool tokens_add(struct tokens* t, const char* name, uint32_t n) {
+	if (t->count >= TOKENS_MAX) return false;
+	for (size_t i = 0; i < t->count; i += 1)
+		if (strcmp(t->items[i].name, name) == 0) return false;
+	da_append(t, ((struct token) {.name = name, .total = n}));
+	return true;
+}
+
+/* the index of the resource called name, negative if there's none */
+int tokens_find(struct tokens* t, const char* name, size_t len) {
+	for (size_t i = 0; i < t->count; i += 1)
+		if (strncmp(t->items[i].name, name, len) == 0 && t->items[i].name[len] == '\0') return (int)i;
+	return -1;
+}
+
+/* the first resource of the n in need that a task can't take now, negative if it can
+   take them all. a task that was woken holds the tokens reserved for it on resource
+   woken, negative if it wasn't, and may go ahead of the ones still waiting
+*/
+int tokens_short(struct tokens* t, const struct tokenneed* need, size_t n, int woken) {
+	for (size_t i = 0; i < n; i += 1) {
+		struct token* tk = &t->items[need[i].token];
+		uint32_t held = (int)need[i].token == woken ? need[i].n : 0;
+		if (tk->used + tk->reserved - held + need[i].n > tk->total) return (int)need[i].token;
+		if (woken < 0 && tk->waiters.count > tk->waiters.head) return (int)need[i].token;
+	}
+	return -1;
+}
+
+/* tokens of resource i that are neither used nor reserved */
+uint32_t tokens_free(struct tokens* t, size_t i) {
+	return t->items[i].total - t->items[i].used - t->items[i].reserved;
+}
+
+void tokens_take(struct tokens* t, const struct tokenneed* need, size_t n) {
+	for (size_t i = 0; i < n; i += 1) t->items[need[i].token].used += need[i].n;
+}
+
+void tokens_give(struct tokens* t, const struct tokenneed* need, size_t n) {
+	for (size_t i = 0; i < n; i += 1) t->items[need[i].token].used -= need[i].n;
+}
+
+/* task id waits on resource i */
+void tokens_wait(struct tokens* t, size_t i, uint32_t id) {
+	struct token* tk = &t->items[i];
+	/* the waiters before head are gone, make room by dropping them rather than growing */
+	if (tk->waiters.count == tk->waiters.capacity && tk->waiters.head > 0) {
+		memmove(tk->waiters.items, tk->waiters.items + tk->waiters.head,
+			(tk->waiters.count - tk->waiters.head)*sizeof(*tk->waiters.items));
+		tk->waiters.count -= tk->waiters.head;
+		tk->waiters.head = 0;
+	}
+	da_append(&tk->waiters, id);
+	t->waits += 1;
+}
+
+/* the task at the head of the waiters of resource i, 0 if none waits */
+uint32_t tokens_waiter(struct tokens* t, size_t i) {
+	struct token* tk = &t->items[i];
+	return tk->waiters.head < tk->waiters.count ? tk->waiters.items[tk->waiters.head] : 0;
+}
+
+/* the task at the head stops waiting on resource i */
+void tokens_unwait(struct tokens* t, size_t i) {
+	struct token* tk = &t->items[i];
+	tk->waiters.head += 1;
+	if (tk->waiters.head == tk->waiters.count) tk->waiters.head = tk->waiters.count = 0;
+}
+
+/* tasks waiting on resource i */
+size_t tokens_nwaiting(struct tokens* t, size_t i) {
+	return t->items[i].waiters.count - t->items[i].waiters.head;
+}
@@ -0,0 +1,232 @@
+/*
+
+cpu placement
+-------------
+
+the cpus the daemon may use, from its own affinity, are read from
+/sys/devices/system/cpu once at startup, with the numa node and the physical
+core of each. a task is placed on a set of them and the set is applied with
+sched_setaffinity(2) in its process, before exec:
+	- a task that asks for n cores gets the n least loaded cpus of one
+	  node, and counts as 1 on each. the node is the one where those cpus
+	  are least loaded, and of those the one with the fewest idle cpus
+	  left, so tasks bin-pack onto nodes and whole nodes stay free for
+	  bigger ones. cpus are kept in core order, so smt siblings go to the
+	  same task. only a task asking for more cores than any node has
+	  spans nodes.
+	- any other task, if the daemon places every task, gets all the cpus
+	  of the least loaded node, and counts as 1/n on each of its n cpus.
+
+the kernel allocates memory on the node of the cpu that touches it first, so
+a task kept on one node keeps its memory there too. tasks are never held back
+by placement: once every cpu is taken, tasks share the least loaded ones.
+
+*/
+
+#pragma once
+
+#include <dirent.h>
+#include <sched.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "util.h"
+
+#define TOPO_MAX_CPUS CPU_SETSIZE
+
+struct topocpu {
+	uint16_t cpu; /* as the kernel numbers it */
+	uint16_t node;
+	uint32_t core; /* package << 16 | core id, shared by smt siblings */
+	double load; /* tasks placed on it, see above */
+};
+
+struct toponode {
+	uint16_t id;
+	uint16_t first; /* of its cpus in struct topo's */
+	uint16_t count;
+};
+
+struct topo {
+	struct {
+		struct topocpu* items; /* sorted by node and core */
+		size_t count;
+		size_t capacity;
+	} cpus;
+	struct {
+		struct toponode* items;
+		size_t count;
+		size_t capacity;
+	} nodes;
+	uint64_t placed; /* tasks placed on cores they asked for */
+	uint64_t spanned; /* of those, tasks that didn't fit in a node */
+	uint64_t shared; /* tasks placed on a node */
+};
+
+static
+long topo_readnum(const char* fmt, unsigned cpu) {
+	char path[128];
+	snprintf(path, sizeof(path), fmt, cpu);
+	FILE* f = fopen(path, "re");
+	if (f == NULL) return 0;
+	long n = 0;
+	if (fscanf(f, "%ld", &n) != 1) n = 0;
+	fclose(f);
+	return n < 0 ? 0 : n;
+}
+
+/* the node of cpu is the nodeN entry in its directory, 0 without numa */
+static
+uint16_t topo_readnode(unsigned cpu) {
+	char path[64];
+	snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%u", cpu);
+	DIR* d = opendir(path);
+	if (d == NULL) return 0;
+	unsigned node = 0;
+	struct dirent* e;
+	while ((e = readdir(d)) != NULL)
+		if (sscanf(e->d_name, "node%u", &node) == 1) break;
+	closedir(d);
+	return (uint16_t)node;
+}
+
+static
+int topo_cmpcpu(const void* a, const void* b) {
+	const struct topocpu* x = a;
+	const struct topocpu* y = b;
+	if (x->node != y->node) return x->node < y->node ? -1 : 1;
+	if (x->core != y->core) return x->core < y->core ? -1 : 1;
+	return x->cpu < y->cpu ? -1 : x->cpu > y->cpu;
+}
+
+/* read the topology of the cpus the process may run on, false if there are none */
+bool topo_init(struct topo* t) {
+	*t = (struct topo) {0};
+	cpu_set_t allowed;
+	if (sched_getaffinity(0, sizeof(allowed), &allowed) == -1) return false;
+
+	for (unsigned cpu = 0; cpu < TOPO_MAX_CPUS; cpu += 1) {
+		if (!CPU_ISSET(cpu, &allowed)) continue;
+		long pkg = topo_readnum("/sys/devices/system/cpu/cpu%u/topology/physical_package_id", cpu);
+		long core = topo_readnum("/sys/devices/system/cpu/cpu%u/topology/core_id", cpu);
+		da_append(&t->cpus, ((struct topocpu) {
+			.cpu = (uint16_t)cpu,
+			.node = topo_readnode(cpu),
+			.core = (uint32_t)(pkg & 0xffff) << 16 | (uint32_t)(core & 0xffff),
+		}));
+	}
+	if (t->cpus.count == 0) return false;
+	qsort(t->cpus.items, t->cpus.count, sizeof(*t->cpus.items), topo_cmpcpu);
+
+	for (size_t i = 0; i < t->cpus.count; i += 1) {
+		struct toponode* n = t->nodes.count > 0 ? &t->nodes.items[t->nodes.count - 1] : NULL;
+		if (n == NULL || n->id != t->cpus.items[i].node) {
+			da_append(&t->nodes, ((struct toponode) {.id = t->cpus.items[i].node, .first = (uint16_t)i}));
+			n = &t->nodes.items[t->nodes.count - 1];
+		}
+		n->count += 1;
+	}
+	return true;
+}
+
+/* the n least loaded of count cpus from first, into idx in core order. returns their load */
+static
+double topo_pick(struct topo* t, size_t first, size_t count, size_t n, uint16_t* idx) {
+	/* insertion sort by load, stable so equally loaded siblings stay together */
+	uint16_t order[count];
+	for (size_t i = 0; i < count; i += 1) {
+		size_t j = i;
+		for (; j > 0 && t->cpus.items[first + order[j - 1]].load > t->cpus.items[first + i].load; j -= 1)
+			order[j] = order[j - 1];
+		order[j] = (uint16_t)i;
+	}
+	double load = 0;
+	for (size_t i = 0; i < n; i += 1) {
+		idx[i] = (uint16_t)(first + order[i]);
+		load += t->cpus.items[idx[i]].load;
+	}
+	/* back in core order */
+	for (size_t i = 1; i < n; i += 1)
+		for (size_t j = i; j > 0 && idx[j - 1] > idx[j]; j -= 1) {
+			uint16_t x = idx[j];
+			idx[j] = idx[j - 1];
+			idx[j - 1] = x;
+		}
+	return load;
+}
+
+/* the load of node i, tasks per cpu */
+double topo_nodeload(struct topo* t, size_t i) {
+	struct toponode* n = &t->nodes.items[i];
+	double load = 0;
+	for (size_t c = n->first; c < n->first + n->count; c += 1) load += t->cpus.items[c].load;
+	return load/n->count;
+}
+
+/* place a task that asks for cores, or on a node if cores is 0. idx gets the indices of
+   its cpus, room for as many as there are, and the number of them is returned
+*/
+size_t topo_place(struct topo* t, size_t cores, uint16_t* idx) {
+	if (t->cpus.count == 0) return 0;
+
+	if (cores == 0) {
+		struct toponode* best = &t->nodes.items[0];
+		double bestload = topo_nodeload(t, 0);
+		for (size_t i = 1; i < t->nodes.count; i += 1) {
+			double load = topo_nodeload(t, i);
+			if (load < bestload) {
+				best = &t->nodes.items[i];
+				bestload = load;
+			}
+		}
+		for (size_t i = 0; i < best->count; i += 1) {
+			idx[i] = best->first + i;
+			t->cpus.items[idx[i]].load += 1.0/best->count;
+		}
+		t->shared += 1;
+		return best->count;
+	}
+
+	if (cores > t->cpus.count) cores = t->cpus.count;
+	uint16_t cand[cores];
+	double bestload = -1;
+	size_t bestidle = 0;
+	for (size_t i = 0; i < t->nodes.count; i += 1) {
+		struct toponode* n = &t->nodes.items[i];
+		if (n->count < cores) continue;
+		double load = topo_pick(t, n->first, n->count, cores, cand);
+		size_t idle = 0;
+		for (size_t c = n->first; c < n->first + n->count; c += 1) idle += t->cpus.items[c].load == 0;
+		/* best fit: of the nodes the task loads the least, the one it leaves the fewest idle cpus on */
+		if (bestload < 0 || load < bestload || (load == bestload && idle < bestidle)) {
+			memcpy(idx, cand, sizeof(cand));
+			bestload = load;
+			bestidle = idle;
+		}
+	}
+	if (bestload < 0) {
+		topo_pick(t, 0, t->cpus.count, cores, idx);
+		t->spanned += 1;
+	}
+	for (size_t i = 0; i < cores; i += 1) t->cpus.items[idx[i]].load += 1;
+	t->placed += 1;
+	return cores;
+}
+
+/* take back the placement of a task, as topo_place() returned it for cores */
+void topo_release(struct topo* t, size_t cores, const uint16_t* idx, size_t n) {
+	for (size_t i = 0; i < n; i += 1) {
+		struct topocpu* c = &t->cpus.items[idx[i]];
+		c->load -= cores == 0 ? 1.0/n : 1;
+		/* shares of 1/n don't always add back up to 0 exactly */
+		if (c->load < 1e-9) c->load = 0;
+	}
+}
+
+/* the cpu set of a placement */
+void topo_cpuset(struct topo* t, const uint16_t* idx, size_t n, cpu_set_t* set) {
+	CPU_ZERO(set);
+	for (size_t i = 0; i < n; i += 1) CPU_SET(t->cpus.items[idx[i]].cpu, set);
+}
@@ -1,21 +1,30 @@
 #define  _POSIX_C_SOURCE 2
 #include <assert.h>
 #include <errno.h>
+#include <stdbool.h>
+#include <getopt.h>
+#include <signal.h>
 #include <stdio.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/socket.h>
 #include <sys/un.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "util.h"
 #include "wire.h"
 
+extern char** environ;
+
 enum subcmd {
 	SC_NOOP = -1,
 	SC_LIST = 0,
 	SC_KILL = 1,
+	SC_SUBMIT = 2,
+	SC_STATS = 3,
+	SC_ENV = 4,
 };
 
 static
@@ -26,8 +35,92 @@ const char* subcmd_help[] = {
 	,
 
 	/* SC_KILL */
-	"kill: terminates the specified process\n"
-	"\nusage: kill [-h] <pid>\n"
+	"kill: signals the selected running tasks and cancels the selected ones that haven't started\n"
+	"\nusage: kill [-h] [-s signal] [--all] [--queue name] [--name pattern] [--state state[,state...]] [id...]\n"
+	"\n"
+	" -s signal       signal name or number to send, defaults to TERM\n"
+	" --all           select every task, needed when no other selector is given\n"
+	" --queue name    select the tasks in queue name\n"
+	" --name pattern  select the tasks whose command name matches the shell pattern\n"
+	" --state state   select the tasks in one of the states, e.g. running,waiting\n"
+	" id              select the tasks with these ids\n"
+	"\nall the given selectors must match\n"
+	,
+
+	/* SC_SUBMIT */
+	"submit: queue a command, prints the id of the new task\n"
+	"\nusage: submit [-h] [--after id[,id...]] [--after-any id[,id...]] [--queue name]\n"
+	"              [--at time | --in duration] [--every interval]\n"
+	"              [--timeout duration [--kill-after duration]]\n"
+	"              [--cpus cpus] [--mem size] [--cpu-limit cpus] [--mem-limit size]\n"
+	"              [--cores n] [--background] [--deadline t [--deadline-strict]] [--hedge]\n"
+	"              [--resource name[=tokens]]... [--worker] [--cwd dir]\n"
+	"              [--export-env | --env-template id] [--setenv NAME=value] [--unsetenv NAME]\n"
+	"              [--retries n [--retry-on code[,code...]] [--backoff d] [--backoff-max d]]\n"
+	"              [--key key [--reuse ttl]] [--memo [--input path]... [--hash-inputs]]\n"
+	"              [--] <command> [args...]\n"
+	"\n"
+	" --after id        run after task id exited with 0, the task is cancelled if it didn't\n"
+	" --after-any id    run after task id finished, however it did\n"
+	" --queue name      put the task in queue name, instead of the default queue\n"
+	" --at time         start no earlier than time: HH:MM[:SS], YYYY-MM-DD HH:MM[:SS] or @epoch\n"
+	" --in duration     start no earlier than duration from now, e.g. 90, 500ms, 5m, 1h30m\n"
+	" --every interval  start the command every interval, starting now or at --at/--in. a start is\n"
+	"                   skipped while the last run hasn't finished\n"
+	" --timeout d       send SIGTERM to the command if it runs for longer than d\n"
+	" --kill-after d    send SIGKILL d after the SIGTERM if it is still running, defaults to 10s\n"
+	" --cpus cpus       start only once this many cpus of the daemon's capacity are free, e.g. 0.5 or 4\n"
+	" --mem size        start only once this much of the daemon's memory capacity is free, e.g. 8G\n"
+	" --cpu-limit cpus  cap the cpu time of the command's process tree, e.g. 0.5 or 2\n"
+	" --mem-limit size  cap the memory of the command's process tree, e.g. 512M or 2G\n"
+	" --cores n         pin the command to n cpus of one numa node, the least busy ones\n"
+	" --background      run the command only on idle cpu and disk time, past the daemon's -j\n"
+	" --deadline t      the command should be done by t, a time like --at or a duration like --in.\n"
+	"                   tasks with deadlines start earliest deadline first, ahead of those without\n"
+	" --deadline-strict don't queue the command if it's expected to miss its deadline\n"
+	" --hedge           the command can safely run twice at once. if it runs for twice as long\n"
+	"                   as it rarely does, a copy starts next to it and the first to finish counts\n"
+	" --resource r      start only once the tokens of resource r the daemon has are free, one\n"
+	"                   or the number after '=', e.g. db or gpu-license=2. can be repeated\n"
+	" --worker          don't spawn the command, a worker connected to the daemon for the task's\n"
+	"                   queue leases it and runs it as it sees fit, like unqux does for plugins\n"
+	" --cwd dir         run the command in dir, instead of the current directory\n"
+	" --export-env      run the command with this environment, instead of the daemon's\n"
+	" --env-template id run the command with environment id, as registered by env\n"
+	" --setenv N=value  set N in the command's environment, can be repeated\n"
+	" --unsetenv N      remove N from the command's environment, can be repeated\n"
+	" --retries n       run the command again, with the same id, up to n times while it fails\n"
+	" --retry-on list   only retry these exit codes and signals, e.g. 75,KILL, defaults to any failure\n"
+	" --backoff d       wait d before the first retry and twice as long before each next one, defaults to 1s\n"
+	" --backoff-max d   never wait longer than d between retries, defaults to 5m\n"
+	" --key key         if a task submitted with key hasn't finished, print its id instead of queueing\n"
+	"                   the command again\n"
+	" --reuse ttl       also print the id of a task with key that exited with 0 less than ttl ago\n"
+	" --memo            the command is deterministic, if it already exited with 0 with the same\n"
+	"                   argv, environment, directory and inputs, its output is replayed instead\n"
+	" --input path      a file the command reads, for --memo, can be repeated\n"
+	" --hash-inputs     compare inputs by their contents, instead of their size and mtime\n"
+	"\na deadline is expected to be missed going by how long the command ran before, it's\n"
+	"queued anyway and the reply says so, unless --deadline-strict is given\n"
+	"\n--hedge only copies a command that ran to completion at least 5 times, and only while\n"
+	"no other task waits for a free slot. the copy is a task of its own, the other one is killed\n"
+	"\na task for workers has only its command, dependencies, deadline, retries and key\n"
+	"\nretries don't happen for tasks stopped with kill, waits are shortened by up to half at random\n"
+	"\n--cpus and --mem only hold the command back, tasks that don't use them start right away.\n"
+	"smaller tasks may start ahead of a held task, if they don't delay it\n"
+	"\nlimits need the daemon to run with cgroup v2 and the cpu and memory controllers\n"
+	,
+
+	/* SC_STATS */
+	"stats: print the daemon's counters and memory use\n"
+	"\nusage: stats [-h]\n"
+	,
+
+	/* SC_ENV */
+	"env: register this environment with the daemon, prints the id to submit with --env-template\n"
+	"\nusage: env [-h]\n"
+	"\nthe tasks submitted with the same id share one copy of the environment in the daemon,\n"
+	"registering the same environment again gives the same id\n"
 	,
 };
 
@@ -44,7 +137,11 @@ void printusage(void) {
 	        "usage: " UNQU " [-h] <subcommand> [args...]\n"
 	        "subcommands:\n"
 	        "  list: list all processes, showing their command line and process id\n"
-	        "  kill: terminates the specified process\n"
+	        "  kill: terminates the selected tasks\n"
+	        "  submit: queue a command\n"
+	        "  stats: print the daemon's counters\n"
+	        "  env: register this environment for submit --env-template\n"
+	        "\nexits with 75 if the daemon was too busy to take the request, try again later\n"
 	);
 	exit(0);
 }
@@ -57,8 +154,49 @@ struct config {
 	union {
 		/* SC_KILL */
 		struct {
-			int32_t pid;
+			int signo;
+			bool all;
+			uint32_t states;
+			uint32_t nids;
+			uint32_t* ids;
+			const char* queue;
+			const char* pattern;
 		} kill;
+		/* SC_SUBMIT */
+		struct {
+			uint32_t ndeps;
+			struct wire_dep* deps;
+			uint64_t delay;
+			uint64_t every;
+			uint64_t timeout;
+			uint64_t grace;
+			uint32_t cpulimit;
+			uint64_t memlimit;
+			uint16_t cores;
+			uint32_t cpus;
+			uint64_t mem;
+			bool background;
+			uint64_t deadline;
+			bool deadlinestrict;
+			bool hedge;
+			bool worker;
+			const char* queue;
+			char* cwd;
+			bool exportenv;
+			uint32_t envtemplate;
+			uint32_t noverrides;
+			char** overrides;
+			struct wire_retry retry;
+			const char* key;
+			uint64_t reuse;
+			uint8_t memo;
+			uint32_t ninputs;
+			char** inputs;
+			uint32_t nresources;
+			char** resources; /* name=tokens */
+			int argc;
+			char** argv;
+		} submit;
 	};
 };
 
@@ -71,14 +209,137 @@ struct wire_frame config_towire(struct config* conf) {
 	switch (conf->subcmd) {
 	case SC_LIST:
 		break;
-	case SC_KILL:
-		wf_ret.m.kill = *(struct msgkill*) &conf->kill;
+	case SC_KILL: {
+		uint32_t queuelen = conf->kill.queue != NULL ? strlen(conf->kill.queue) + 1 : 0;
+		uint32_t patternlen = conf->kill.pattern != NULL ? strlen(conf->kill.pattern) + 1 : 0;
+		size_t len = (size_t)conf->kill.nids*sizeof(uint32_t) + queuelen + patternlen;
+		if (len > WIRE_MAX_PAYLOAD) {
+			fprintf(stderr, UNQU ": too many tasks selected\n");
+			exit(1);
+		}
+		wf_ret.m.kill = (struct msgkill) {
+			.signo = (uint8_t)conf->kill.signo,
+			.all = conf->kill.all,
+			.states = conf->kill.states,
+			.nids = conf->kill.nids,
+			.queuelen = queuelen,
+			.patternlen = patternlen,
+			.len = (uint32_t)len,
+		};
+	} break;
+	case SC_SUBMIT: {
+		uint32_t queuelen = conf->submit.queue != NULL ? strlen(conf->submit.queue) + 1 : 0;
+		uint32_t cwdlen = strlen(conf->submit.cwd) + 1;
+		uint32_t keylen = conf->submit.key != NULL ? strlen(conf->submit.key) + 1 : 0;
+		uint32_t envc = 0;
+		size_t len = conf->submit.ndeps * sizeof(struct wire_dep) + queuelen + cwdlen + keylen;
+		for (int i = 0; i < conf->submit.argc; i += 1)
+			len += strlen(conf->submit.argv[i]) + 1;
+		for (char** e = environ; conf->submit.exportenv && *e != NULL; e += 1, envc += 1)
+			len += strlen(*e) + 1;
+		for (uint32_t i = 0; i < conf->submit.noverrides; i += 1)
+			len += strlen(conf->submit.overrides[i]) + 1;
+		for (uint32_t i = 0; i < conf->submit.ninputs; i += 1)
+			len += strlen(conf->submit.inputs[i]) + 1;
+		for (uint32_t i = 0; i < conf->submit.nresources; i += 1)
+			len += strlen(conf->submit.resources[i]) + 1;
+		if (len > WIRE_MAX_PAYLOAD) {
+			fprintf(stderr, UNQU ": command line and environment are too long\n");
+			exit(1);
+		}
+		wf_ret.m.submit = (struct msgsubmit) {
+			.ndeps = conf->submit.ndeps,
+			.argc = (uint32_t)conf->submit.argc,
+			.queuelen = queuelen,
+			.len = (uint32_t)len,
+			.delay = conf->submit.delay,
+			.every = conf->submit.every,
+			.timeout = conf->submit.timeout,
+			.grace = conf->submit.grace,
+			.cpulimit = conf->submit.cpulimit,
+			.memlimit = conf->submit.memlimit,
+			.cores = conf->submit.cores,
+			.cpus = conf->submit.cpus,
+			.mem = conf->submit.mem,
+			.background = conf->submit.background,
+			.deadline = conf->submit.deadline,
+			.deadlinestrict = conf->submit.deadlinestrict,
+			.hedge = conf->submit.hedge,
+			.cwdlen = cwdlen,
+			.envc = envc,
+			.hasenv = conf->submit.exportenv,
+			.envtemplate = conf->submit.envtemplate,
+			.noverrides = conf->submit.noverrides,
+			.retry = conf->submit.retry,
+			.keylen = keylen,
+			.reuse = conf->submit.reuse,
+			.memo = conf->submit.memo,
+			.ninputs = conf->submit.ninputs,
+			.nresources = conf->submit.nresources,
+			.worker = conf->submit.worker,
+		};
+	} break;
+	case SC_STATS:
 		break;
+	case SC_ENV: {
+		uint32_t envc = 0;
+		size_t len = 0;
+		for (char** e = environ; *e != NULL; e += 1, envc += 1)
+			len += strlen(*e) + 1;
+		if (len > WIRE_MAX_PAYLOAD) {
+			fprintf(stderr, UNQU ": environment is too long\n");
+			exit(1);
+		}
+		wf_ret.m.env = (struct msgenv) {.envc = envc, .len = (uint32_t)len};
+	} break;
 	case SC_NOOP: abort();
 	}
 	return wf_ret;
 }
 
+static void writeall(int out, const char* bytes, size_t sz);
+
+/* write the payload that follows the frame, in the order described in wire.h */
+static
+void config_writepayload(struct config* conf, int out) {
+	switch (conf->subcmd) {
+	case SC_LIST:
+		break;
+	case SC_KILL:
+		writeall(out, (const char*)conf->kill.ids, conf->kill.nids*sizeof(uint32_t));
+		if (conf->kill.queue != NULL)
+			writeall(out, conf->kill.queue, strlen(conf->kill.queue) + 1);
+		if (conf->kill.pattern != NULL)
+			writeall(out, conf->kill.pattern, strlen(conf->kill.pattern) + 1);
+		break;
+	case SC_SUBMIT:
+		writeall(out, (const char*)conf->submit.deps, conf->submit.ndeps * sizeof(struct wire_dep));
+		if (conf->submit.queue != NULL)
+			writeall(out, conf->submit.queue, strlen(conf->submit.queue) + 1);
+		writeall(out, conf->submit.cwd, strlen(conf->submit.cwd) + 1);
+		if (conf->submit.key != NULL)
+			writeall(out, conf->submit.key, strlen(conf->submit.key) + 1);
+		for (int i = 0; i < conf->submit.argc; i += 1)
+			writeall(out, conf->submit.argv[i], strlen(conf->submit.argv[i]) + 1);
+		for (char** e = environ; conf->submit.exportenv && *e != NULL; e += 1)
+			writeall(out, *e, strlen(*e) + 1);
+		for (uint32_t i = 0; i < conf->submit.noverrides; i += 1)
+			writeall(out, conf->submit.overrides[i], strlen(conf->submit.overrides[i]) + 1);
+		for (uint32_t i = 0; i < conf->submit.ninputs; i += 1)
+			writeall(out, conf->submit.inputs[i], strlen(conf->submit.inputs[i]) + 1);
+		for (uint32_t i = 0; i < conf->submit.nresources; i += 1)
+			writeall(out, conf->submit.resources[i], strlen(conf->submit.resources[i]) + 1);
+		break;
+	case SC_STATS:
+		break;
+	case SC_ENV:
+		for (char** e = environ; *e != NULL; e += 1)
+			writeall(out, *e, strlen(*e) + 1);
+		break;
+	case SC_NOOP: abort();
+	}
+}
+
 static
 struct config parse_list(int argc, char* argv[]) {
 	(void)argv;
@@ -88,33 +349,594 @@ struct config parse_list(int argc, char* argv[]) {
 	return (struct config) {.subcmd = SC_LIST};
 }
 
+static
+struct config parse_stats(int argc, char* argv[]) {
+	(void)argv;
+	if (argc - optind > 0) {
+		printhelp(SC_STATS);
+	}
+	return (struct config) {.subcmd = SC_STATS};
+}
+
+static
+struct config parse_env(int argc, char* argv[]) {
+	(void)argv;
+	if (argc - optind > 0) {
+		printhelp(SC_ENV);
+	}
+	return (struct config) {.subcmd = SC_ENV};
+}
+
+static
+int parse_signal(const char* s) {
+	static const struct { const char* name; int signo; } signals[] = {
+		{"HUP", SIGHUP}, {"INT", SIGINT}, {"QUIT", SIGQUIT}, {"KILL", SIGKILL},
+		{"USR1", SIGUSR1}, {"USR2", SIGUSR2}, {"TERM", SIGTERM}, {"CONT", SIGCONT},
+		{"STOP", SIGSTOP}, {"ALRM", SIGALRM},
+	};
+
+	const char* name = strncmp(s, "SIG", 3) == 0 ? s + 3 : s;
+	for (size_t i = 0; i < sizeof(signals)/sizeof(signals[0]); i += 1)
+		if (strcmp(name, signals[i].name) == 0) return signals[i].signo;
+
+	char* end;
+	errno = 0;
+	long signo = strtol(s, &end, 10);
+	if (errno > 0 || end == s || *end != '\0' || signo < 0 || signo > 64) {
+		fprintf(stderr, UNQU ": '%s' is not a valid signal\n", s);
+		exit(1);
+	}
+	return (int)signo;
+}
+
+/* parse a comma separated list of state names into a bitmask */
+static
+uint32_t parse_states(const char* list) {
+	uint32_t states = 0;
+	const char* p = list;
+	while (*p != '\0') {
+		size_t len = strcspn(p, ",");
+		state_t st = TS_INVALID;
+		for (state_t i = 0; i < TS_COUNT; i += 1)
+			if (strlen(task_states[i]) == len && strncmp(p, task_states[i], len) == 0) st = i;
+		if (st == TS_INVALID) {
+			fprintf(stderr, UNQU ": '%.*s' is not a task state\n", (int)len, p);
+			exit(1);
+		}
+		states |= UINT32_C(1) << st;
+		p += len;
+		if (*p == ',') p += 1;
+	}
+	return states;
+}
+
 static
 struct config parse_kill(int argc, char* argv[]) {
-	switch (argc - optind) {
-	case 1: break;
-	case 0:
-		fprintf(stderr, "%s: subcommand 'kill' expected a process id\n", argv[0]);
-		printhelp(SC_KILL);
-		break;
-	default:
-		fprintf(stderr, "%s: subcommand 'kill' expects only one argument\n", argv[0]);
+	enum { OPT_ALL = 256, OPT_QUEUE, OPT_NAME, OPT_STATE };
+	static const struct option longopts[] = {
+		{"all", no_argument, NULL, OPT_ALL},
+		{"queue", required_argument, NULL, OPT_QUEUE},
+		{"name", required_argument, NULL, OPT_NAME},
+		{"state", required_argument, NULL, OPT_STATE},
+		{"help", no_argument, NULL, 'h'},
+		{0},
+	};
+
+	struct config conf = {.subcmd = SC_KILL, .kill = {.signo = SIGTERM}};
+	int opt;
+	while ((opt = getopt_long(argc, argv, "hs:", longopts, NULL)) != -1) {
+		switch (opt) {
+		case 's':
+			conf.kill.signo = parse_signal(optarg);
+			break;
+		case OPT_ALL:
+			conf.kill.all = true;
+			break;
+		case OPT_QUEUE:
+			conf.kill.queue = optarg;
+			break;
+		case OPT_NAME:
+			conf.kill.pattern = optarg;
+			break;
+		case OPT_STATE:
+			conf.kill.states |= parse_states(optarg);
+			break;
+		default: case 'h': printhelp(SC_KILL);
+		}
+	}
+
+	conf.kill.nids = argc - optind;
+	conf.kill.ids = calloc(conf.kill.nids + 1, sizeof(uint32_t));
+	ASSERT(conf.kill.ids != NULL, "out of memory");
+	for (int i = optind; i < argc; i += 1) {
+		char* end;
+		errno = 0;
+		unsigned long id = strtoul(argv[i], &end, 10);
+		if (errno > 0 || end == argv[i] || *end != '\0' || id == 0 || id > UINT32_MAX) {
+			fprintf(stderr, "%s: '%s' is not a valid task id\n", argv[0], argv[i]);
+			exit(1);
+		}
+		conf.kill.ids[i - optind] = (uint32_t)id;
+	}
+
+	if (conf.kill.nids == 0 && conf.kill.queue == NULL && conf.kill.pattern == NULL &&
+	    conf.kill.states == 0 && !conf.kill.all) {
+		fprintf(stderr, "%s: subcommand 'kill' expected a task id or a selector\n", argv[0]);
 		printhelp(SC_KILL);
 	}
 
-	int opt = getopt(argc, argv, "h");
-	switch (opt) {
-	case -1: break;
-	default: case 'h': printhelp(SC_KILL);
+	return conf;
+}
+
+/* parse a comma separated list of task ids into deps */
+static
+void parse_deps(struct config* conf, const char* list, uint8_t kind) {
+	const char* p = list;
+	while (*p != '\0') {
+		char* end;
+		errno = 0;
+		unsigned long id = strtoul(p, &end, 10);
+		if (errno > 0 || end == p || id == 0 || id > UINT32_MAX || (*end != ',' && *end != '\0')) {
+			fprintf(stderr, UNQU ": '%s' is not a valid list of task ids\n", list);
+			exit(1);
+		}
+		conf->submit.deps = realloc(conf->submit.deps, (conf->submit.ndeps + 1)*sizeof(struct wire_dep));
+		ASSERT(conf->submit.deps != NULL, "out of memory");
+		conf->submit.deps[conf->submit.ndeps] = (struct wire_dep) {.id = (uint32_t)id, .kind = kind};
+		conf->submit.ndeps += 1;
+		p = *end == ',' ? end + 1 : end;
+	}
+}
+
+/* parse a comma separated list of exit codes and signal names into the bitmap of struct wire_retry */
+static
+void parse_retryon(struct wire_retry* r, const char* list) {
+	char buf[strlen(list) + 1];
+	memcpy(buf, list, sizeof(buf));
+	for (char* tok = strtok(buf, ","); tok != NULL; tok = strtok(NULL, ",")) {
+		int code;
+		if (tok[0] >= '0' && tok[0] <= '9') {
+			char* end;
+			errno = 0;
+			long n = strtol(tok, &end, 10);
+			if (errno > 0 || *end != '\0' || n < 1 || n > 255) {
+				fprintf(stderr, UNQU ": '%s' is not a valid exit code for --retry-on\n", tok);
+				exit(1);
+			}
+			code = (int)n;
+		} else {
+			/* killed by a signal, the exit code is 128+signo */
+			code = 128 + parse_signal(tok);
+		}
+		r->on[code/8] |= 1 << code%8;
 	}
+}
 
+/* parse a duration like 90, 500ms, 5m or 1h30m into milliseconds, bare numbers are seconds */
+static
+uint64_t parse_duration(const char* opt, const char* s) {
+	static const struct { const char* suffix; uint64_t ms; } units[] = {
+		{"ms", 1}, {"s", 1000}, {"m", 60*1000}, {"h", 60*60*1000}, {"d", 24*60*60*1000},
+	};
+
+	uint64_t total = 0;
+	const char* p = s;
+	while (*p != '\0') {
+		char* end;
+		errno = 0;
+		unsigned long long n = strtoull(p, &end, 10);
+		if (errno > 0 || end == p) goto bad;
+
+		uint64_t unit = 0;
+		if (*end == '\0') {
+			unit = 1000;
+		} else {
+			for (size_t i = 0; i < sizeof(units)/sizeof(units[0]); i += 1) {
+				size_t len = strlen(units[i].suffix);
+				if (strncmp(end, units[i].suffix, len) == 0 && (end[len] == '\0' || (end[len] >= '0' && end[len] <= '9'))) {
+					unit = units[i].ms;
+					end += len;
+					break;
+				}
+			}
+		}
+		if (unit == 0) goto bad;
+		total += n*unit;
+		p = end;
+	}
+	if (p == s) goto bad;
+	return total;
+bad:
+	fprintf(stderr, UNQU ": '%s' is not a valid duration for %s\n", s, opt);
+	exit(1);
+}
+
+/* parse a size like 4096, 512K, 2M or 1G into bytes */
+static
+uint64_t parse_size(const char* opt, const char* s) {
+	char* end;
 	errno = 0;
-	long int pid = strtol(argv[optind], NULL, 10);
-	if (errno > 0) {
-		fprintf(stderr, "%s: '%s' is not a valid process id\n", argv[0], argv[optind]);
+	unsigned long long n = strtoull(s, &end, 10);
+	if (errno > 0 || end == s) goto bad;
+
+	switch (*end) {
+	case '\0': return n;
+	case 'K': case 'k': n <<= 10; break;
+	case 'M': case 'm': n <<= 20; break;
+	case 'G': case 'g': n <<= 30; break;
+	case 'T': case 't': n <<= 40; break;
+	default: goto bad;
+	}
+	if (end[1] != '\0' && strcmp(end + 1, "B") != 0) goto bad;
+	return n;
+bad:
+	fprintf(stderr, UNQU ": '%s' is not a valid size for %s\n", s, opt);
+	exit(1);
+}
+
+/* parse a fractional number of cpus into thousandths of a cpu */
+static
+uint32_t parse_cpus(const char* opt, const char* s) {
+	char* end;
+	errno = 0;
+	double cpus = strtod(s, &end);
+	if (errno > 0 || end == s || *end != '\0' || !(cpus > 0) || cpus > 4096) {
+		fprintf(stderr, UNQU ": '%s' is not a valid number of cpus for %s\n", s, opt);
+		exit(1);
+	}
+	uint32_t milli = (uint32_t)(cpus*1000 + 0.5);
+	return milli > 0 ? milli : 1;
+}
+
+/* parse an absolute local time into milliseconds from now, times of day that already passed mean tomorrow */
+static
+uint64_t parse_at(const char* opt, const char* s) {
+	time_t now = time(NULL);
+	time_t at;
+
+	if (s[0] == '@') {
+		char* end;
+		errno = 0;
+		long long epoch = strtoll(s + 1, &end, 10);
+		if (errno > 0 || end == s + 1 || *end != '\0') goto bad;
+		at = (time_t)epoch;
+	} else {
+		struct tm tm = *localtime(&now);
+		int year, mon, day, n = 0;
+		tm.tm_sec = 0;
+		if (sscanf(s, "%d-%d-%d%*1[ T]%d:%d%n", &year, &mon, &day, &tm.tm_hour, &tm.tm_min, &n) == 5) {
+			tm.tm_year = year - 1900;
+			tm.tm_mon = mon - 1;
+			tm.tm_mday = day;
+		} else if (n = 0, sscanf(s, "%d:%d%n", &tm.tm_hour, &tm.tm_min, &n) != 2) {
+			goto bad;
+		}
+		if (s[n] == ':') {
+			int m = 0;
+			if (sscanf(s + n, ":%d%n", &tm.tm_sec, &m) != 1) goto bad;
+			n += m;
+		}
+		if (s[n] != '\0') goto bad;
+		tm.tm_isdst = -1;
+		at = mktime(&tm);
+		if (at == (time_t)-1) goto bad;
+		if (at <= now && strchr(s, '-') == NULL) at += 24*60*60;
+	}
+
+	return at <= now ? 0 : (uint64_t)(at - now)*1000;
+bad:
+	fprintf(stderr, UNQU ": '%s' is not a valid time for %s\n", s, opt);
+	exit(1);
+}
+
+/* rel appended to the absolute dir, the caller owns the result */
+static
+char* joinpath(const char* dir, const char* rel) {
+	size_t len = strlen(dir) + 1 + strlen(rel) + 1;
+	char* p = malloc(len);
+	ASSERT(p != NULL, "out of memory");
+	snprintf(p, len, "%s%s%s", dir, *rel != '\0' ? "/" : "", rel);
+	return p;
+}
+
+static
+struct config parse_submit(int argc, char* argv[]) {
+	enum { OPT_AFTER = 256, OPT_AFTERANY, OPT_QUEUE, OPT_AT, OPT_IN, OPT_EVERY, OPT_TIMEOUT, OPT_KILLAFTER,
+		OPT_CPULIMIT, OPT_MEMLIMIT, OPT_CWD, OPT_EXPORTENV, OPT_ENVTEMPLATE, OPT_SETENV, OPT_UNSETENV,
+		OPT_RETRIES, OPT_RETRYON, OPT_BACKOFF, OPT_BACKOFFMAX, OPT_KEY, OPT_REUSE,
+		OPT_MEMO, OPT_INPUT, OPT_HASHINPUTS, OPT_CORES,
+		OPT_CPUS, OPT_MEM, OPT_BACKGROUND, OPT_DEADLINE, OPT_DEADLINESTRICT, OPT_HEDGE, OPT_RESOURCE, OPT_WORKER };
+	static const struct option longopts[] = {
+		{"after", required_argument, NULL, OPT_AFTER},
+		{"after-any", required_argument, NULL, OPT_AFTERANY},
+		{"queue", required_argument, NULL, OPT_QUEUE},
+		{"at", required_argument, NULL, OPT_AT},
+		{"in", required_argument, NULL, OPT_IN},
+		{"every", required_argument, NULL, OPT_EVERY},
+		{"timeout", required_argument, NULL, OPT_TIMEOUT},
+		{"kill-after", required_argument, NULL, OPT_KILLAFTER},
+		{"cpu-limit", required_argument, NULL, OPT_CPULIMIT},
+		{"mem-limit", required_argument, NULL, OPT_MEMLIMIT},
+		{"cwd", required_argument, NULL, OPT_CWD},
+		{"export-env", no_argument, NULL, OPT_EXPORTENV},
+		{"env-template", required_argument, NULL, OPT_ENVTEMPLATE},
+		{"setenv", required_argument, NULL, OPT_SETENV},
+		{"unsetenv", required_argument, NULL, OPT_UNSETENV},
+		{"retries", required_argument, NULL, OPT_RETRIES},
+		{"retry-on", required_argument, NULL, OPT_RETRYON},
+		{"backoff", required_argument, NULL, OPT_BACKOFF},
+		{"backoff-max", required_argument, NULL, OPT_BACKOFFMAX},
+		{"key", required_argument, NULL, OPT_KEY},
+		{"reuse", required_argument, NULL, OPT_REUSE},
+		{"memo", no_argument, NULL, OPT_MEMO},
+		{"input", required_argument, NULL, OPT_INPUT},
+		{"hash-inputs", no_argument, NULL, OPT_HASHINPUTS},
+		{"cores", required_argument, NULL, OPT_CORES},
+		{"cpus", required_argument, NULL, OPT_CPUS},
+		{"mem", required_argument, NULL, OPT_MEM},
+		{"background", no_argument, NULL, OPT_BACKGROUND},
+		{"deadline", required_argument, NULL, OPT_DEADLINE},
+		{"deadline-strict", no_argument, NULL, OPT_DEADLINESTRICT},
+		{"hedge", no_argument, NULL, OPT_HEDGE},
+		{"resource", required_argument, NULL, OPT_RESOURCE},
+		{"worker", no_argument, NULL, OPT_WORKER},
+		{"help", no_argument, NULL, 'h'},
+		{0},
+	};
+
+	struct config conf = {.subcmd = SC_SUBMIT};
+	bool hasdelay = false;
+	bool hasretryopt = false;
+	bool hashinputs = false;
+	int opt;
+	/* '+' stops at the first non-option, the rest belongs to the command */
+	while ((opt = getopt_long(argc, argv, "+h", longopts, NULL)) != -1) {
+		switch (opt) {
+		case OPT_AFTER:
+			parse_deps(&conf, optarg, DEP_AFTEROK);
+			break;
+		case OPT_AFTERANY:
+			parse_deps(&conf, optarg, DEP_AFTERANY);
+			break;
+		case OPT_QUEUE:
+			if (optarg[0] == '\0') {
+				fprintf(stderr, "%s: queue name can't be empty\n", argv[0]);
+				exit(1);
+			}
+			conf.submit.queue = optarg;
+			break;
+		case OPT_AT:
+		case OPT_IN:
+			if (hasdelay) {
+				fprintf(stderr, "%s: only one of --at and --in can be given\n", argv[0]);
+				exit(1);
+			}
+			hasdelay = true;
+			conf.submit.delay = opt == OPT_AT ? parse_at("--at", optarg) : parse_duration("--in", optarg);
+			break;
+		case OPT_EVERY:
+			conf.submit.every = parse_duration("--every", optarg);
+			if (conf.submit.every == 0) {
+				fprintf(stderr, "%s: --every must be positive\n", argv[0]);
+				exit(1);
+			}
+			break;
+		case OPT_TIMEOUT:
+			conf.submit.timeout = parse_duration("--timeout", optarg);
+			break;
+		case OPT_KILLAFTER:
+			conf.submit.grace = parse_duration("--kill-after", optarg);
+			break;
+		case OPT_CPULIMIT:
+			conf.submit.cpulimit = parse_cpus("--cpu-limit", optarg);
+			break;
+		case OPT_MEMLIMIT:
+			conf.submit.memlimit = parse_size("--mem-limit", optarg);
+			break;
+		case OPT_CPUS:
+			conf.submit.cpus = parse_cpus("--cpus", optarg);
+			break;
+		case OPT_MEM:
+			conf.submit.mem = parse_size("--mem", optarg);
+			break;
+		case OPT_DEADLINE:
+			if (optarg[0] == '@' || strchr(optarg, ':') != NULL) conf.submit.deadline = parse_at("--deadline", optarg);
+			else conf.submit.deadline = parse_duration("--deadline", optarg);
+			if (conf.submit.deadline == 0) {
+				fprintf(stderr, "%s: --deadline must be in the future\n", argv[0]);
+				exit(1);
+			}
+			break;
+		case OPT_DEADLINESTRICT:
+			conf.submit.deadlinestrict = true;
+			break;
+		case OPT_HEDGE:
+			conf.submit.hedge = true;
+			break;
+		case OPT_WORKER:
+			conf.submit.worker = true;
+			break;
+		case OPT_BACKGROUND:
+			conf.submit.background = true;
+			break;
+		case OPT_CORES: {
+			char* end;
+			errno = 0;
+			unsigned long n = strtoul(optarg, &end, 10);
+			if (errno > 0 || end == optarg || *end != '\0' || n == 0 || n > UINT16_MAX) {
+				fprintf(stderr, "%s: '%s' is not a valid number of cores\n", argv[0], optarg);
+				exit(1);
+			}
+			conf.submit.cores = (uint16_t)n;
+		} break;
+		case OPT_CWD:
+			conf.submit.cwd = optarg;
+			break;
+		case OPT_EXPORTENV:
+			conf.submit.exportenv = true;
+			break;
+		case OPT_ENVTEMPLATE: {
+			char* end;
+			errno = 0;
+			unsigned long id = strtoul(optarg, &end, 10);
+			if (errno > 0 || end == optarg || *end != '\0' || id == 0 || id > UINT32_MAX) {
+				fprintf(stderr, "%s: '%s' is not a valid env template id\n", argv[0], optarg);
+				exit(1);
+			}
+			conf.submit.envtemplate = (uint32_t)id;
+		} break;
+		case OPT_SETENV:
+		case OPT_UNSETENV: {
+			size_t namelen = strcspn(optarg, "=");
+			if (namelen == 0 || (opt == OPT_SETENV) != (optarg[namelen] == '=')) {
+				fprintf(stderr, "%s: '%s' is not a valid %s\n", argv[0], optarg,
+					opt == OPT_SETENV ? "NAME=value" : "variable name");
+				exit(1);
+			}
+			conf.submit.overrides = realloc(conf.submit.overrides, (conf.submit.noverrides + 1)*sizeof(char*));
+			ASSERT(conf.submit.overrides != NULL, "out of memory");
+			conf.submit.overrides[conf.submit.noverrides] = optarg;
+			conf.submit.noverrides += 1;
+		} break;
+		case OPT_RETRIES: {
+			char* end;
+			errno = 0;
+			unsigned long n = strtoul(optarg, &end, 10);
+			if (errno > 0 || end == optarg || *end != '\0' || n == 0 || n > UINT32_MAX) {
+				fprintf(stderr, "%s: '%s' is not a valid number of retries\n", argv[0], optarg);
+				exit(1);
+			}
+			conf.submit.retry.max = (uint32_t)n;
+		} break;
+		case OPT_RETRYON:
+			parse_retryon(&conf.submit.retry, optarg);
+			hasretryopt = true;
+			break;
+		case OPT_BACKOFF:
+		case OPT_BACKOFFMAX: {
+			uint64_t d = parse_duration(opt == OPT_BACKOFF ? "--backoff" : "--backoff-max", optarg);
+			if (d == 0) {
+				fprintf(stderr, "%s: %s must be positive\n", argv[0], opt == OPT_BACKOFF ? "--backoff" : "--backoff-max");
+				exit(1);
+			}
+			if (opt == OPT_BACKOFF) conf.submit.retry.backoff = d;
+			else conf.submit.retry.backoffmax = d;
+			hasretryopt = true;
+		} break;
+		case OPT_KEY:
+			if (optarg[0] == '\0') {
+				fprintf(stderr, "%s: key can't be empty\n", argv[0]);
+				exit(1);
+			}
+			conf.submit.key = optarg;
+			break;
+		case OPT_REUSE:
+			conf.submit.reuse = parse_duration("--reuse", optarg);
+			break;
+		case OPT_MEMO:
+			if (conf.submit.memo == MEMO_NONE) conf.submit.memo = MEMO_STAT;
+			break;
+		case OPT_HASHINPUTS:
+			hashinputs = true;
+			break;
+		case OPT_RESOURCE: {
+			/* name alone is one token */
+			char* eq = strchr(optarg, '=');
+			char* r = optarg;
+			if (eq != NULL) {
+				char* end;
+				errno = 0;
+				unsigned long n = strtoul(eq + 1, &end, 10);
+				if (eq == optarg || errno > 0 || end == eq + 1 || *end != '\0' || n == 0 || n > UINT32_MAX) {
+					fprintf(stderr, "%s: '%s' is not a valid resource, name or name=tokens\n", argv[0], optarg);
+					exit(1);
+				}
+			} else {
+				size_t len = strlen(optarg) + sizeof("=1");
+				r = malloc(len);
+				ASSERT(r != NULL, "out of memory");
+				snprintf(r, len, "%s=1", optarg);
+			}
+			conf.submit.resources = realloc(conf.submit.resources, (conf.submit.nresources + 1)*sizeof(char*));
+			ASSERT(conf.submit.resources != NULL, "out of memory");
+			conf.submit.resources[conf.submit.nresources] = r;
+			conf.submit.nresources += 1;
+		} break;
+		case OPT_INPUT:
+			conf.submit.inputs = realloc(conf.submit.inputs, (conf.submit.ninputs + 1)*sizeof(char*));
+			ASSERT(conf.submit.inputs != NULL, "out of memory");
+			conf.submit.inputs[conf.submit.ninputs] = optarg;
+			conf.submit.ninputs += 1;
+			break;
+		default: case 'h': printhelp(SC_SUBMIT);
+		}
+	}
+
+	if (conf.submit.grace > 0 && conf.submit.timeout == 0) {
+		fprintf(stderr, "%s: --kill-after needs --timeout\n", argv[0]);
+		exit(1);
+	}
+	if (hasretryopt && conf.submit.retry.max == 0) {
+		fprintf(stderr, "%s: --retry-on, --backoff and --backoff-max need --retries\n", argv[0]);
+		exit(1);
+	}
+	if ((conf.submit.ninputs > 0 || hashinputs) && conf.submit.memo == MEMO_NONE) {
+		fprintf(stderr, "%s: --input and --hash-inputs need --memo\n", argv[0]);
+		exit(1);
+	}
+	if (hashinputs) conf.submit.memo = MEMO_CONTENT;
+	if (conf.submit.reuse > 0 && conf.submit.key == NULL) {
+		fprintf(stderr, "%s: --reuse needs --key\n", argv[0]);
+		exit(1);
+	}
+	if (conf.submit.exportenv && conf.submit.envtemplate > 0) {
+		fprintf(stderr, "%s: only one of --export-env and --env-template can be given\n", argv[0]);
+		exit(1);
+	}
+	if (conf.submit.every > 0 && conf.submit.ndeps > 0) {
+		fprintf(stderr, "%s: --every can't be combined with --after or --after-any\n", argv[0]);
+		exit(1);
+	}
+	if (conf.submit.every > 0 && conf.submit.deadline > 0) {
+		fprintf(stderr, "%s: --every can't be combined with --deadline\n", argv[0]);
+		exit(1);
+	}
+	if (conf.submit.deadlinestrict && conf.submit.deadline == 0) {
+		fprintf(stderr, "%s: --deadline-strict needs --deadline\n", argv[0]);
 		exit(1);
 	}
+	if (conf.submit.hedge && conf.submit.memo != MEMO_NONE) {
+		fprintf(stderr, "%s: --hedge can't be combined with --memo\n", argv[0]);
+		exit(1);
+	}
+	if (conf.submit.worker && (conf.submit.timeout > 0 || conf.submit.cpulimit > 0 || conf.submit.memlimit > 0 ||
+	    conf.submit.cores > 0 || conf.submit.cpus > 0 || conf.submit.mem > 0 || conf.submit.background ||
+	    conf.submit.hedge || conf.submit.memo != MEMO_NONE || conf.submit.nresources > 0)) {
+		fprintf(stderr, "%s: --worker only combines with --after, --queue, --at, --in, --every, --deadline,\n"
+			"--retries and --key\n", argv[0]);
+		exit(1);
+	}
+
+	if (argc - optind == 0) {
+		fprintf(stderr, "%s: subcommand 'submit' expected a command\n", argv[0]);
+		printhelp(SC_SUBMIT);
+	}
+	/* the daemon has a working directory of its own, it needs an absolute path */
+	if (conf.submit.cwd == NULL || conf.submit.cwd[0] != '/') {
+		char dir[4096];
+		if (getcwd(dir, sizeof(dir)) == NULL) {
+			perror("getcwd");
+			exit(1);
+		}
+		conf.submit.cwd = joinpath(dir, conf.submit.cwd != NULL ? conf.submit.cwd : "");
+	}
+	/* inputs are relative to the directory the command runs in */
+	for (uint32_t i = 0; i < conf.submit.ninputs; i += 1)
+		if (conf.submit.inputs[i][0] != '/') conf.submit.inputs[i] = joinpath(conf.submit.cwd, conf.submit.inputs[i]);
 
-	return (struct config) {.subcmd = SC_KILL, .kill = { .pid = (int32_t)pid}};
+	conf.submit.argc = argc - optind;
+	conf.submit.argv = argv + optind;
+	return conf;
 }
 
 static
@@ -130,6 +952,15 @@ struct config parse_conf(int argc, char* argv[]) {
 	} else if (strcmp(argv[1], "kill") == 0) {
 		cmd = SC_KILL;
 		parse = &parse_kill;
+	} else if (strcmp(argv[1], "submit") == 0) {
+		cmd = SC_SUBMIT;
+		parse = &parse_submit;
+	} else if (strcmp(argv[1], "stats") == 0) {
+		cmd = SC_STATS;
+		parse = &parse_stats;
+	} else if (strcmp(argv[1], "env") == 0) {
+		cmd = SC_ENV;
+		parse = &parse_env;
 	} else {
 		printusage();
 	}
@@ -172,6 +1003,8 @@ void writeall(int out, const char* bytes, size_t sz) {
 	size_t n = sz;
 	while (n > 0) {
 		int wn = write(out, ptr, n);
+		/* the daemon turned the request away without reading it, its reply is waiting */
+		if (wn == -1 && errno == EPIPE) return;
 		if (wn == -1) {
 			perror("writeall");
 			exit(1);
@@ -188,15 +1021,19 @@ int main(int argc, char* argv[]) {
 	static char buf[4096];
 
 	conf = parse_conf(argc, argv);
+	signal(SIGPIPE, SIG_IGN);
 	in = clientsock();
 
 	/* send the config */
 	wire = config_towire(&conf);
 	xxd((const uint8_t*)&wire, sizeof(wire));
 	writeall(in, (const char*)&wire, sizeof(wire));
+	config_writepayload(&conf, in);
 
         /* read all */
 	int n = -1;
+	bool busy = false;
+	bool first = true;
 	while (n != 0) {
 		n = read(in, buf, sizeof(buf));
 		switch (n) {
@@ -206,9 +1043,13 @@ int main(int argc, char* argv[]) {
 		case 0:
 			break;
 		default:
+			if (first) busy = (size_t)n >= strlen(WIRE_BUSY) && strncmp(buf, WIRE_BUSY, strlen(WIRE_BUSY)) == 0;
+			first = false;
 			printf("%.*s", n, buf);
 		}
 	}
 
 	puts("[client] done.");
+	/* EX_TEMPFAIL, scripts can tell a request worth retrying from one that failed */
+	return busy ? 75 : 0;
 }
@@ -1,5 +1,8 @@
-#define _POSIX_C_SOURCE 202506L
+#define _GNU_SOURCE
 #include <errno.h>
+#include <fcntl.h>
+#include <fnmatch.h>
+#include <limits.h>
 #include <poll.h>
 #include <signal.h>
 #include <stdbool.h>
@@ -7,72 +10,230 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/prctl.h>
 #include <sys/socket.h>
+#include <sys/syscall.h>
 #include <sys/un.h>
 #include <sys/wait.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "util.h"
+#include "adapt.h"
+#include "capacity.h"
+#include "cgroup.h"
+#include "execcache.h"
+#include "intern.h"
+#include "jobserver.h"
+#include "memo.h"
+#include "ratelimit.h"
+#include "runtimes.h"
+#include "spawn.h"
+#include "tasktab.h"
+#include "tokens.h"
+#include "topo.h"
+#include "wheel.h"
 #include "wire.h"
+#include "workers.h"
 
 ///////////////////////////////////
 
-typedef int state_t;
-#define TS_INVALID  -1
-#define TS_INACTIVE 0
-#define TS_ACTIVE   1
-#define TS_EXITED   2
-#define state2str(state) ((state) < TS_INVALID || (state) > TS_EXITED ? \
-	"UNKNOWN" : (state) == TS_INACTIVE ? \
-		"inactive" : (state) == TS_ACTIVE ? \
-		        "running" : "exited")
-
-struct task {
-	pid_t  id;
-	state_t state;
-	int exitcode; /* only relevant if state is TS_EXITED */
-	const char* name;
-	const char* arg;
+/* argv is an interned vector of at least one string */
+struct task newtask(istr argv) {
+	ASSERT(argv != 0, "task must have at least a name");
+	return (struct task) {.id = 0, .pidfd = -1, .cgfd = -1, .argv = argv};
+}
+
+#define DEFAULT_QUEUE "default"
+
+const char* task_queue(struct strtab* tab, struct task* task) {
+	return task->queue != 0 ? istr_get(tab, task->queue) : DEFAULT_QUEUE;
+}
+
+const char* task_name(struct strtab* tab, struct task* task) {
+	return ivec_get(tab, task->argv, 0);
+}
+
+struct strvec {
+	const char** items;
+	size_t count;
+	size_t capacity;
 };
 
-/* arg is a concatenated list of null-terminated strings: argv0\0argv1\0argv2\0...\0
-   it must terminate with a null byte
+/* whether vector v, from index `from` on, sets or unsets the variable of NAME=value or NAME */
+static
+bool env_has(struct strtab* tab, istr v, uint32_t from, const char* s) {
+	size_t n = strcspn(s, "=");
+	uint32_t c = ivec_len(tab, v);
+	for (uint32_t i = from; i < c; i += 1) {
+		const char* e = ivec_get(tab, v, i);
+		if (strcspn(e, "=") == n && memcmp(e, s, n) == 0) return true;
+	}
+	return false;
+}
+
+/* the NAME=value the task's process gets for name, 0 if it's unset.
+   daemonenv is the base of a task that only has overrides
 */
-struct task newtask(const char* name, const char* arg) {
-	ASSERT(name != NULL, "task name must be non-null pointer");
-	return (struct task) {.id = -1, .state = TS_INACTIVE, .name = name, .arg = arg};
+istr task_getenv(struct strtab* tab, struct task* task, istr daemonenv, const char* name) {
+	size_t n = strlen(name);
+	if (task->envover != 0) {
+		for (uint32_t i = ivec_len(tab, task->envover); i > 0; i -= 1) {
+			const char* o = ivec_get(tab, task->envover, i - 1);
+			if (strcspn(o, "=") != n || memcmp(o, name, n) != 0) continue;
+			return o[n] == '=' ? ivec_at(tab, task->envover, i - 1) : 0;
+		}
+	}
+	istr base = task->env != 0 ? task->env : daemonenv;
+	uint32_t envc = ivec_len(tab, base);
+	for (uint32_t i = 0; i < envc; i += 1) {
+		const char* e = ivec_get(tab, base, i);
+		if (strncmp(e, name, n) == 0 && e[n] == '=') return ivec_at(tab, base, i);
+	}
+	return 0;
 }
 
-bool task_run(struct task* task) {
-	ASSERT(task->name != NULL, "task name must be non-null pointer");
+/* point a at the task's strings in the table, nothing is copied but the pointers.
+   the environment is the task's base, or daemonenv if it only has overrides, with
+   the overrides applied, and makeflags in place of MAKEFLAGS unless it's NULL.
+   the vectors are reused by the next call
+*/
+void task_spawnargs(struct strtab* tab, struct task* task, istr daemonenv, const char* path, const char* makeflags,
+                    struct spawnargs* a) {
+	static struct strvec v = {0};
+	v.count = 0;
+
+	uint32_t argc = ivec_len(tab, task->argv);
+	for (uint32_t i = 0; i < argc; i += 1) da_append(&v, ivec_get(tab, task->argv, i));
+	da_append(&v, NULL);
+
+	size_t envoff = v.count;
+	if (task->env != 0 || task->envover != 0 || makeflags != NULL) {
+		istr base = task->env != 0 ? task->env : daemonenv;
+		istr over = task->envover;
+		uint32_t envc = ivec_len(tab, base);
+		for (uint32_t i = 0; i < envc; i += 1) {
+			const char* e = ivec_get(tab, base, i);
+			if (makeflags != NULL && strncmp(e, "MAKEFLAGS=", strlen("MAKEFLAGS=")) == 0) continue;
+			if (over == 0 || !env_has(tab, over, 0, e)) da_append(&v, e);
+		}
+		/* the last override of a variable wins, the ones without a value only unset */
+		uint32_t overc = over != 0 ? ivec_len(tab, over) : 0;
+		for (uint32_t i = 0; i < overc; i += 1) {
+			const char* o = ivec_get(tab, over, i);
+			if (makeflags != NULL && strncmp(o, "MAKEFLAGS=", strlen("MAKEFLAGS=")) == 0) continue;
+			if (strchr(o, '=') != NULL && !env_has(tab, over, i + 1, o)) da_append(&v, o);
+		}
+		if (makeflags != NULL) da_append(&v, makeflags);
+		da_append(&v, NULL);
+	}
 
-	int taskid = fork();
+	*a = (struct spawnargs) {
+		.argv = v.items,
+		.envp = envoff < v.count ? v.items + envoff : NULL,
+		.cwd = istr_get(tab, task->cwd),
+		.path = path,
+		.background = task->background,
+	};
+}
 
-	if (taskid == -1) return false;
-	if (taskid > 0) {
-		task->id = taskid;
-		task->state = TS_ACTIVE;
-		ASSERT(waitpid(taskid, NULL, WNOHANG) == 0, "newly start process must be running, this is a bug");
-		return true;
+/* run the task in its own process group, and its own cgroup leaf if cg is set up.
+   the zygote forks it if there is one, so the daemon doesn't have to
+*/
+bool task_run(struct tasktab* tab, struct task* task, struct tasklimits* l, struct spawnargs* a, struct cgroot* cg,
+              struct zygote* zy) {
+	int procsfd = -1;
+	task->cgfd = cg_create(cg, task->id, l->cpulimit, l->memlimit);
+	if (task->cgfd != -1) {
+		procsfd = openat(task->cgfd, "cgroup.procs", O_WRONLY | O_CLOEXEC);
+		if (procsfd == -1) logerr("cgroup for task %u: %s", task->id, strerror(errno));
+	}
+
+	int pidfd = -1;
+	pid_t pid;
+	if (zy->pid != -1) {
+		pid = zygote_spawn(zy, a, procsfd, &pidfd);
+	} else {
+		pid = fork();
+		if (pid == 0) spawn_exec(a, procsfd);
+		/* both sides set the group, whichever runs first wins the race with exec or kill */
+		if (pid > 0) setpgid(pid, pid);
+		/* the child can't be reaped before we wait for it, so this can't race with pid reuse */
+		if (pid > 0) pidfd = syscall(SYS_pidfd_open, pid, 0);
 	}
-	task->id = getpid();
-	loginfo("executing %d: '%s'", task->id, task->name);
-	if (execlp(task->name, task->name, task->arg, NULL) == -1) {
-		perror("execlp");
+	if (procsfd != -1) close(procsfd);
+
+	if (pid == -1) {
+		if (task->cgfd != -1) {
+			close(task->cgfd);
+			task->cgfd = -1;
+			cg_remove(cg, task->id);
+		}
 		return false;
 	}
+	task_setpid(tab, task, pid);
+	task->pidfd = pidfd;
+	task_setstate(tab, task, TS_ACTIVE);
 	return true;
 }
 
-bool task_isnew(struct task* task) {
-	return (task->id == -1) && (task->state == TS_INACTIVE);
+#ifndef PIDFD_SIGNAL_PROCESS_GROUP
+#define PIDFD_SIGNAL_PROCESS_GROUP (1 << 2)
+#endif
+
+/* signal the whole process tree of a running task. SIGKILL goes through cgroup.kill
+   when the task has a cgroup, which also gets the processes that left the group.
+   otherwise the group is signalled through the pidfd, so a recycled pid never gets
+   the signal.
+*/
+int task_signal(struct tasktab* tab, struct task* task, int signo) {
+	ASSERT(task_state(tab, task) == TS_ACTIVE, "only running tasks can be signalled");
+	if (signo == SIGKILL && task->cgfd != -1 && cg_kill(task->cgfd))
+		return 0;
+	if (task->pidfd != -1) {
+		if (syscall(SYS_pidfd_send_signal, task->pidfd, signo, NULL, PIDFD_SIGNAL_PROCESS_GROUP) == 0)
+			return 0;
+		if (errno != EINVAL) return -1;
+	}
+	/* before linux 6.9, the leader is our unreaped child so its group can't have been recycled either */
+	return kill(-task_pid(tab, task), signo);
+}
+
+/* write the task's argv, separated by spaces */
+void task_printargs(int fd, struct strtab* tab, struct task* task) {
+	uint32_t argc = ivec_len(tab, task->argv);
+	for (uint32_t i = 0; i < argc; i += 1)
+		dprintf(fd, i == 0 ? "%s" : " %s", ivec_get(tab, task->argv, i));
 }
 
 ///////////////////////////////////
 
+#define DEFAULT_MEMO_DIR "unqu.cache"
+#define DEFAULT_RUNTIMES_FILE "unqu.runtimes"
+#define DEFAULT_JOBSERVER "unqu.jobserver"
+
 struct config {
 	bool help;
 	bool daemon;
+	size_t maxjobs; /* 0 for no limit */
+	bool adaptive; /* maxjobs is only the upper bound of the limit */
+	bool placeall; /* place tasks that don't ask for cores on a numa node */
+	bool nocgroup;
+	int zygote; /* warm children of the zygote, -1 for no zygote */
+	const char* memodir;
+	uint64_t memobudget; /* bytes */
+	double rate; /* requests per second of each uid, 0 for no limit */
+	double burst;
+	size_t maxpending; /* tasks that haven't started, 0 for no limit */
+	uint64_t maxtables; /* bytes of the task and string tables, 0 for no limit */
+	uint64_t cpus; /* thousandths of a cpu tasks may declare, 0 for the host's */
+	uint64_t mem; /* bytes tasks may declare, 0 for the host's */
+	size_t maxbackground; /* background tasks at once, 0 for one per cpu */
+	bool sjf; /* start the shortest ready tasks first, instead of the oldest */
+	const char* runtimesfile;
+	struct tokens tokens; /* named resources and their tokens */
+	size_t jobtokens; /* tokens of the jobserver, 0 for none */
+	uint64_t leasems; /* ms a worker that holds leases may stay silent */
 };
 
 static
@@ -80,9 +241,35 @@ void printusage(int code) {
 	fprintf(stderr,
 	        "start the unqu daemon\n"
 	        "\n"
-	        "usage: " UNQUD " [-h] [-d]\n"
+	        "usage: " UNQUD " [-h] [-d] [-C] [-j jobs] [-A] [-P] [-z warm] [-m dir] [-M mb]\n"
+	        "             [-r rate] [-b burst] [-Q tasks] [-S mb] [-c cpus] [-G mb] [-B jobs]\n"
+	        "             [-p policy] [-T file] [-R name=tokens]... [-J tokens]\n"
+	        "             [-L ms]\n"
 	        "\n"
 	        " -d     daemonize, go to background\n"
+	        " -C     don't put tasks in cgroups, even if cgroup v2 is available\n"
+	        " -j     run at most this many tasks at once, 0 (the default) for no limit\n"
+	        " -A     adapt the limit to the load of the host, up to -j or 4 per cpu\n"
+	        " -P     pin every task to the cpus of a numa node, not only those submitted with --cores\n"
+	        " -z     spawn tasks through a zygote process that keeps this many warm children\n"
+	        " -m     keep the results of memoized tasks in this directory, defaults to " DEFAULT_MEMO_DIR "\n"
+	        " -M     evict memoized results past this many megabytes, defaults to 1024\n"
+	        " -r     answer busy to a user making more than this many requests a second\n"
+	        " -b     requests a user can make at once before -r applies, defaults to the rate\n"
+	        " -Q     answer busy to submits while this many tasks haven't started\n"
+	        " -S     refuse submits once the task and string tables take this many megabytes. nothing\n"
+	        "        in them is freed while the daemon runs, the limit is for good once it's reached\n"
+	        " -c     cpus tasks may declare with --cpus at once, defaults to the cpus of the host\n"
+	        " -G     megabytes tasks may declare with --mem at once, defaults to the memory of the host\n"
+	        " -B     run at most this many background tasks at once, on top of -j, defaults to one per cpu\n"
+	        " -p     order of the ready tasks without a deadline: fifo (the default), or sjf for the ones\n"
+	        "        expected to be done soonest first, a task waits at most about as long as it runs\n"
+	        " -T     keep the runtimes of commands in this file, defaults to " DEFAULT_RUNTIMES_FILE "\n"
+	        " -R     a resource tasks share, with this many tokens, e.g. db=1 or gpu-license=2. tasks\n"
+	        "        submitted with --resource only start once they can take all the tokens they need\n"
+	        " -J     be the make jobserver of the tasks, with this many tokens. tasks take one each, and\n"
+	        "        make -j or ninja in a task take one for each job past its first, from " DEFAULT_JOBSERVER "\n"
+	        " -L     a worker that holds tasks loses them if it's silent for this many ms, defaults to 10000\n"
 	        " -h     print this help and exit\n"
 	        "\n"
 	);
@@ -94,10 +281,17 @@ struct config parse_conf(int argc, char* argv[]) {
 	struct config conf = {
 		.help = false,
 		.daemon = false,
+		.maxjobs = 0,
+		.zygote = -1,
+		.memodir = DEFAULT_MEMO_DIR,
+		.memobudget = (uint64_t)1024 << 20,
+		.runtimesfile = DEFAULT_RUNTIMES_FILE,
+		.leasems = DEFAULT_LEASE_MS,
 	};
 
 	int opt;
-	while ((opt = getopt(argc, argv, "hd")) != -1) {
+	char* end;
+	while ((opt = getopt(argc, argv, "hdCAPj:z:m:M:r:b:Q:S:c:G:B:p:T:R:J:L:")) != -1) {
 		switch (opt) {
 		case 'h':
 			conf.help = true;
@@ -105,12 +299,148 @@ struct config parse_conf(int argc, char* argv[]) {
 		case 'd':
 			conf.daemon = true;
 			break;
-		default: abort();
+		case 'C':
+			conf.nocgroup = true;
+			break;
+		case 'A':
+			conf.adaptive = true;
+			break;
+		case 'P':
+			conf.placeall = true;
+			break;
+		case 'j':
+			errno = 0;
+			conf.maxjobs = strtoul(optarg, &end, 10);
+			if (errno > 0 || end == optarg || *end != '\0') {
+				fprintf(stderr, UNQUD ": '%s' is not a valid number of jobs\n", optarg);
+				printusage(1);
+			}
+			break;
+		case 'p':
+			if (strcmp(optarg, "fifo") != 0 && strcmp(optarg, "sjf") != 0) {
+				fprintf(stderr, UNQUD ": '%s' is not a policy, fifo or sjf\n", optarg);
+				printusage(1);
+			}
+			conf.sjf = strcmp(optarg, "sjf") == 0;
+			break;
+		case 'T':
+			conf.runtimesfile = optarg;
+			break;
+		case 'R': {
+			char* eq = strchr(optarg, '=');
+			unsigned long n = 0;
+			if (eq != NULL && eq != optarg) {
+				errno = 0;
+				n = strtoul(eq + 1, &end, 10);
+				if (errno > 0 || end == eq + 1 || *end != '\0' || n > UINT32_MAX) n = 0;
+			}
+			if (n == 0) {
+				fprintf(stderr, UNQUD ": '%s' is not a valid resource, name=tokens\n", optarg);
+				printusage(1);
+			}
+			*eq = '\0';
+			if (!tokens_add(&conf.tokens, optarg, (uint32_t)n)) {
+				fprintf(stderr, UNQUD ": resource '%s' given twice, or more than %d resources\n", optarg, TOKENS_MAX);
+				printusage(1);
+			}
+		} break;
+		case 'J':
+			errno = 0;
+			conf.jobtokens = strtoul(optarg, &end, 10);
+			if (errno > 0 || end == optarg || *end != '\0' || conf.jobtokens == 0 || conf.jobtokens > JOBSERVER_MAX_TOKENS) {
+				fprintf(stderr, UNQUD ": '%s' is not a valid number of tokens, 1 to %d\n", optarg, JOBSERVER_MAX_TOKENS);
+				printusage(1);
+			}
+			break;
+		case 'L':
+			errno = 0;
+			conf.leasems = strtoull(optarg, &end, 10);
+			if (errno > 0 || end == optarg || *end != '\0' || conf.leasems == 0) {
+				fprintf(stderr, UNQUD ": '%s' is not a valid lease timeout in ms\n", optarg);
+				printusage(1);
+			}
+			break;
+		case 'B':
+			errno = 0;
+			conf.maxbackground = strtoul(optarg, &end, 10);
+			if (errno > 0 || end == optarg || *end != '\0' || conf.maxbackground == 0) {
+				fprintf(stderr, UNQUD ": '%s' is not a valid number of background jobs\n", optarg);
+				printusage(1);
+			}
+			break;
+		case 'z':
+			errno = 0;
+			conf.zygote = strtol(optarg, &end, 10);
+			if (errno > 0 || end == optarg || *end != '\0' || conf.zygote < 0 || conf.zygote > ZYGOTE_MAX_WARM) {
+				fprintf(stderr, UNQUD ": '%s' is not a valid number of warm children, 0 to %d\n", optarg, ZYGOTE_MAX_WARM);
+				printusage(1);
+			}
+			break;
+		case 'm':
+			conf.memodir = optarg;
+			break;
+		case 'M': {
+			errno = 0;
+			unsigned long long mb = strtoull(optarg, &end, 10);
+			if (errno > 0 || end == optarg || *end != '\0' || mb > (UINT64_MAX >> 20)) {
+				fprintf(stderr, UNQUD ": '%s' is not a valid number of megabytes\n", optarg);
+				printusage(1);
+			}
+			conf.memobudget = (uint64_t)mb << 20;
+		} break;
+		case 'r':
+		case 'b': {
+			errno = 0;
+			double d = strtod(optarg, &end);
+			if (errno > 0 || end == optarg || *end != '\0' || !(d >= 0)) {
+				fprintf(stderr, UNQUD ": '%s' is not a valid %s\n", optarg, opt == 'r' ? "rate" : "burst");
+				printusage(1);
+			}
+			if (opt == 'r') conf.rate = d;
+			else conf.burst = d;
+		} break;
+		case 'Q':
+			errno = 0;
+			conf.maxpending = strtoul(optarg, &end, 10);
+			if (errno > 0 || end == optarg || *end != '\0') {
+				fprintf(stderr, UNQUD ": '%s' is not a valid number of tasks\n", optarg);
+				printusage(1);
+			}
+			break;
+		case 'S': {
+			errno = 0;
+			unsigned long long mb = strtoull(optarg, &end, 10);
+			if (errno > 0 || end == optarg || *end != '\0' || mb > (UINT64_MAX >> 20)) {
+				fprintf(stderr, UNQUD ": '%s' is not a valid number of megabytes\n", optarg);
+				printusage(1);
+			}
+			conf.maxtables = (uint64_t)mb << 20;
+		} break;
+		case 'c': {
+			errno = 0;
+			double d = strtod(optarg, &end);
+			if (errno > 0 || end == optarg || *end != '\0' || !(d > 0) || d > 1e9) {
+				fprintf(stderr, UNQUD ": '%s' is not a valid number of cpus\n", optarg);
+				printusage(1);
+			}
+			conf.cpus = (uint64_t)(d*1000 + 0.5);
+		} break;
+		case 'G': {
+			errno = 0;
+			unsigned long long mb = strtoull(optarg, &end, 10);
+			if (errno > 0 || end == optarg || *end != '\0' || mb == 0 || mb > (UINT64_MAX >> 20)) {
+				fprintf(stderr, UNQUD ": '%s' is not a valid number of megabytes\n", optarg);
+				printusage(1);
+			}
+			conf.mem = (uint64_t)mb << 20;
+		} break;
+		default: printusage(1);
 		}
 	}
 	if (conf.help) {
 		printusage(0);
 	}
+	if (conf.burst < 1) conf.burst = conf.rate > 1 ? conf.rate : 1;
 	return conf;
 }
 
@@ -147,16 +477,276 @@ int listener(void) {
 
 ///////////////////////////////////
 
-#define MAX_TASK_COUNT 2
+/* FIFO of task ids */
+struct idqueue {
+	uint32_t* items;
+	size_t head;
+	size_t count;
+	size_t capacity;
+};
+
+void idqueue_push(struct idqueue* q, uint32_t id) {
+	if (q->count == q->capacity) {
+		size_t cap = q->capacity == 0 ? DA_INIT_CAP : q->capacity*2;
+		uint32_t* items = malloc(cap*sizeof(*items));
+		ASSERT(items != NULL, "out of memory");
+		for (size_t i = 0; i < q->count; i += 1)
+			items[i] = q->items[(q->head + i) % q->capacity];
+		free(q->items);
+		q->items = items;
+		q->head = 0;
+		q->capacity = cap;
+	}
+	q->items[(q->head + q->count) % q->capacity] = id;
+	q->count += 1;
+}
+
+uint32_t idqueue_peek(struct idqueue* q) {
+	ASSERT(q->count > 0, "peek into empty queue");
+	return q->items[q->head];
+}
+
+uint32_t idqueue_pop(struct idqueue* q) {
+	ASSERT(q->count > 0, "pop from empty queue");
+	uint32_t id = q->items[q->head];
+	q->head = (q->head + 1) % q->capacity;
+	q->count -= 1;
+	return id;
+}
+
+/* min-heap of task ids by deadline */
+struct dlentry {
+	uint64_t deadline;
+	uint32_t id;
+};
+
+struct dlheap {
+	struct dlentry* items;
+	size_t count;
+	size_t capacity;
+};
+
+void dlheap_push(struct dlheap* h, uint64_t deadline, uint32_t id) {
+	da_append(h, ((struct dlentry) {.deadline = deadline, .id = id}));
+	for (size_t i = h->count - 1; i > 0 && h->items[(i - 1)/2].deadline > h->items[i].deadline; i = (i - 1)/2) {
+		struct dlentry e = h->items[i];
+		h->items[i] = h->items[(i - 1)/2];
+		h->items[(i - 1)/2] = e;
+	}
+}
+
+uint32_t dlheap_pop(struct dlheap* h) {
+	ASSERT(h->count > 0, "pop from empty heap");
+	uint32_t id = h->items[0].id;
+	h->items[0] = h->items[--h->count];
+	for (size_t i = 0;;) {
+		size_t min = i, l = 2*i + 1, r = 2*i + 2;
+		if (l < h->count && h->items[l].deadline < h->items[min].deadline) min = l;
+		if (r < h->count && h->items[r].deadline < h->items[min].deadline) min = r;
+		if (min == i) break;
+		struct dlentry e = h->items[i];
+		h->items[i] = h->items[min];
+		h->items[min] = e;
+		i = min;
+	}
+	return id;
+}
+
+/* the ready tasks of a class: earliest deadline first, then the tasks without one.
+   those are in the order they became ready, or with sjf by when they became ready
+   plus how long they're expected to run, which is when they'd be done if they started
+   right away. short tasks go first, but a long one waits at most about as long as it
+   runs, it doesn't starve
+*/
+struct readyq {
+	struct dlheap edf;
+	struct dlheap sjf;
+	struct idqueue fifo;
+};
+
+size_t readyq_count(struct readyq* q) {
+	return q->edf.count + q->sjf.count + q->fifo.count;
+}
+
+/* sjf is the key of the task in the sjf order, 0 to keep it in the fifo */
+void readyq_push(struct readyq* q, uint32_t id, uint64_t deadline, uint64_t sjf) {
+	if (deadline > 0) dlheap_push(&q->edf, deadline, id);
+	else if (sjf > 0) dlheap_push(&q->sjf, sjf, id);
+	else idqueue_push(&q->fifo, id);
+}
+
+uint32_t readyq_peek(struct readyq* q) {
+	if (q->edf.count > 0) return q->edf.items[0].id;
+	if (q->sjf.count > 0) return q->sjf.items[0].id;
+	return idqueue_peek(&q->fifo);
+}
+
+uint32_t readyq_pop(struct readyq* q) {
+	if (q->edf.count > 0) return dlheap_pop(&q->edf);
+	if (q->sjf.count > 0) return dlheap_pop(&q->sjf);
+	return idqueue_pop(&q->fifo);
+}
+
+/* open addressing pid -> task id map, so reaping a child doesn't scan the task table */
+struct pidslot {
+	pid_t pid; /* 0 if the slot is empty */
+	uint32_t id;
+};
+
+struct pidmap {
+	struct pidslot* slots;
+	size_t count;
+	size_t capacity; /* always a power of two */
+};
+
+static inline
+size_t pidmap_hash(pid_t pid, size_t capacity) {
+	return ((uint32_t)pid * 2654435761u) & (capacity - 1);
+}
+
+void pidmap_put(struct pidmap* m, pid_t pid, uint32_t id);
+
+static
+void pidmap_grow(struct pidmap* m) {
+	struct pidmap old = *m;
+	m->capacity = old.capacity == 0 ? DA_INIT_CAP : old.capacity*2;
+	m->slots = calloc(m->capacity, sizeof(*m->slots));
+	ASSERT(m->slots != NULL, "out of memory");
+	m->count = 0;
+	for (size_t i = 0; i < old.capacity; i += 1)
+		if (old.slots[i].pid != 0) pidmap_put(m, old.slots[i].pid, old.slots[i].id);
+	free(old.slots);
+}
+
+void pidmap_put(struct pidmap* m, pid_t pid, uint32_t id) {
+	ASSERT(pid > 0, "pid must be positive");
+	if ((m->count + 1)*2 > m->capacity) pidmap_grow(m);
+
+	size_t i = pidmap_hash(pid, m->capacity);
+	while (m->slots[i].pid != 0)
+		i = (i + 1) & (m->capacity - 1);
+	m->slots[i] = (struct pidslot) {.pid = pid, .id = id};
+	m->count += 1;
+}
+
+/* remove pid from the map, returns its task id or 0 if it isn't one of ours */
+uint32_t pidmap_take(struct pidmap* m, pid_t pid) {
+	if (m->count == 0) return 0;
+
+	size_t mask = m->capacity - 1;
+	size_t i = pidmap_hash(pid, m->capacity);
+	while (m->slots[i].pid != pid) {
+		if (m->slots[i].pid == 0) return 0;
+		i = (i + 1) & mask;
+	}
+	uint32_t id = m->slots[i].id;
+
+	/* backward shift deletion, keeps probe sequences intact without tombstones */
+	for (size_t j = i;;) {
+		j = (j + 1) & mask;
+		if (m->slots[j].pid == 0) break;
+		size_t k = pidmap_hash(m->slots[j].pid, m->capacity);
+		bool inplace = i <= j ? (i < k && k <= j) : (i < k || k <= j);
+		if (inplace) continue;
+		m->slots[i] = m->slots[j];
+		i = j;
+	}
+	m->slots[i].pid = 0;
+	m->count -= 1;
+	return id;
+}
 
 struct qu {
 	int fd;
 	int clientfd;
-	size_t ntasks;
-	struct task tasks[MAX_TASK_COUNT];
+	int sigfd[2]; /* self-pipe, written on SIGCHLD */
+	size_t nactive; /* not counting background tasks */
+	size_t nbackground;
+	size_t maxbackground;
+	size_t maxjobs; /* 0 for no limit */
+	bool adaptive; /* the limit is adapt's instead of maxjobs */
+	struct adapt adapt;
+	struct psi psi;
+	struct topo topo;
+	bool placeall; /* every task is placed, not only those that ask for cores */
+	struct tasktab tasks;
+	struct readyq ready;
+	struct readyq bgready; /* background tasks, they don't wait for the tasks in ready */
+	struct {
+		uint32_t* items; /* ready tasks that didn't fit, in the order they became ready */
+		size_t count;
+		size_t capacity;
+	} held;
+	struct capacity cap;
+	struct pidmap pids; /* running tasks */
+	struct wheel timers;
+	struct cgroot cg;
+	struct zygote zy;
+	struct execcache exec;
+	struct strtab strs; /* every string of every task */
+	istr pathenv; /* PATH=... of the daemon, 0 if it has none */
+	istr daemonenv; /* environment vector of the daemon */
+	struct {
+		istr* items; /* environment vector of each template, by id - 1 */
+		size_t count;
+		size_t capacity;
+	} envs;
+	uint64_t rng; /* xorshift state for retry jitter */
+	struct strmap keys; /* idempotency key -> id of the last task submitted with it */
+	uint64_t ncoalesced; /* submits answered with a task that hadn't finished */
+	uint64_t nreused; /* submits answered with a task that had succeeded */
+	struct memocache memo;
+	struct ratelimit limit;
+	size_t maxpending;
+	uint64_t maxtables;
+	uint64_t nbusy; /* submits turned away by maxpending */
+	uint64_t nfull; /* submits, template starts and hedge copies refused by maxtables */
+	struct runtimes runtimes;
+	bool sjf;
+	uint64_t dlmet; /* tasks with a deadline that finished by it */
+	uint64_t dlmissed;
+	uint64_t dlatrisk; /* submitted though they were expected to miss their deadline */
+	uint64_t dlrefused; /* not submitted because they were expected to miss it */
+	struct tokens tokens;
+	struct jobserver js;
+	uint64_t nhedged; /* copies started next to straggling tasks */
+	uint64_t ncopywon; /* of them, the ones that finished first */
+	uint64_t nrecurred; /* starts of templates */
+	uint64_t nrecurskipped; /* starts skipped while the template's last copy hadn't finished */
+	uint64_t nrecurmissed; /* intervals missed while the daemon was busy */
+	struct workers workers;
+	struct strmap leaseqs; /* queue -> struct idqueue* of the ready tasks for workers */
+	uint64_t leasems;
 };
 
+/* timer kinds */
+#define TIMER_START 0
+#define TIMER_TERM  1 /* the task ran past its timeout */
+#define TIMER_KILL  2 /* the task outlived the grace period after TIMER_TERM */
+#define TIMER_CGROUP 3 /* retry removing the cgroup leaf of a finished task */
+#define TIMER_ADAPT  4 /* end of a window of the adaptive limit, not for a task */
+#define TIMER_RUNTIMES 5 /* save the runtimes and the memo index, not for a task */
+#define TIMER_HEDGE 6 /* the task runs for longer than its command usually does */
+#define TIMER_LEASE 7 /* a worker may have gone silent, for the worker instead of a task */
+
+#define RUNTIMES_SAVE_MS (60*1000)
+#define HEDGE_FACTOR 2.0 /* of the runtime few runs go past, see runtimes_high() */
+#define HEDGE_MIN_RUNS 5 /* runs of a command before it's known well enough to hedge */
+#define HEDGE_RETRY_MS 1000 /* wait for a free slot this long at a time */
+
+#define DEFAULT_GRACE_MS 10000
+#define DEFAULT_BACKOFF_MS 1000
+#define DEFAULT_BACKOFF_MAX_MS (5*60*1000)
+
+static
+uint64_t now_ms(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec*1000 + ts.tv_nsec/1000000;
+}
+
 static bool had_sigintr = false;
+static int sigchld_fd = -1;
 
 static
 void qu_sigintr(UNUSED int sig) {
@@ -164,11 +754,81 @@ void qu_sigintr(UNUSED int sig) {
 	loginfo("received SIGINT");
 }
 
-void qu_init(struct qu* qu, UNUSED struct config* conf) {
+static
+void qu_sigchld(UNUSED int sig) {
+	int saved = errno;
+	(void)!write(sigchld_fd, "", 1);
+	errno = saved;
+}
+
+static
+void setfdflags(int fd, int fdflags, int flflags) {
+	if (fcntl(fd, F_SETFD, fcntl(fd, F_GETFD) | fdflags) == -1 ||
+	    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | flflags) == -1) {
+		perror("fcntl");
+		exit(1);
+	}
+}
+
+void qu_init(struct qu* qu, struct config* conf) {
 	if (qu == NULL) return;
 
-	for (size_t i = 0; i < MAX_TASK_COUNT; i += 1)
-		qu->tasks[i].state = TS_INVALID;
+	wheel_init(&qu->timers, now_ms());
+	qu->rng = ((uint64_t)time(NULL) << 20) ^ (uint64_t)getpid() ^ now_ms();
+	if (qu->rng == 0) qu->rng = 1;
+
+	qu->cg.fd = -1;
+	if (!conf->nocgroup) {
+		if (cg_init(&qu->cg)) loginfo("tasks run in cgroups under %s", qu->cg.path);
+		else loginfo("cgroup v2 isn't available, tasks run in process groups only");
+	}
+
+	/* the zygote inherits the ends of the jobserver, for the tasks */
+	qu->js.fd = -1;
+	if (conf->jobtokens > 0) {
+		if (jobserver_init(&qu->js, DEFAULT_JOBSERVER, conf->jobtokens))
+			loginfo("jobserver %s of %zu tokens", DEFAULT_JOBSERVER, qu->js.tokens);
+		else logerr("jobserver: %s, tasks run without one", strerror(errno));
+	}
+
+	/* before the rest is set up, the zygote should inherit as little as possible */
+	qu->zy.pid = -1;
+	if (conf->zygote >= 0) {
+		if (zygote_start(&qu->zy, conf->zygote)) loginfo("zygote %d spawns tasks", qu->zy.pid);
+		else perror("zygote");
+		/* so the tasks of a zygote that dies are ours to reap, and not init's */
+		if (qu->zy.pid != -1 && prctl(PR_SET_CHILD_SUBREAPER, 1) == -1) perror("prctl");
+	}
+
+	if (!execcache_init(&qu->exec)) perror("inotify");
+	if (topo_init(&qu->topo)) loginfo("%zu cpus on %zu numa nodes", qu->topo.cpus.count, qu->topo.nodes.count);
+	else logerr("couldn't read the cpu topology, tasks aren't pinned");
+	qu->placeall = conf->placeall;
+	long pages = sysconf(_SC_PHYS_PAGES), pagesize = sysconf(_SC_PAGESIZE);
+	qu->cap.total.cpus = conf->cpus > 0 ? conf->cpus : (qu->topo.cpus.count > 0 ? qu->topo.cpus.count : 1)*1000;
+	qu->maxbackground = conf->maxbackground > 0 ? conf->maxbackground : qu->topo.cpus.count > 0 ? qu->topo.cpus.count : 1;
+	qu->cap.total.mem = conf->mem > 0 ? conf->mem : pages > 0 && pagesize > 0 ? (uint64_t)pages*pagesize : UINT64_MAX;
+	qu->tokens = conf->tokens;
+	for (size_t i = 0; i < qu->tokens.count; i += 1)
+		loginfo("resource %s of %u tokens", qu->tokens.items[i].name, qu->tokens.items[i].total);
+	memo_init(&qu->memo, conf->memodir, conf->memobudget);
+	runtimes_init(&qu->runtimes, conf->runtimesfile);
+	qu->sjf = conf->sjf;
+	wheel_add(&qu->timers, now_ms() + RUNTIMES_SAVE_MS, 0, TIMER_RUNTIMES);
+	qu->limit.rate = conf->rate;
+	qu->limit.burst = conf->burst;
+	qu->maxpending = conf->maxpending;
+	qu->maxtables = conf->maxtables;
+	qu->leasems = conf->leasems;
+	const char* path = getenv("PATH");
+	if (path != NULL) {
+		char pathenv[strlen("PATH=") + strlen(path) + 1];
+		snprintf(pathenv, sizeof(pathenv), "PATH=%s", path);
+		qu->pathenv = intern_str(&qu->strs, pathenv);
+	}
+	uint32_t envc = 0;
+	while (environ[envc] != NULL) envc += 1;
+	qu->daemonenv = intern_strv(&qu->strs, environ, envc);
 
 	struct sigaction act = {0};
 	sigemptyset(&act.sa_mask);
@@ -179,188 +839,2057 @@ void qu_init(struct qu* qu, UNUSED struct config* conf) {
 		exit(1);
 	}
 
+	if (pipe(qu->sigfd) == -1) {
+		perror("pipe");
+		exit(1);
+	}
+	setfdflags(qu->sigfd[0], FD_CLOEXEC, O_NONBLOCK);
+	setfdflags(qu->sigfd[1], FD_CLOEXEC, O_NONBLOCK);
+	sigchld_fd = qu->sigfd[1];
+
+	act.sa_handler = &qu_sigchld;
+	act.sa_flags = SA_NOCLDSTOP;
+	if (sigaction(SIGCHLD, &act, NULL) == -1) {
+		perror("sigaction");
+		exit(1);
+	}
+
 	qu->fd = listener();
-	qu->ntasks = 0;
+	setfdflags(qu->fd, FD_CLOEXEC, 0);
+	qu->nactive = 0;
+	qu->maxjobs = conf->maxjobs;
+	qu->adaptive = conf->adaptive;
+	if (qu->adaptive) {
+		long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+		if (ncpu < 1) ncpu = 1;
+		double max = qu->maxjobs > 0 ? (double)qu->maxjobs : 4.0*ncpu;
+		adapt_init(&qu->adapt, 1, max, ncpu, now_ms());
+		psi_open(&qu->psi);
+		wheel_add(&qu->timers, now_ms() + ADAPT_WINDOW_MS, 0, TIMER_ADAPT);
+		loginfo("adaptive limit, %zu tasks at first, at most %.0f", adapt_limit(&qu->adapt), max);
+	}
 	qu->clientfd = -1;
 }
 
-static inline
-int task_getid(struct task* task) {
-	if (task == NULL) return -1;
-	return (int)((size_t)task & 0xffffffff);
+struct task* qu_gettask(struct qu* qu, uint32_t id) {
+	return tasktab_get(&qu->tasks, id);
 }
 
-int qu_addtask(struct qu* qu, struct task* task) {
-	if (qu->ntasks == MAX_TASK_COUNT) return -1;
+uint32_t qu_addtask(struct qu* qu, struct task* task) {
 	ASSERT(task != NULL, "cannot add null task");
-
-	qu->tasks[qu->ntasks] = *task;
-	qu->ntasks += 1;
-	/* unnecessary but WTH */
-	return task_getid(&qu->tasks[qu->ntasks - 1]);
+	return tasktab_add(&qu->tasks, task);
 }
 
-int qu_runtask(UNUSED struct qu* qu, int taskid) {
-	struct task *task = NULL;
-	for (size_t i = 0; i < qu->ntasks; i += 1) {
-		if (taskid == task_getid(qu->tasks + i)) {
-			task = qu->tasks + i;
-			break;
-		}
-	}
+/* whether the task and string tables reached -S. tasks and strings are never freed, a
+   daemon whose tables are full stays so: it takes no new tasks, neither submitted nor
+   started by templates or hedging. a retry keeps the row of its task and still happens
+*/
+static
+bool qu_tablesfull(struct qu* qu) {
+	return qu->maxtables > 0 && tasktab_bytes(&qu->tasks) + strtab_bytes(&qu->strs) >= qu->maxtables;
+}
 
-	if (task == NULL) return -1;
+static double qu_runtime(struct qu* qu, struct task* task);
 
-	task_run(task);
+/* the ready tasks of queue that wait for a worker, NULL if none ever did unless create is set */
+static
+struct idqueue* qu_leaseq(struct qu* qu, const char* queue, bool create) {
+	struct idqueue* q = strmap_get(&qu->leaseqs, queue);
+	if (q != NULL || !create) return q;
+	q = calloc(1, sizeof(*q));
+	ASSERT(q != NULL, "out of memory");
+	/* the name is interned or the default queue's, it outlives the map */
+	strmap_put(&qu->leaseqs, queue, q);
+	return q;
+}
 
-	return 0;
+/* a task that can start, background tasks have a queue of their own and tasks for
+   workers one for each of their queues. commands that never ran are taken for short
+   with sjf, so they're soon known
+*/
+static
+void qu_ready(struct qu* qu, struct task* task) {
+	if (task->worker) {
+		idqueue_push(qu_leaseq(qu, task_queue(&qu->strs, task), true), task->id);
+		return;
+	}
+	uint64_t sjf = 0;
+	if (qu->sjf && task->deadline == 0) {
+		double r = qu_runtime(qu, task);
+		sjf = now_ms() + (r > 0 ? (uint64_t)r : 0);
+	}
+	readyq_push(task->background ? &qu->bgready : &qu->ready, task->id, task->deadline, sjf);
 }
 
-int qu_poll(struct qu* qu, uint32_t timeout /* in seconds */) {
-	int nactive = 0;
-	int status = 0;
-	for (size_t i = 0; i < qu->ntasks; i += 1) {
-		struct task* task = &qu->tasks[i];
-		ASSERT(task->id > 0, "this task was not initialized");
+/* the task finished: walk its direct successors only, releasing the ones that have
+   no unfinished dependencies left and cancelling the after-ok ones if it failed.
+   cancellations cascade through the graph, so this works off a worklist.
+*/
+static
+void qu_release(struct qu* qu, uint32_t id) {
+	static struct {
+		uint32_t* items;
+		size_t count;
+		size_t capacity;
+	} work = {0};
 
-		/* maybe this task terminated before we got to poll on it */
-		if (task->state == TS_EXITED) continue;
+	da_append(&work, id);
+	while (work.count > 0) {
+		struct task* t = qu_gettask(qu, work.items[--work.count]);
+		bool ok = task_isok(&qu->tasks, t);
 
-		/* TODO:
-			this returns -1 (and exit with 1) if there's no task is in TS_ACTIVE state.
-			it's results should instead be interpreted as part of what is returned by poll(),
-			with the task states updated approriately
-		*/
-		int id = waitpid(task->id, &status, WNOHANG);
-		switch (id) {
-		case -1:
-			perror("waitpid");
-			exit(1);
-		case 0:
-			if (task->state == TS_ACTIVE) nactive += 1;
-			continue;
-		default:
-			if (WIFEXITED(status)) {
-				loginfo("task %d done", task->id);
-				task->state = TS_EXITED;
-				task->exitcode = WEXITSTATUS(status);
-			} else ASSERT(false, "what are we even doing?");
-		}
-	}
+		struct edges* succ = side_get(&qu->tasks.succ, t->id);
+		for (size_t i = 0; succ != NULL && i < succ->count; i += 1) {
+			struct edge e = succ->items[i];
+			struct task* s = qu_gettask(qu, e.id);
+			/* an earlier failed dependency may have cancelled it already */
+			state_t st = task_state(&qu->tasks, s);
+			if (st != TS_WAITING && st != TS_SCHEDULED) continue;
 
-	struct pollfd pfd = {
-		.fd = qu->fd,
-		.events = POLLIN,
-		.revents = -1,
-	};
+			if (!ok && e.kind == DEP_AFTEROK) {
+				loginfo("task %u cancelled, dependency %u failed", s->id, t->id);
+				if (s->timer != NULL) {
+					wheel_release(&qu->timers, s->timer);
+					s->timer = NULL;
+				}
+				task_setstate(&qu->tasks, s, TS_CANCELLED);
+				da_append(&work, s->id);
+				continue;
+			}
 
-	while (1) {
-		status = poll(&pfd, 1, 1000*timeout);
-		if (status == -1) {
-			/* TODO(Thu 19 Jun 23:14:51 WAT 2025):
-				the more sensible thing to do here is to block signals that may interrupt
-				this poll
-			*/
-			if (errno == EINTR) {
-				return -1;
+			s->ndeps -= 1;
+			/* a scheduled task goes to the ready queue when its timer fires */
+			if (s->ndeps == 0 && st == TS_WAITING) {
+				task_setstate(&qu->tasks, s, TS_INACTIVE);
+				qu_ready(qu, s);
 			}
-			perror("poll");
-			exit(1);
 		}
-		break;
+		/* cancelling and readying don't add dependents, succ stays put */
+		if (succ != NULL) da_free(succ);
 	}
+}
 
-	bool has_client = (status > 0) && ((pfd.revents & POLLIN) == POLLIN);
-	if (has_client) {
-		int fd = accept(qu->fd, NULL, NULL);
-		if (fd == -1) {
-			perror("accept");
-			exit(1);
-		}
-		qu->clientfd = fd;
-	}
+/* the cached path of the task's command, as long as it's searched for on the same PATH as the daemon's */
+static
+const char* qu_execpath(struct qu* qu, struct task* task) {
+	/* interned, the same string is the same handle */
+	if ((task->env != 0 || task->envover != 0) &&
+	    task_getenv(&qu->strs, task, qu->daemonenv, "PATH") != qu->pathenv)
+		return NULL;
+	return execcache_resolve(&qu->exec, task_name(&qu->strs, task));
+}
 
-	return nactive;
+/* hash an input of a memoized task, false if it can't be read */
+static
+bool qu_hashinput(struct memohash* h, const char* path, uint8_t memo) {
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
+	struct stat st;
+	if (fd == -1 || fstat(fd, &st) == -1) {
+		if (fd != -1) close(fd);
+		return false;
+	}
+	uint64_t size = st.st_size;
+	memohash_update(h, &size, sizeof(size));
+	if (memo == MEMO_CONTENT && S_ISREG(st.st_mode)) {
+		char buf[64*1024];
+		ssize_t n;
+		while ((n = read(fd, buf, sizeof(buf))) > 0) memohash_update(h, buf, n);
+		close(fd);
+		return n == 0;
+	}
+	int64_t mtime[2] = {st.st_mtim.tv_sec, st.st_mtim.tv_nsec};
+	memohash_update(h, mtime, sizeof(mtime));
+	close(fd);
+	return true;
 }
 
-void qu_handleclient(struct qu* qu, struct wire_frame* frame) {
-	ASSERT(frame != NULL, "got null frame");
-	ASSERT(qu->clientfd > -1, "clientfd is negative");
+/* the memo key of a task about to run with a, false if one of its inputs can't be read */
+static
+bool qu_memokey(struct qu* qu, struct task* task, struct spawnargs* a, char key[MEMO_KEYLEN + 1]) {
+	struct memohash h;
+	memohash_init(&h);
+	for (const char** s = a->argv; *s != NULL; s += 1) memohash_str(&h, *s);
+	memohash_str(&h, NULL);
+	const char** envp = a->envp != NULL ? a->envp : (const char**)environ;
+	for (const char** e = envp; *e != NULL; e += 1) memohash_str(&h, *e);
+	memohash_str(&h, NULL);
+	memohash_str(&h, a->cwd);
 
-	switch (frame->kind) {
-	case KIND_KILL:
-		dprintf(qu->clientfd, "killed [%d]\n", frame->m.kill.pid);
-		break;
-	case KIND_LIST:
-		/* handle client */
-		for (size_t i = 0; i < qu->ntasks; i += 1) {
-			struct task* t = &qu->tasks[i];
-			loginfo("sent: [%d] %s %s (%s)", t->id, t->name, t->arg, state2str(t->state));
-			dprintf(qu->clientfd, "[%d] %s %s (%s)\n", t->id, t->name, t->arg, state2str(t->state));
+	uint32_t n = task->inputs != 0 ? ivec_len(&qu->strs, task->inputs) : 0;
+	for (uint32_t i = 0; i < n; i += 1) {
+		const char* path = ivec_get(&qu->strs, task->inputs, i);
+		memohash_str(&h, path);
+		if (!qu_hashinput(&h, path, task->memo)) {
+			logerr("task %u input %s: %s, not memoized", task->id, path, strerror(errno));
+			return false;
 		}
-		break;
-	default:
-		logerr("unknown command: %u", frame->kind);
-		dprintf(qu->clientfd, "error: unknown command\n");
 	}
-	close(qu->clientfd);
-	qu->clientfd = -1;
+	memohash_hex(&h, key);
+	return true;
 }
 
-///////////////////////////////////
+/* copy the output of the run of task id, or the memoized result key, to the daemon's */
+static
+void qu_memoreplay(struct qu* qu, const char* key, uint32_t id) {
+	char name[MEMO_KEYLEN + 16];
+	const char* exts[] = {"out", "err"};
+	for (int fd = STDOUT_FILENO; fd <= STDERR_FILENO; fd += 1) {
+		if (key != NULL) snprintf(name, sizeof(name), "%s.%s", key, exts[fd - STDOUT_FILENO]);
+		else snprintf(name, sizeof(name), "run.%u.%s", id, exts[fd - STDOUT_FILENO]);
+		memo_copy(&qu->memo, name, fd);
+	}
+}
 
-int main(int argc, char* argv[]) {
-	int tid;
-	int code;
-	struct qu qu = {0};
-	struct task t = {0};
-	struct wire_frame* frame;
-	static char buf[4096];
-	struct config conf = parse_conf(argc, argv);
+/* the argv of a task as pointers, in a buffer reused by the next call */
+static
+const char* const* qu_argv(struct qu* qu, struct task* task, size_t* argc) {
+	static struct strvec v = {0};
+	v.count = 0;
+	*argc = ivec_len(&qu->strs, task->argv);
+	for (uint32_t i = 0; i < *argc; i += 1) da_append(&v, ivec_get(&qu->strs, task->argv, i));
+	return v.items;
+}
 
-	qu_init(&qu, &conf);
-	code = 0;
+/* expected ms the task runs for, negative if its command never ran to completion */
+static
+double qu_runtime(struct qu* qu, struct task* task) {
+	size_t argc;
+	const char* const* argv = qu_argv(qu, task, &argc);
+	return runtimes_estimate(&qu->runtimes, argv, argc);
+}
 
-	t = newtask("sleep", "5");
-	tid = qu_addtask(&qu, &t);
-	qu_runtask(&qu, tid);
+/* a task finished for good, count whether it made its deadline */
+static
+void qu_deadline(struct qu* qu, struct task* task) {
+	if (task->deadline == 0) return;
+	if (task->ended <= task->deadline) {
+		qu->dlmet += 1;
+		return;
+	}
+	qu->dlmissed += 1;
+	loginfo("task %u missed its deadline by %llums", task->id, (unsigned long long)(task->ended - task->deadline));
+}
 
-	t = newtask("sleep", "7");
-	tid = qu_addtask(&qu, &t);
-	qu_runtask(&qu, tid);
+/* give back the cpus a task was placed on */
+static
+void qu_unplace(struct qu* qu, struct task* task) {
+	istr* placement = side_get(&qu->tasks.placement, task->id);
+	if (placement == NULL || *placement == 0) return;
+	uint32_t n = istr_len(&qu->strs, *placement)/sizeof(uint16_t);
+	uint16_t idx[n];
+	memcpy(idx, istr_get(&qu->strs, *placement), sizeof(idx));
+	topo_release(&qu->topo, task->cores, idx, n);
+	*placement = 0;
+}
 
-	for (;;) {
-		if (had_sigintr) {
-			code = 1;
-			goto qu_shutdown;
-		}
-		qu_poll(&qu, -1);
+/* the named resources a task needs, into need with room for TOKENS_MAX, returns how many */
+static
+size_t qu_tokens(struct qu* qu, struct task* task, struct tokenneed* need) {
+	if (task->tokens == 0) return 0;
+	uint32_t len = istr_len(&qu->strs, task->tokens);
+	memcpy(need, istr_get(&qu->strs, task->tokens), len);
+	return len/sizeof(*need);
+}
 
-		if (qu.clientfd < 0) {
-			continue;
+/* wake the tasks waiting on resource i from the head, as many as its free tokens fit.
+   their tokens are reserved, and they're held so the next dispatch tries them before
+   any ready task
+*/
+static
+void qu_tokenwake(struct qu* qu, uint32_t i) {
+	uint32_t id;
+	while ((id = tokens_waiter(&qu->tokens, i)) != 0) {
+		struct task* w = qu_gettask(qu, id);
+		if (task_state(&qu->tasks, w) == TS_INACTIVE) {
+			struct tokenneed wneed[TOKENS_MAX];
+			size_t wn = qu_tokens(qu, w, wneed);
+			uint32_t k = 0;
+			for (size_t j = 0; j < wn; j += 1)
+				if (wneed[j].token == i) k = wneed[j].n;
+			if (k > tokens_free(&qu->tokens, i)) break;
+			qu->tokens.items[i].reserved += k;
+			w->woken = (uint8_t)(i + 1);
+			if (w->background) qu_ready(qu, w);
+			else da_append(&qu->held, id);
 		}
+		tokens_unwait(&qu->tokens, i);
+	}
+}
 
-		/* TODO:
-			the more sensible thing to do here is to block signals that may interrupt
-			this read
-		* see TODO(Thu 19 Jun 23:14:51 WAT 2025)
-		*/
-		int n = read(qu.clientfd, buf, sizeof(buf));
-		switch (n) {
-		default:
-			printf("got: ");
-			xxd((const uint8_t*)buf, n);
+/* a woken task gives up the tokens reserved for it, when it took them or won't. unless
+   it took them, the tasks that wait on them are woken
+*/
+static
+void qu_tokenunreserve(struct qu* qu, struct task* task, bool took) {
+	if (task->woken == 0) return;
+	uint32_t i = task->woken - 1;
+	task->woken = 0;
+	struct tokenneed need[TOKENS_MAX];
+	size_t n = qu_tokens(qu, task, need);
+	for (size_t j = 0; j < n; j += 1)
+		if (need[j].token == i) qu->tokens.items[i].reserved -= need[j].n;
+	if (!took) qu_tokenwake(qu, i);
+}
+
+/* whether a task has to wait for a named resource, it's then put on its waiters */
+static
+bool qu_tokenwait(struct qu* qu, struct task* task) {
+	struct tokenneed need[TOKENS_MAX];
+	size_t n = qu_tokens(qu, task, need);
+	int i = tokens_short(&qu->tokens, need, n, (int)task->woken - 1);
+	if (i < 0) return false;
+	/* another resource it needs is short, it waits on that one without a reservation */
+	qu_tokenunreserve(qu, task, false);
+	tokens_wait(&qu->tokens, i, task->id);
+	return true;
+}
+
+/* give back the tokens of a task and wake the tasks waiting on them that fit now */
+static
+void qu_tokengive(struct qu* qu, struct task* task) {
+	struct tokenneed need[TOKENS_MAX];
+	size_t n = qu_tokens(qu, task, need);
+	tokens_give(&qu->tokens, need, n);
+	for (size_t i = 0; i < n; i += 1) qu_tokenwake(qu, need[i].token);
+}
 
-			ASSERT((size_t)n >= sizeof(struct wire_frame), "wire frame size is incorrect");
+/* MAKEFLAGS=... for a task to use the jobserver, on top of the flags it has. NULL without
+   a jobserver, the string is reused by the next call
+*/
+static
+const char* qu_makeflags(struct qu* qu, struct task* task) {
+	static char* buf = NULL;
+	if (qu->js.fd == -1) return NULL;
+	istr cur = task_getenv(&qu->strs, task, qu->daemonenv, "MAKEFLAGS");
+	const char* flags = cur != 0 ? istr_get(&qu->strs, cur) + strlen("MAKEFLAGS=") : "";
+	size_t len = strlen(flags) + 64;
+	buf = realloc(buf, len);
+	ASSERT(buf != NULL, "out of memory");
+	snprintf(buf, len, "MAKEFLAGS=%s%s-j%zu --jobserver-auth=%d,%d", flags, *flags != '\0' ? " " : "",
+		qu->js.tokens, qu->js.ends[0], qu->js.ends[1]);
+	return buf;
+}
 
-			frame = (struct wire_frame*)buf;
-			wire_frame_print(frame);
+/* whether a task that isn't a background one may start, there's a slot under the limit
+   and a token of the jobserver if there is one
+*/
+static
+bool qu_hasslot(struct qu* qu, size_t limit) {
+	if (limit > 0 && qu->nactive >= limit) return false;
+	return qu->js.fd == -1 || jobserver_free(&qu->js) > 0;
+}
+
+int qu_runtask(struct qu* qu, uint32_t id) {
+	struct task* task = qu_gettask(qu, id);
+	if (task == NULL) return -1;
+
+	struct spawnargs a;
+	task_spawnargs(&qu->strs, task, qu->daemonenv, qu_execpath(qu, task), qu_makeflags(qu, task), &a);
+	if (qu->js.fd != -1) a.jobfds = qu->js.ends;
+
+	char key[MEMO_KEYLEN + 1], out[PATH_MAX], err[PATH_MAX];
+	task->memokey = 0;
+	if (task->memo != MEMO_NONE && memo_open(&qu->memo) && qu_memokey(qu, task, &a, key)) {
+		if (memo_get(&qu->memo, key) != NULL) {
+			loginfo("task %u memoized as %s", id, key);
+			qu_memoreplay(qu, key, id);
+			qu_tokenunreserve(qu, task, false);
+			task->cached = true;
+			task->exitcode = 0;
+			task->started = task->ended = now_ms();
+			task_setstate(&qu->tasks, task, TS_EXITED);
+			qu_deadline(qu, task);
+			qu_release(qu, id);
+			return 0;
+		}
+		task->memokey = intern(&qu->strs, key, MEMO_KEYLEN);
+		memo_runpath(&qu->memo, id, "out", out, sizeof(out));
+		memo_runpath(&qu->memo, id, "err", err, sizeof(err));
+		a.stdoutpath = out;
+		a.stderrpath = err;
+	}
+
+	capacity_take(&qu->cap, task_res(task));
+	struct tokenneed need[TOKENS_MAX];
+	tokens_take(&qu->tokens, need, qu_tokens(qu, task, need));
+	qu_tokenunreserve(qu, task, true);
+	/* a job may take the token dispatch saw first, the task runs anyway */
+	task->jstoken = qu->js.fd != -1 && !task->background && jobserver_take(&qu->js);
+	cpu_set_t cpus;
+	if (task->cores > 0 || qu->placeall) {
+		uint16_t idx[qu->topo.cpus.count + 1];
+		size_t n = topo_place(&qu->topo, task->cores, idx);
+		if (n > 0) {
+			istr placement = intern(&qu->strs, (const char*)idx, n*sizeof(*idx));
+			*(istr*)side_at(&qu->tasks.placement, id) = placement;
+			topo_cpuset(&qu->topo, idx, n, &cpus);
+			a.cpus = &cpus;
+		}
+	}
+
+	struct tasklimits l = task_limits(&qu->strs, task);
+	if (!task_run(&qu->tasks, task, &l, &a, &qu->cg, &qu->zy)) {
+		perror("fork");
+		qu_unplace(qu, task);
+		capacity_give(&qu->cap, task_res(task));
+		qu_tokengive(qu, task);
+		if (task->jstoken) jobserver_give(&qu->js);
+		task->jstoken = false;
+		task_setstate(&qu->tasks, task, TS_EXITED);
+		task->exitcode = 127;
+		qu_release(qu, id);
+		return -1;
+	}
+	pidmap_put(&qu->pids, task_pid(&qu->tasks, task), id);
+	if (task->background) qu->nbackground += 1;
+	else qu->nactive += 1;
+	task->started = now_ms();
+	if (l.timeout > 0)
+		task->timer = wheel_add(&qu->timers, task->started + l.timeout, id, TIMER_TERM);
+	task->killsig = 0;
+	struct hedge* h = side_get(&qu->tasks.hedges, id);
+	if (h != NULL) {
+		h->copy = 0;
+		h->lost = false;
+	}
+	if (task->hedge) {
+		size_t argc;
+		const char* const* argv = qu_argv(qu, task, &argc);
+		double high = runtimes_high(&qu->runtimes, argv, argc, HEDGE_MIN_RUNS);
+		if (high >= 0) {
+			h = side_at(&qu->tasks.hedges, id);
+			h->timer = wheel_add(&qu->timers, task->started + (uint64_t)(HEDGE_FACTOR*high) + 1, id, TIMER_HEDGE);
+		}
+	}
+
+	return 0;
+}
+
+/* ready tasks looked at behind the first one that didn't fit, so a big task at the
+   head of millions doesn't make every dispatch scan them all
+*/
+#define BACKFILL_DEPTH 64
+
+struct backfill {
+	bool reserved; /* a task didn't fit, the rest are backfilled behind it */
+	uint64_t shadow;
+	struct res extra;
+};
+
+/* whether a ready task may start now, see capacity.h */
+static
+bool qu_canstart(struct qu* qu, struct task* task, struct backfill* bf) {
+	struct res need = task_res(task);
+	if (!res_fits(need, capacity_free(&qu->cap))) {
+		if (bf->reserved) return false;
+		/* the first task that doesn't fit gets the reservation */
+		static struct {
+			struct release* items;
+			size_t count;
+			size_t capacity;
+		} rel = {0};
+		rel.count = 0;
+		for (size_t i = 0; i < qu->pids.capacity; i += 1) {
+			if (qu->pids.slots[i].pid == 0) continue;
+			struct task* t = qu_gettask(qu, qu->pids.slots[i].id);
+			uint64_t timeout = task_limits(&qu->strs, t).timeout;
+			uint64_t end = timeout > 0 ? t->started + timeout : NO_END;
+			da_append(&rel, ((struct release) {.end = end, .res = task_res(t)}));
+		}
+		capacity_reserve(&qu->cap, need, rel.items, rel.count, &bf->shadow, &bf->extra);
+		bf->reserved = true;
+		return false;
+	}
+	if (!bf->reserved) return true;
+
+	uint64_t timeout = task_limits(&qu->strs, task).timeout;
+	uint64_t end = timeout > 0 ? now_ms() + timeout : NO_END;
+	if (end < bf->shadow) {
+		qu->cap.backfilled += 1;
+		return true;
+	}
+	if (res_fits(need, bf->extra)) {
+		bf->extra.cpus -= need.cpus;
+		bf->extra.mem -= need.mem;
+		qu->cap.backfilled += 1;
+		return true;
+	}
+	return false;
+}
+
+static void qu_serve(struct qu* qu);
+
+/* start tasks whose dependencies are satisfied, as long as there are free slots and
+   the capacity they declared is free. tasks held back for their capacity go first.
+   tasks for workers go to the workers that wait for them
+*/
+void qu_dispatch(struct qu* qu) {
+	size_t limit = qu->adaptive ? adapt_limit(&qu->adapt) : qu->maxjobs;
+	struct backfill bf = {0};
+
+	size_t kept = 0;
+	for (size_t i = 0; i < qu->held.count; i += 1) {
+		uint32_t id = qu->held.items[i];
+		struct task* task = qu_gettask(qu, id);
+		/* cancelled while it waited */
+		if (task_state(&qu->tasks, task) != TS_INACTIVE || qu_tokenwait(qu, task)) continue;
+		if (!qu_hasslot(qu, limit) || !qu_canstart(qu, task, &bf)) qu->held.items[kept++] = id;
+		else qu_runtask(qu, id);
+	}
+	qu->held.count = kept;
+
+	while (readyq_count(&qu->ready) > 0 && qu_hasslot(qu, limit) && qu->held.count < BACKFILL_DEPTH) {
+		uint32_t id = readyq_pop(&qu->ready);
+		struct task* task = qu_gettask(qu, id);
+		if (task_state(&qu->tasks, task) != TS_INACTIVE || qu_tokenwait(qu, task)) continue;
+		if (qu_canstart(qu, task, &bf)) qu_runtask(qu, id);
+		else {
+			da_append(&qu->held, id);
+			qu->cap.held += 1;
+		}
+	}
+	if (qu->adaptive && limit > 0 && qu->nactive >= limit && readyq_count(&qu->ready) + qu->held.count > 0)
+		adapt_heldback(&qu->adapt);
+
+	/* background tasks go past the limit, first come first served, the memory they
+	   declared and the resources they need still have to be free
+	*/
+	while (readyq_count(&qu->bgready) > 0 && qu->nbackground < qu->maxbackground) {
+		uint32_t id = readyq_peek(&qu->bgready);
+		struct task* task = qu_gettask(qu, id);
+		if (task_state(&qu->tasks, task) == TS_INACTIVE && !res_fits(task_res(task), capacity_free(&qu->cap))) break;
+		readyq_pop(&qu->bgready);
+		if (task_state(&qu->tasks, task) == TS_INACTIVE && !qu_tokenwait(qu, task)) qu_runtask(qu, id);
+	}
+
+	qu_serve(qu);
+}
+
+/* expected ms from now until task would finish if it became ready after delay ms,
+   negative if its command never ran to completion. it waits for the running tasks of
+   its class and the ready ones due before it, spread over the slots of the class.
+   dependencies aren't taken into account
+*/
+static
+double qu_expected(struct qu* qu, struct task* task, uint64_t delay) {
+	double own = qu_runtime(qu, task);
+	if (own < 0) return -1;
+
+	size_t limit = task->background ? qu->maxbackground : qu->adaptive ? adapt_limit(&qu->adapt) : qu->maxjobs;
+	double wait = 0;
+	if (limit > 0) {
+		double work = 0;
+		struct dlheap* edf = task->background ? &qu->bgready.edf : &qu->ready.edf;
+		for (size_t i = 0; i < edf->count; i += 1) {
+			if (edf->items[i].deadline > task->deadline) continue;
+			double r = qu_runtime(qu, qu_gettask(qu, edf->items[i].id));
+			if (r > 0) work += r;
+		}
+		uint64_t now = now_ms();
+		for (size_t i = 0; i < qu->pids.capacity; i += 1) {
+			if (qu->pids.slots[i].pid == 0) continue;
+			struct task* t = qu_gettask(qu, qu->pids.slots[i].id);
+			double r = t->background == task->background ? qu_runtime(qu, t) - (double)(now - t->started) : 0;
+			if (r > 0) work += r;
+		}
+		wait = work/limit;
+	}
+	return (wait > delay ? wait : (double)delay) + own;
+}
+
+/* add a task that runs after deps have finished and delay ms have passed, a template
+   if every isn't 0. returns its id or 0 if a dependency doesn't exist
+*/
+uint32_t qu_submit(struct qu* qu, struct task* task, struct wire_dep* deps, uint32_t ndeps, uint64_t delay, uint64_t every) {
+	bool cancelled = false;
+	for (uint32_t i = 0; i < ndeps; i += 1) {
+		struct task* d = qu_gettask(qu, deps[i].id);
+		if (d == NULL) return 0;
+		if (task_isdone(&qu->tasks, d) && !task_isok(&qu->tasks, d) && deps[i].kind == DEP_AFTEROK)
+			cancelled = true;
+	}
+
+	/* a task can only depend on tasks that already exist, so the graph can't have cycles */
+	uint32_t id = qu_addtask(qu, task);
+	task = qu_gettask(qu, id);
+	if (cancelled) {
+		loginfo("task %u cancelled, a dependency failed", id);
+		task_setstate(&qu->tasks, task, TS_CANCELLED);
+		return id;
+	}
+
+	for (uint32_t i = 0; i < ndeps; i += 1) {
+		struct task* d = qu_gettask(qu, deps[i].id);
+		if (task_isdone(&qu->tasks, d)) continue;
+		struct edges* succ = side_at(&qu->tasks.succ, d->id);
+		da_append(succ, ((struct edge) {.id = id, .kind = deps[i].kind}));
+		task->ndeps += 1;
+	}
+
+	if (every > 0) ((struct recur*)side_at(&qu->tasks.recur, id))->every = every;
+	if (delay > 0 || every > 0) {
+		task_setstate(&qu->tasks, task, TS_SCHEDULED);
+		task->timer = wheel_add(&qu->timers, now_ms() + delay, id, TIMER_START);
+	} else if (task->ndeps > 0) {
+		task_setstate(&qu->tasks, task, TS_WAITING);
+	} else {
+		qu_ready(qu, task);
+	}
+	return id;
+}
+
+/* a new task that runs the way task does, without its state */
+static
+struct task task_copy(struct task* task) {
+	struct task t = newtask(task->argv);
+	t.env = task->env;
+	t.envover = task->envover;
+	t.cwd = task->cwd;
+	t.queue = task->queue;
+	t.limits = task->limits;
+	t.cores = task->cores;
+	t.cpus = task->cpus;
+	t.mem = task->mem;
+	t.background = task->background;
+	t.hedge = task->hedge;
+	t.tokens = task->tokens;
+	t.retry = task->retry;
+	t.memo = task->memo;
+	t.inputs = task->inputs;
+	t.worker = task->worker;
+	return t;
+}
+
+static
+void qu_timerstart(struct qu* qu, struct timer* timer) {
+	struct task* task = qu_gettask(qu, timer->id);
+	ASSERT(task->timer == timer, "start timer fired for a task that doesn't own it");
+
+	struct recur* r = side_get(&qu->tasks.recur, task->id);
+	if (r == NULL) {
+		wheel_release(&qu->timers, timer);
+		task->timer = NULL;
+		if (task->ndeps > 0) {
+			task_setstate(&qu->tasks, task, TS_WAITING);
+		} else {
+			task_setstate(&qu->tasks, task, TS_INACTIVE);
+			qu_ready(qu, task);
+		}
+		return;
+	}
+
+	/* fixed rate: the next start is a multiple of every from the first one,
+	   intervals missed while the daemon was busy are skipped
+	*/
+	uint64_t now = now_ms();
+	uint64_t period = r->every;
+	uint64_t next = timer->expires + period;
+	if (next <= now) {
+		uint64_t missed = (now - next)/period + 1;
+		qu->nrecurmissed += missed;
+		next += missed*period;
+	}
+	wheel_release(&qu->timers, timer);
+	task->timer = wheel_add(&qu->timers, next, task->id, TIMER_START);
+
+	/* the copies run as one task, its row is started again once it's done, so a
+	   template costs the same however long it runs. one that's still waiting or
+	   running when the next start is due makes it skip
+	*/
+	uint32_t tmpl = task->id;
+	struct task* c = qu_gettask(qu, r->copy);
+	if (c != NULL && !task_isdone(&qu->tasks, c)) {
+		qu->nrecurskipped += 1;
+		loginfo("template %u skipped a start, task %u hasn't finished", tmpl, c->id);
+		return;
+	}
+	if (c == NULL && qu_tablesfull(qu)) {
+		qu->nfull += 1;
+		logerr("template %u didn't start a copy, the tables are full", tmpl);
+		return;
+	}
+	qu->nrecurred += 1;
+	struct task t = task_copy(task);
+	if (c == NULL) {
+		/* the table may move when the copy is added */
+		uint32_t id = qu_addtask(qu, &t);
+		((struct recur*)side_get(&qu->tasks.recur, tmpl))->copy = id;
+		c = qu_gettask(qu, id);
+	} else {
+		/* what the last run left behind is the past */
+		t.id = c->id;
+		*c = t;
+		task_setpid(&qu->tasks, c, -1);
+		task_setstate(&qu->tasks, c, TS_INACTIVE);
+		struct attempts* tries = side_get(&qu->tasks.attempts, c->id);
+		if (tries != NULL) tries->count = 0;
+		struct hedge* h = side_get(&qu->tasks.hedges, c->id);
+		if (h != NULL) *h = (struct hedge) {0};
+	}
+	loginfo("task %u started from template %u", c->id, tmpl);
+	qu_ready(qu, c);
+}
+
+/* a running task ran out of time: SIGTERM it and give it a grace period to exit before SIGKILL */
+static
+void qu_timerkill(struct qu* qu, struct timer* timer) {
+	struct task* task = qu_gettask(qu, timer->id);
+	ASSERT(task->timer == timer, "kill timer fired for a task that doesn't own it");
+	ASSERT(task_state(&qu->tasks, task) == TS_ACTIVE, "kill timer fired for a task that isn't running");
+
+	bool term = timer->kind == TIMER_TERM;
+	wheel_release(&qu->timers, timer);
+	task->timer = NULL;
+	task->timedout = true;
+
+	loginfo("task %u timed out, sending %s", task->id, term ? "SIGTERM" : "SIGKILL");
+	if (task_signal(&qu->tasks, task, term ? SIGTERM : SIGKILL) == -1) {
+		perror("pidfd_send_signal");
+		return;
+	}
+	if (term)
+		task->timer = wheel_add(&qu->timers, now_ms() + task_limits(&qu->strs, task).grace, task->id, TIMER_KILL);
+}
+
+/* a running task straggles, past HEDGE_FACTOR times the runtime few runs of its command
+   go past. if there's a free slot that no ready task waits for, a copy of it starts next
+   to it and whichever finishes first is the task's result, see qu_hedgedone()
+*/
+static
+void qu_timerhedge(struct qu* qu, struct timer* timer) {
+	struct task* task = qu_gettask(qu, timer->id);
+	struct hedge* h = side_get(&qu->tasks.hedges, timer->id);
+	ASSERT(h != NULL && h->timer == timer, "hedge timer fired for a task that doesn't own it");
+	ASSERT(task_state(&qu->tasks, task) == TS_ACTIVE, "hedge timer fired for a task that isn't running");
+	wheel_release(&qu->timers, timer);
+	h->timer = NULL;
+	/* for good, the timer isn't set again */
+	if (qu_tablesfull(qu)) {
+		qu->nfull += 1;
+		return;
+	}
+
+	size_t limit = qu->adaptive ? adapt_limit(&qu->adapt) : qu->maxjobs;
+	bool room = task->background ?
+		qu->nbackground < qu->maxbackground && readyq_count(&qu->bgready) == 0 :
+		qu_hasslot(qu, limit) && readyq_count(&qu->ready) == 0 && qu->held.count == 0;
+	struct tokenneed need[TOKENS_MAX];
+	size_t n = qu_tokens(qu, task, need);
+	if (!room || !res_fits(task_res(task), capacity_free(&qu->cap)) || tokens_short(&qu->tokens, need, n, false) >= 0) {
+		h->timer = wheel_add(&qu->timers, now_ms() + HEDGE_RETRY_MS, task->id, TIMER_HEDGE);
+		return;
+	}
+
+	/* the copy has no retries of its own, the task retries if the result was a failure */
+	struct task t = task_copy(task);
+	t.hedge = false;
+	t.retry = 0;
+	uint32_t orig = task->id;
+	uint32_t id = qu_addtask(qu, &t);
+	task = qu_gettask(qu, orig);
+	/* the side table may move when the copy's entry is added too */
+	((struct hedge*)side_at(&qu->tasks.hedges, id))->copyof = orig;
+	((struct hedge*)side_get(&qu->tasks.hedges, orig))->copy = id;
+	qu->nhedged += 1;
+	loginfo("task %u straggles after %llums, copy started as task %u", orig,
+		(unsigned long long)(now_ms() - task->started), id);
+	qu_runtask(qu, id);
+}
+
+static void qu_timerlease(struct qu* qu, struct timer* timer);
+
+#define CGROUP_RETRY_MS 100 /* first wait to remove a leaf that's still busy again */
+#define CGROUP_GIVEUP_MS (5*60*1000)
+
+/* remove the cgroup leaf of a task that ended. the processes it killed may take a
+   moment to leave it, so a busy leaf is tried again, after waits as long as it has
+   been since the task ended, so they double. a process stuck in the kernel may
+   never leave, the leaf is left behind after CGROUP_GIVEUP_MS
+*/
+static
+void qu_cgremove(struct qu* qu, uint32_t id) {
+	if (cg_remove(&qu->cg, id)) return;
+	int err = errno;
+	uint64_t since = now_ms() - qu_gettask(qu, id)->ended;
+	if (since >= CGROUP_GIVEUP_MS) {
+		logerr("cgroup leaf of task %u still busy after %llums, left behind: %s", id,
+			(unsigned long long)since, strerror(err));
+		return;
+	}
+	wheel_add(&qu->timers, now_ms() + (since > CGROUP_RETRY_MS ? since : CGROUP_RETRY_MS), id, TIMER_CGROUP);
+}
+
+/* advance the timers to now and act on the ones that are due */
+static
+void qu_expire(struct qu* qu) {
+	wheel_update(&qu->timers, now_ms());
+
+	struct timer* timer;
+	while ((timer = wheel_next(&qu->timers)) != NULL) {
+		switch (timer->kind) {
+		case TIMER_START:
+			qu_timerstart(qu, timer);
+			break;
+		case TIMER_TERM:
+		case TIMER_KILL:
+			qu_timerkill(qu, timer);
+			break;
+		case TIMER_ADAPT: {
+			size_t before = adapt_limit(&qu->adapt);
+			adapt_tick(&qu->adapt, now_ms(), psi_read(&qu->psi));
+			if (adapt_limit(&qu->adapt) != before)
+				loginfo("adaptive limit %zu -> %zu", before, adapt_limit(&qu->adapt));
+			wheel_add(&qu->timers, now_ms() + ADAPT_WINDOW_MS, 0, TIMER_ADAPT);
+			wheel_release(&qu->timers, timer);
+		} break;
+		case TIMER_RUNTIMES:
+			if (!runtimes_save(&qu->runtimes)) logerr("runtimes %s: %s", qu->runtimes.path, strerror(errno));
+			memo_sync(&qu->memo);
+			wheel_add(&qu->timers, now_ms() + RUNTIMES_SAVE_MS, 0, TIMER_RUNTIMES);
+			wheel_release(&qu->timers, timer);
+			break;
+		case TIMER_HEDGE:
+			qu_timerhedge(qu, timer);
+			break;
+		case TIMER_LEASE:
+			qu_timerlease(qu, timer);
+			break;
+		case TIMER_CGROUP:
+			qu_cgremove(qu, timer->id);
+			wheel_release(&qu->timers, timer);
+			break;
+		default:
+			ASSERT(false, "unknown timer kind");
+		}
+	}
+}
+
+static
+uint64_t qu_rand(struct qu* qu) {
+	qu->rng ^= qu->rng << 13;
+	qu->rng ^= qu->rng >> 7;
+	qu->rng ^= qu->rng << 17;
+	return qu->rng;
+}
+
+/* whether kill sending signo means to end a task, rather than to probe, stop or wake it */
+static
+bool sig_ends(int signo) {
+	return signo == SIGTERM || signo == SIGKILL || signo == SIGINT || signo == SIGHUP || signo == SIGQUIT;
+}
+
+/* ms to wait before retry n, counting from 1, see struct wire_retry */
+static
+uint64_t qu_backoff(struct qu* qu, struct wire_retry* r, uint32_t n) {
+	uint64_t delay = r->backoff;
+	for (uint32_t i = 1; i < n && delay < r->backoffmax; i += 1) delay *= 2;
+	if (delay > r->backoffmax) delay = r->backoffmax;
+	return delay - qu_rand(qu) % (delay/2 + 1);
+}
+
+/* put a task that failed back on the timers if its retry policy allows it, the
+   failed attempt is recorded and the task keeps its id. its dependents wait for
+   the last attempt
+*/
+static
+bool qu_retry(struct qu* qu, struct task* task) {
+	if (task->retry == 0 || task->exitcode == 0 || task->killed) return false;
+	struct wire_retry r;
+	memcpy(&r, istr_get(&qu->strs, task->retry), sizeof(r));
+	struct attempts* tries = side_get(&qu->tasks.attempts, task->id);
+	if (tries != NULL && tries->count >= r.max) return false;
+	bool any = true;
+	for (size_t i = 0; i < sizeof(r.on); i += 1) any = any && r.on[i] == 0;
+	if (!any && (task->exitcode > 255 || (r.on[task->exitcode/8] & (1 << task->exitcode%8)) == 0)) return false;
+
+	uint64_t now = now_ms();
+	tries = side_at(&qu->tasks.attempts, task->id);
+	da_append(tries, ((struct attempt) {
+		.exitcode = task->exitcode,
+		.timedout = task->timedout,
+		.ms = now - task->started,
+	}));
+	task->timedout = false;
+
+	uint64_t delay = qu_backoff(qu, &r, tries->count);
+	loginfo("task %u retry %zu of %u in %llums", task->id, tries->count, r.max, (unsigned long long)delay);
+	task_setstate(&qu->tasks, task, TS_SCHEDULED);
+	task->timer = wheel_add(&qu->timers, now + delay, task->id, TIMER_START);
+	return true;
+}
+
+/* a task or its copy exited. the first of the two to finish is the result of both and
+   the other is killed: a copy that lost is done, a task that lost takes the result of
+   its copy once it's gone too. a copy killed some other way doesn't count as finished
+*/
+static
+void qu_hedgedone(struct qu* qu, struct task* task) {
+	struct hedge* h = side_get(&qu->tasks.hedges, task->id);
+	if (h == NULL) return;
+	if (h->lost) {
+		struct task* c = qu_gettask(qu, h->copy);
+		task->exitcode = c->exitcode;
+		task->timedout = c->timedout;
+		task->ended = c->ended;
+		return;
+	}
+	uint32_t other = h->copy != 0 ? h->copy : h->copyof;
+	if (other == 0 || (h->copyof != 0 && task->killed)) return;
+	struct task* o = qu_gettask(qu, other);
+	if (task_state(&qu->tasks, o) != TS_ACTIVE) return;
+
+	if (h->copyof != 0) {
+		((struct hedge*)side_get(&qu->tasks.hedges, other))->lost = true;
+		qu->ncopywon += 1;
+		loginfo("task %u finished ahead of the task it copies, %u", task->id, o->id);
+	} else {
+		o->killed = true;
+	}
+	if (task_signal(&qu->tasks, o, SIGKILL) == -1) perror("pidfd_send_signal");
+}
+
+/* an attempt of a task is over and its result is in: keep its runtime, then retry it
+   or release its dependents
+*/
+static
+void qu_finished(struct qu* qu, struct task* task) {
+	/* a task that lost ran for as long as it took to kill it */
+	struct hedge* h = side_get(&qu->tasks.hedges, task->id);
+	if (task->exitcode == 0 && !task->timedout && !task->killed && (h == NULL || !h->lost)) {
+		size_t argc;
+		const char* const* argv = qu_argv(qu, task, &argc);
+		runtimes_record(&qu->runtimes, argv, argc, task->ended - task->started);
+	}
+	if (qu_retry(qu, task)) return;
+	qu_deadline(qu, task);
+	qu_release(qu, task->id);
+}
+
+static
+void qu_taskexited(struct qu* qu, struct task* task, int status) {
+	if (task->timer != NULL) {
+		wheel_release(&qu->timers, task->timer);
+		task->timer = NULL;
+	}
+	struct hedge* h = side_get(&qu->tasks.hedges, task->id);
+	if (h != NULL && h->timer != NULL) {
+		wheel_release(&qu->timers, h->timer);
+		h->timer = NULL;
+	}
+
+	if (task->pidfd != -1) {
+		close(task->pidfd);
+		task->pidfd = -1;
+	}
+
+	task->ended = now_ms();
+	/* the leader is gone, take the rest of the tree with it */
+	if (task->cgfd != -1) {
+		cg_stats(task->cgfd, side_at(&qu->tasks.stats, task->id));
+		cg_kill(task->cgfd);
+		close(task->cgfd);
+		task->cgfd = -1;
+		qu_cgremove(qu, task->id);
+	}
+
+	if (WIFEXITED(status)) {
+		task->exitcode = WEXITSTATUS(status);
+	} else if (WIFSIGNALED(status)) {
+		task->exitcode = 128 + WTERMSIG(status);
+	} else ASSERT(false, "what are we even doing?");
+	/* killed if kill meant to end it, or it died of what kill sent */
+	if (task->killsig != 0)
+		task->killed = task->killed || sig_ends(task->killsig) ||
+			(WIFSIGNALED(status) && WTERMSIG(status) == task->killsig);
+	qu_hedgedone(qu, task);
+	task_setstate(&qu->tasks, task, task->timedout ? TS_TIMEDOUT : TS_EXITED);
+
+	loginfo("task %u done (%d)", task->id, task->exitcode);
+	qu_unplace(qu, task);
+	capacity_give(&qu->cap, task_res(task));
+	qu_tokengive(qu, task);
+	if (task->jstoken) jobserver_give(&qu->js);
+	task->jstoken = false;
+	/* background tasks run slow by design, their runtime says nothing about the load */
+	if (task->background) qu->nbackground -= 1;
+	else qu->nactive -= 1;
+	if (qu->js.fd != -1 && qu->nactive + qu->nbackground == 0) jobserver_refill(&qu->js);
+	if (qu->adaptive && !task->background) adapt_done(&qu->adapt, task->ended - task->started);
+	if (task->memokey != 0) {
+		qu_memoreplay(qu, NULL, task->id);
+		if (task->exitcode == 0 && !task->timedout && !task->killed) memo_put(&qu->memo, istr_get(&qu->strs, task->memokey), task->id);
+		else memo_discard(&qu->memo, task->id);
+	}
+	qu_finished(qu, task);
+}
+
+static
+void qu_exited(struct qu* qu, pid_t pid, int status) {
+	uint32_t id = pidmap_take(&qu->pids, pid);
+	if (id == 0) return;
+	qu_taskexited(qu, qu_gettask(qu, id), status);
+}
+
+/* reap every child that exited since the last call */
+static
+void qu_reap(struct qu* qu) {
+	char drain[64];
+	while (read(qu->sigfd[0], drain, sizeof(drain)) > 0)
+		;
+
+	int status;
+	pid_t pid;
+	while ((pid = waitpid(-1, &status, WNOHANG)) > 0)
+		qu_exited(qu, pid, status);
+	if (pid == -1 && errno != ECHILD) {
+		perror("waitpid");
+		exit(1);
+	}
+}
+
+/* the tasks zygote zy was running when it died. the daemon is their subreaper, once the
+   zygote is reaped they're its children and their exits come through qu_reap. one that
+   isn't, if the daemon couldn't be made a subreaper, would never be heard of: it's
+   killed and fails as if it was
+*/
+static
+void qu_zyorphans(struct qu* qu, pid_t zy) {
+	/* the zygote is exiting, its children have been reparented once it can be waited for */
+	while (waitpid(zy, NULL, 0) == -1 && errno == EINTR)
+		;
+
+	/* exits take tasks out of the map, so go by a copy of it */
+	static struct {
+		pid_t* items;
+		size_t count;
+		size_t capacity;
+	} pids = {0};
+	pids.count = 0;
+	for (size_t i = 0; i < qu->pids.capacity; i += 1)
+		if (qu->pids.slots[i].pid != 0) da_append(&pids, qu->pids.slots[i].pid);
+
+	for (size_t i = 0; i < pids.count; i += 1) {
+		int status;
+		pid_t pid;
+		do pid = waitpid(pids.items[i], &status, WNOHANG); while (pid == -1 && errno == EINTR);
+		if (pid > 0) qu_exited(qu, pid, status);
+		if (pid != -1 || errno != ECHILD) continue;
+		uint32_t id = pidmap_take(&qu->pids, pids.items[i]);
+		if (id == 0) continue;
+		struct task* task = qu_gettask(qu, id);
+		logerr("task %u was orphaned by the zygote, killing it", id);
+		if (task_signal(&qu->tasks, task, SIGKILL) == -1) perror("pidfd_send_signal");
+		/* a wait status of death by SIGKILL */
+		qu_taskexited(qu, task, SIGKILL);
+	}
+}
+
+/* exits of the tasks the zygote spawned */
+static
+void qu_zyreap(struct qu* qu) {
+	struct zyexit exits[256];
+	int n;
+	while ((n = zygote_exits(&qu->zy, exits, sizeof(exits)/sizeof(exits[0]))) > 0)
+		for (int i = 0; i < n; i += 1)
+			qu_exited(qu, exits[i].pid, exits[i].status);
+
+	if (n == -1) {
+		logerr("zygote exited, forking tasks from the daemon");
+		pid_t zy = qu->zy.pid;
+		zygote_stop(&qu->zy);
+		qu_zyorphans(qu, zy);
+	}
+}
+
+/* read exactly n bytes, returns 0 if the peer hung up first */
+static
+ssize_t readall(int fd, char* buf, size_t n) {
+	size_t got = 0;
+	while (got < n) {
+		ssize_t rn = read(fd, buf + got, n - got);
+		if (rn == -1 && errno == EINTR) continue;
+		if (rn <= 0) return rn;
+		got += rn;
+	}
+	return got;
+}
+
+static
+uint32_t qu_workerid(struct qu* qu, struct worker* w) {
+	return (uint32_t)(w - qu->workers.items) + 1;
+}
+
+/* the worker hung up or went silent, the tasks it holds go back to their queues */
+static
+void qu_dropworker(struct qu* qu, struct worker* w) {
+	uint32_t wid = qu_workerid(qu, w);
+	size_t nleased = w->nleased;
+	if (nleased > 0) {
+		/* a worker is dropped far less often than it leases, the map is scanned for its tasks */
+		static struct {
+			uint32_t* items;
+			size_t count;
+			size_t capacity;
+		} ids = {0};
+		ids.count = 0;
+		for (size_t i = 0; i < qu->workers.leases.capacity; i += 1)
+			if (qu->workers.leases.slots[i].id != 0 && qu->workers.leases.slots[i].worker == wid)
+				da_append(&ids, qu->workers.leases.slots[i].id);
+		for (size_t i = 0; i < ids.count; i += 1) {
+			struct task* task = qu_gettask(qu, ids.items[i]);
+			workers_unlease(&qu->workers, task->id);
+			task_setstate(&qu->tasks, task, TS_INACTIVE);
+			qu_ready(qu, task);
+		}
+		qu->workers.expired += nleased;
+		logerr("worker %u gone, %zu tasks it held are back in their queues", wid, nleased);
+	}
+	if (w->timer != NULL) wheel_release(&qu->timers, w->timer);
+	w->timer = NULL;
+	w->want = 0;
+	/* the buffers are kept for the next worker in the slot, a frame being handled may point into in */
+	w->in.count = 0;
+	w->out.count = 0;
+	w->sent = 0;
+	close(w->fd);
+	w->fd = -1;
+	qu->workers.connected -= 1;
+}
+
+/* write as much of its answers as the worker takes, it's hung up on if it can't be written to */
+static
+void qu_workerflush(struct qu* qu, struct worker* w) {
+	while (w->sent < w->out.count) {
+		ssize_t wn = send(w->fd, w->out.items + w->sent, w->out.count - w->sent, MSG_NOSIGNAL);
+		if (wn == -1 && errno == EINTR) continue;
+		if (wn == -1 && errno == EAGAIN) return;
+		if (wn <= 0) {
+			logerr("worker %u: %s", qu_workerid(qu, w), strerror(errno));
+			qu_dropworker(qu, w);
+			return;
+		}
+		w->sent += wn;
+	}
+	w->out.count = 0;
+	w->sent = 0;
+}
+
+/* answer the worker that waits for tasks with as many of its queues' as it asked for.
+   without any, it keeps waiting unless now is set. the answer is queued on the worker,
+   qu_workerflush writes it
+*/
+static
+void qu_lease(struct qu* qu, struct worker* w, bool now) {
+	uint32_t wid = qu_workerid(qu, w);
+	uint32_t n = 0;
+	size_t at = w->out.count;
+	da_reserve(&w->out, at + sizeof(n));
+	w->out.count += sizeof(n);
+	uint32_t nqueues = ivec_len(&qu->strs, w->queues);
+	for (uint32_t i = 0; i < nqueues && n < w->want; i += 1) {
+		struct idqueue* q = qu_leaseq(qu, ivec_get(&qu->strs, w->queues, i), false);
+		while (q != NULL && q->count > 0 && n < w->want) {
+			struct task* task = qu_gettask(qu, idqueue_pop(q));
+			/* cancelled while it waited */
+			if (task_state(&qu->tasks, task) != TS_INACTIVE) continue;
+
+			uint32_t argc = ivec_len(&qu->strs, task->argv);
+			struct wire_lease l = {.id = task->id, .argc = argc};
+			for (uint32_t a = 0; a < argc; a += 1) l.len += istr_len(&qu->strs, ivec_at(&qu->strs, task->argv, a)) + 1;
+			da_reserve(&w->out, w->out.count + sizeof(l) + l.len);
+			memcpy(w->out.items + w->out.count, &l, sizeof(l));
+			w->out.count += sizeof(l);
+			for (uint32_t a = 0; a < argc; a += 1) {
+				istr h = ivec_at(&qu->strs, task->argv, a);
+				memcpy(w->out.items + w->out.count, istr_get(&qu->strs, h), istr_len(&qu->strs, h));
+				w->out.count += istr_len(&qu->strs, h);
+				w->out.items[w->out.count++] = '\0';
+			}
+
+			task->started = now_ms();
+			task_setstate(&qu->tasks, task, TS_ACTIVE);
+			workers_lease(&qu->workers, wid, task->id);
+			n += 1;
+		}
+	}
+	if (n == 0 && !now) {
+		w->out.count = at;
+		return;
+	}
+
+	memcpy(w->out.items + at, &n, sizeof(n));
+	w->want = 0;
+	if (n > 0 && w->timer == NULL) w->timer = wheel_add(&qu->timers, w->seen + qu->leasems, wid, TIMER_LEASE);
+}
+
+/* answer the workers that wait, with the tasks that became ready since */
+static
+void qu_serve(struct qu* qu) {
+	for (size_t i = 0; i < qu->workers.count; i += 1) {
+		struct worker* w = &qu->workers.items[i];
+		if (w->fd == -1 || w->want == 0) continue;
+		qu_lease(qu, w, false);
+		qu_workerflush(qu, w);
+	}
+}
+
+/* a worker finished a task it held, or the task was killed and its lease revoked. a
+   task for workers finishes far more often than a process, it isn't logged
+*/
+static
+void qu_leasedone(struct qu* qu, struct task* task, int exitcode) {
+	task->ended = now_ms();
+	task->exitcode = exitcode;
+	task_setstate(&qu->tasks, task, TS_EXITED);
+	qu_finished(qu, task);
+}
+
+/* a worker that holds leases may have gone silent, see workers.h */
+static
+void qu_timerlease(struct qu* qu, struct timer* timer) {
+	struct worker* w = workers_get(&qu->workers, timer->id);
+	ASSERT(w != NULL && w->timer == timer, "lease timer fired for a worker that doesn't own it");
+	wheel_release(&qu->timers, timer);
+	w->timer = NULL;
+	if (w->nleased == 0) return;
+	uint64_t now = now_ms();
+	if (now < w->seen + qu->leasems) {
+		w->timer = wheel_add(&qu->timers, w->seen + qu->leasems, timer->id, TIMER_LEASE);
+		return;
+	}
+	logerr("worker %u silent for %llums", timer->id, (unsigned long long)(now - w->seen));
+	qu_dropworker(qu, w);
+}
+
+static
+void qu_handlework(struct qu* qu, uint32_t wid, struct msgwork* mw, char* payload) {
+	struct worker* w = workers_get(&qu->workers, wid);
+	w->seen = now_ms();
+
+	/* binary replies can't carry an error, a worker that sends garbage is hung up on */
+	size_t donesz = (size_t)mw->ndone*sizeof(struct wire_done);
+	uint64_t nstrs = 0;
+	for (size_t i = donesz; i < mw->len; i += 1) nstrs += payload[i] == '\0';
+	bool ok = donesz <= mw->len && nstrs == mw->nqueues && (mw->len == donesz || payload[mw->len - 1] == '\0') &&
+		(mw->nqueues > 0 || w->queues != 0);
+	for (uint32_t i = 0; ok && i < mw->ndone; i += 1) {
+		struct wire_done d;
+		memcpy(&d, payload + i*sizeof(d), sizeof(d));
+		ok = d.exitcode >= 0;
+	}
+	if (!ok) {
+		logerr("worker %u: malformed work", wid);
+		qu_dropworker(qu, w);
+		return;
+	}
+
+	/* one answer per frame, in order */
+	if (w->want > 0) qu_lease(qu, w, true);
+	if (mw->nqueues > 0) w->queues = intern_vec(&qu->strs, payload + donesz, mw->nqueues);
+
+	for (uint32_t i = 0; i < mw->ndone; i += 1) {
+		struct wire_done d;
+		memcpy(&d, payload + i*sizeof(d), sizeof(d));
+		struct task* task = qu_gettask(qu, d.id);
+		/* a lease it lost, the task ran again or was killed */
+		if (task == NULL || workers_lessee(&qu->workers, d.id) != wid) continue;
+		workers_unlease(&qu->workers, d.id);
+		qu->workers.done += 1;
+		qu_leasedone(qu, task, d.exitcode);
+	}
+
+	w->want = mw->max;
+	qu_lease(qu, w, mw->max == 0);
+}
+
+/* what a worker sent since the last read, every frame that came in whole is handled.
+   it hung up if there's nothing
+*/
+static
+void qu_workerread(struct qu* qu, uint32_t wid) {
+	struct worker* w = workers_get(&qu->workers, wid);
+	da_reserve(&w->in, w->in.count + WORKER_READ_SIZE);
+	ssize_t rn;
+	do rn = read(w->fd, w->in.items + w->in.count, WORKER_READ_SIZE); while (rn == -1 && errno == EINTR);
+	if (rn == -1 && errno == EAGAIN) return;
+	if (rn > 0) w->in.count += rn;
+
+	size_t at = 0;
+	while (w->fd != -1 && w->in.count - at >= sizeof(struct wire_frame)) {
+		struct wire_frame frame;
+		memcpy(&frame, w->in.items + at, sizeof(frame));
+		uint32_t paylen = wire_frame_paylen(&frame);
+		if (frame.version != WIRE_VERSION || frame.end != WIRE_END_BYTE || frame.kind != KIND_WORK ||
+		    paylen > WIRE_MAX_PAYLOAD) {
+			logerr("worker %u: malformed frame", wid);
+			qu_dropworker(qu, w);
+			return;
+		}
+		if (w->in.count - at - sizeof(frame) < paylen) break;
+		qu_handlework(qu, wid, &frame.m.work, w->in.items + at + sizeof(frame));
+		at += sizeof(frame) + paylen;
+	}
+	if (w->fd == -1) return;
+	w->in.count -= at;
+	memmove(w->in.items, w->in.items + at, w->in.count);
+
+	if (rn <= 0) {
+		if (rn == 0) loginfo("worker %u disconnected", wid);
+		else logerr("worker %u: %s", wid, strerror(errno));
+		qu_dropworker(qu, w);
+		return;
+	}
+	qu_workerflush(qu, w);
+}
+
+/* whether ready tasks wait for the jobs of other tasks to give back a token */
+static
+bool qu_jswait(struct qu* qu) {
+	return qu->js.fd != -1 && readyq_count(&qu->ready) + qu->held.count > 0 && jobserver_free(&qu->js) == 0;
+}
+
+int qu_poll(struct qu* qu, int timeout /* in milliseconds */) {
+	/* sleep until the next timer at the latest, never on a fixed tick */
+	wheel_update(&qu->timers, now_ms());
+	int64_t next = wheel_timeout(&qu->timers);
+	if (next >= 0 && (timeout < 0 || next < timeout))
+		timeout = next > INT_MAX ? INT_MAX : (int)next;
+
+	struct pollfd fixed[] = {
+		{.fd = qu->fd, .events = POLLIN},
+		{.fd = qu->sigfd[0], .events = POLLIN},
+		{.fd = qu->zy.pid != -1 ? qu->zy.ev : -1, .events = POLLIN},
+		{.fd = qu->exec.fd, .events = POLLIN},
+		/* woken when a job gives back a token, only while tasks wait for one */
+		{.fd = qu_jswait(qu) ? qu->js.fd : -1, .events = POLLIN},
+	};
+	/* and the connection of every worker after them */
+	size_t nfixed = sizeof(fixed)/sizeof(fixed[0]);
+	size_t nworkers = qu->workers.count;
+	struct pollfd pfds[nfixed + nworkers];
+	memcpy(pfds, fixed, sizeof(fixed));
+	for (size_t i = 0; i < nworkers; i += 1) {
+		struct worker* w = &qu->workers.items[i];
+		size_t unsent = w->out.count - w->sent;
+		pfds[nfixed + i] = (struct pollfd) {
+			.fd = w->fd,
+			.events = (unsent < WORKER_BACKLOG ? POLLIN : 0) | (unsent > 0 ? POLLOUT : 0),
+		};
+	}
+
+	/* TODO(Thu 19 Jun 23:14:51 WAT 2025):
+		the more sensible thing to do here is to block signals that may interrupt
+		this poll
+	*/
+	int status = poll(pfds, nfixed + nworkers, timeout);
+	if (status == -1) {
+		if (errno == EINTR) {
+			return -1;
+		}
+		perror("poll");
+		exit(1);
+	}
+
+	if ((pfds[1].revents & POLLIN) == POLLIN) {
+		qu_reap(qu);
+	}
+	if (pfds[2].revents != 0 && qu->zy.pid != -1) {
+		qu_zyreap(qu);
+	}
+	/* before anything is dispatched, so nothing runs a binary that was just replaced */
+	if (pfds[3].revents != 0) {
+		execcache_update(&qu->exec);
+	}
+	qu_expire(qu);
+	/* a timer may have dropped a worker already */
+	for (size_t i = 0; i < nworkers; i += 1) {
+		struct worker* w = &qu->workers.items[i];
+		short revents = pfds[nfixed + i].revents;
+		if (revents == 0 || w->fd != pfds[nfixed + i].fd) continue;
+		if ((revents & POLLOUT) == POLLOUT) qu_workerflush(qu, w);
+		if (w->fd != -1 && (revents & ~POLLOUT) != 0) qu_workerread(qu, i + 1);
+	}
+
+	bool has_client = (pfds[0].revents & POLLIN) == POLLIN;
+	if (has_client) {
+		int fd = accept(qu->fd, NULL, NULL);
+		if (fd == -1) {
+			perror("accept");
+			exit(1);
+		}
+		/* turned away before anything is read, a client over its limit costs an accept and a write */
+		struct ucred cred;
+		socklen_t len = sizeof(cred);
+		if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &len) == -1) cred = (struct ucred) {.pid = -1, .uid = (uid_t)-1};
+		uint64_t wait = ratelimit_take(&qu->limit, cred.uid, now_ms());
+		if (wait > 0) {
+			logerr("client uid %u pid %d rate limited", (unsigned)cred.uid, (int)cred.pid);
+			dprintf(fd, WIRE_BUSY "%llums\n", (unsigned long long)wait);
+			close(fd);
+		} else {
+			qu->clientfd = fd;
+		}
+	}
+
+	return qu->nactive;
+}
+
+/* the null-terminated string of len bytes at p, NULL if it isn't one */
+static
+const char* payload_str(const char* p, uint32_t len) {
+	if (len < 2 || p[len - 1] != '\0' || strlen(p) != len - 1) return NULL;
+	return p;
+}
+
+#define BUSY_RETRY_MS 1000
+
+/* whether the daemon can take on more. it answers busy while too many tasks haven't
+   started, the ones that finished are the past, and refuses with an error once the
+   tables are full, which they stay
+*/
+static
+bool qu_admit(struct qu* qu) {
+	if (qu_tablesfull(qu)) {
+		qu->nfull += 1;
+		dprintf(qu->clientfd, "error: the task and string tables are full, past -S %lluM. nothing is freed "
+			"while the daemon runs, restart it to take more\n", (unsigned long long)(qu->maxtables >> 20));
+		return false;
+	}
+	size_t* n = qu->tasks.nstate;
+	size_t pending = n[TS_INACTIVE] + n[TS_WAITING] + n[TS_SCHEDULED];
+	if (qu->maxpending > 0 && pending >= qu->maxpending) {
+		qu->nbusy += 1;
+		dprintf(qu->clientfd, WIRE_BUSY "%dms\n", BUSY_RETRY_MS);
+		return false;
+	}
+	return true;
+}
+
+static
+void qu_handlesubmit(struct qu* qu, struct msgsubmit* ms, char* payload) {
+	size_t depsz = (size_t)ms->ndeps * sizeof(struct wire_dep);
+	size_t strsoff = depsz + ms->queuelen + ms->cwdlen + ms->keylen;
+	if (ms->argc == 0 || strsoff >= ms->len || payload[ms->len - 1] != '\0' || (!ms->hasenv && ms->envc > 0) ||
+	    (ms->hasenv && ms->envtemplate > 0)) {
+		dprintf(qu->clientfd, "error: malformed submit\n");
+		return;
+	}
+
+	const char* queue = payload_str(payload + depsz, ms->queuelen);
+	const char* cwd = payload_str(payload + depsz + ms->queuelen, ms->cwdlen);
+	const char* key = payload_str(payload + depsz + ms->queuelen + ms->cwdlen, ms->keylen);
+	if ((ms->queuelen > 0 && queue == NULL) || (ms->cwdlen > 0 && (cwd == NULL || cwd[0] != '/')) ||
+	    (ms->keylen > 0 && key == NULL)) {
+		dprintf(qu->clientfd, "error: malformed submit\n");
+		return;
+	}
+
+	/* argv, the environment and its overrides must be exactly argc + envc + noverrides
+	   null-terminated strings, the overrides with a name
+	*/
+	char* strs = payload + strsoff;
+	size_t strslen = ms->len - strsoff;
+	uint64_t nstrs = 0;
+	char* env = NULL;
+	char* over = NULL;
+	char* inputs = NULL;
+	char* resources = NULL;
+	for (size_t i = 0; i < strslen; i += 1) {
+		if (strs[i] != '\0') continue;
+		nstrs += 1;
+		if (nstrs == ms->argc) env = strs + i + 1;
+		if (nstrs == (uint64_t)ms->argc + ms->envc) over = strs + i + 1;
+		if (nstrs == (uint64_t)ms->argc + ms->envc + ms->noverrides) inputs = strs + i + 1;
+		if (nstrs == (uint64_t)ms->argc + ms->envc + ms->noverrides + ms->ninputs) resources = strs + i + 1;
+	}
+	if (nstrs != (uint64_t)ms->argc + ms->envc + ms->noverrides + ms->ninputs + ms->nresources || ms->memo > MEMO_CONTENT ||
+	    (ms->memo == MEMO_NONE && ms->ninputs > 0)) {
+		dprintf(qu->clientfd, "error: malformed submit\n");
+		return;
+	}
+	const char* o = over;
+	for (uint32_t i = 0; i < ms->noverrides; i += 1, o += strlen(o) + 1) {
+		if (strcspn(o, "=") == 0) {
+			dprintf(qu->clientfd, "error: malformed submit\n");
+			return;
+		}
+	}
+
+	const char* in = inputs;
+	for (uint32_t i = 0; i < ms->ninputs; i += 1, in += strlen(in) + 1) {
+		if (in[0] != '/') {
+			dprintf(qu->clientfd, "error: malformed submit\n");
+			return;
+		}
+	}
+
+	if (ms->envtemplate > qu->envs.count) {
+		dprintf(qu->clientfd, "error: no such env template\n");
+		return;
+	}
+
+	if (!res_fits((struct res) {.cpus = ms->cpus, .mem = ms->mem}, qu->cap.total)) {
+		dprintf(qu->clientfd, "error: the task needs more than the daemon's capacity\n");
+		return;
+	}
+
+	/* name=tokens, each resource once, so there are never more than TOKENS_MAX */
+	struct tokenneed need[TOKENS_MAX];
+	size_t nneed = 0;
+	const char* rs = resources;
+	for (uint32_t i = 0; i < ms->nresources; i += 1, rs += strlen(rs) + 1) {
+		const char* eq = strchr(rs, '=');
+		char* end = NULL;
+		unsigned long n = eq != NULL ? strtoul(eq + 1, &end, 10) : 0;
+		if (n == 0 || n > UINT32_MAX || end == eq + 1 || *end != '\0') {
+			dprintf(qu->clientfd, "error: malformed submit\n");
+			return;
+		}
+		int tk = tokens_find(&qu->tokens, rs, eq - rs);
+		if (tk < 0) {
+			dprintf(qu->clientfd, "error: no resource %.*s\n", (int)(eq - rs), rs);
+			return;
+		}
+		for (size_t j = 0; j < nneed; j += 1) {
+			if (need[j].token == (uint32_t)tk) {
+				dprintf(qu->clientfd, "error: resource %.*s given twice\n", (int)(eq - rs), rs);
+				return;
+			}
+		}
+		if (n > qu->tokens.items[tk].total) {
+			dprintf(qu->clientfd, "error: resource %s has only %u tokens\n", qu->tokens.items[tk].name, qu->tokens.items[tk].total);
+			return;
+		}
+		need[nneed++] = (struct tokenneed) {.token = (uint32_t)tk, .n = (uint32_t)n};
+	}
+
+	if (ms->every > 0 && ms->ndeps > 0) {
+		dprintf(qu->clientfd, "error: a recurring task can't have dependencies\n");
+		return;
+	}
+
+	if (ms->every > 0 && ms->deadline > 0) {
+		dprintf(qu->clientfd, "error: a recurring task can't have a deadline\n");
+		return;
+	}
+
+	/* a copy's output would never make it to the cache */
+	if (ms->hedge && ms->memo != MEMO_NONE) {
+		dprintf(qu->clientfd, "error: a memoized task can't be hedged\n");
+		return;
+	}
+
+	/* a worker runs the command and nothing else of the process it would have been */
+	if (ms->worker && (ms->timeout > 0 || ms->cpulimit > 0 || ms->memlimit > 0 || ms->cores > 0 || ms->cpus > 0 ||
+	    ms->mem > 0 || ms->background || ms->hedge || ms->memo != MEMO_NONE || ms->nresources > 0)) {
+		dprintf(qu->clientfd, "error: a task for workers can't have a timeout, limits, capacity, cores, resources, "
+			"hedging or memoization, or run in the background\n");
+		return;
+	}
+
+	struct wire_dep deps[ms->ndeps + 1];
+	memcpy(deps, payload, depsz);
+	for (uint32_t i = 0; i < ms->ndeps; i += 1) {
+		if (deps[i].kind != DEP_AFTEROK && deps[i].kind != DEP_AFTERANY) {
+			dprintf(qu->clientfd, "error: unknown dependency kind %u\n", deps[i].kind);
+			return;
+		}
+	}
+
+	if (key != NULL) {
+		struct task* k = qu_gettask(qu, (uint32_t)(uintptr_t)strmap_get(&qu->keys, key));
+		bool pending = k != NULL && !task_isdone(&qu->tasks, k);
+		bool fresh = k != NULL && task_isok(&qu->tasks, k) && ms->reuse > 0 && now_ms() - k->ended <= ms->reuse;
+		if (pending || fresh) {
+			if (pending) qu->ncoalesced += 1;
+			else qu->nreused += 1;
+			dprintf(qu->clientfd, "submitted [%u] (already %s)\n", k->id, state2str(task_state(&qu->tasks, k)));
+			return;
+		}
+	}
+
+	if (!qu_admit(qu)) return;
+
+	struct task t = newtask(intern_vec(&qu->strs, strs, ms->argc));
+	if (ms->hasenv) t.env = intern_vec(&qu->strs, env, ms->envc);
+	if (ms->envtemplate > 0) t.env = qu->envs.items[ms->envtemplate - 1];
+	if (ms->noverrides > 0) t.envover = intern_vec(&qu->strs, over, ms->noverrides);
+	if (ms->ninputs > 0) t.inputs = intern_vec(&qu->strs, inputs, ms->ninputs);
+	t.memo = ms->memo;
+	if (cwd != NULL) t.cwd = intern_str(&qu->strs, cwd);
+	if (queue != NULL && strcmp(queue, DEFAULT_QUEUE) != 0) t.queue = intern_str(&qu->strs, queue);
+	/* memset, the padding is interned too */
+	struct tasklimits l;
+	memset(&l, 0, sizeof(l));
+	l.timeout = ms->timeout;
+	l.grace = ms->grace > 0 ? ms->grace : DEFAULT_GRACE_MS;
+	l.cpulimit = ms->cpulimit;
+	l.memlimit = ms->memlimit;
+	/* tasks submitted with the same limits share them */
+	t.limits = intern(&qu->strs, (const char*)&l, sizeof(l));
+	t.cores = ms->cores;
+	t.cpus = ms->cpus;
+	t.mem = ms->mem;
+	t.background = ms->background;
+	t.hedge = ms->hedge;
+	t.worker = ms->worker;
+	if (nneed > 0) t.tokens = intern(&qu->strs, (const char*)need, nneed*sizeof(*need));
+	double late = 0;
+	if (ms->deadline > 0) {
+		uint64_t now = now_ms();
+		t.deadline = now + ms->deadline;
+		double expected = qu_expected(qu, &t, ms->delay);
+		late = expected >= 0 ? now + expected - t.deadline : 0;
+		if (late > 0 && ms->deadlinestrict) {
+			qu->dlrefused += 1;
+			dprintf(qu->clientfd, "error: deadline can't be met, the task is expected to finish %.0fms after it\n", late);
+			return;
+		}
+		if (late > 0) qu->dlatrisk += 1;
+	}
+	if (ms->retry.max > 0) {
+		struct wire_retry r = ms->retry;
+		if (r.backoff == 0) r.backoff = DEFAULT_BACKOFF_MS;
+		if (r.backoffmax == 0) r.backoffmax = DEFAULT_BACKOFF_MAX_MS;
+		if (r.backoffmax < r.backoff) r.backoffmax = r.backoff;
+		/* tasks submitted with the same policy share it */
+		t.retry = intern(&qu->strs, (const char*)&r, sizeof(r));
+	}
+	/* the strings stay interned, like those of any other task */
+	uint32_t id = qu_submit(qu, &t, deps, ms->ndeps, ms->delay, ms->every);
+	if (id == 0) {
+		dprintf(qu->clientfd, "error: no such dependency\n");
+		return;
+	}
+	if (key != NULL) {
+		/* the index points at the interned key, which lives as long as the daemon */
+		struct task* task = qu_gettask(qu, id);
+		task->key = intern_str(&qu->strs, key);
+		strmap_putn(&qu->keys, istr_get(&qu->strs, task->key), ms->keylen - 1, (void*)(uintptr_t)id);
+	}
+	if (late > 0) dprintf(qu->clientfd, "submitted [%u] (deadline at risk, expected to finish %.0fms after it)\n", id, late);
+	else dprintf(qu->clientfd, "submitted [%u]\n", id);
+}
+
+/* stop a task that hasn't started yet, its after-ok dependents are cancelled with it */
+static
+void qu_cancel(struct qu* qu, struct task* task) {
+	if (task->timer != NULL) {
+		wheel_release(&qu->timers, task->timer);
+		task->timer = NULL;
+	}
+	task_setstate(&qu->tasks, task, TS_CANCELLED);
+	qu_tokenunreserve(qu, task, false);
+	qu_release(qu, task->id);
+}
+
+static
+bool qu_taskmatches(struct qu* qu, struct task* t, struct msgkill* mk, const char* queue, const char* pattern) {
+	if (mk->states != 0 && (mk->states & (UINT32_C(1) << task_state(&qu->tasks, t))) == 0) return false;
+	if (queue != NULL && strcmp(task_queue(&qu->strs, t), queue) != 0) return false;
+	if (pattern != NULL && fnmatch(pattern, task_name(&qu->strs, t), 0) != 0) return false;
+	return true;
+}
+
+/* returns true if the task was signalled or cancelled */
+static
+bool qu_killtask(struct qu* qu, struct task* t, int signo) {
+	switch (task_state(&qu->tasks, t)) {
+	case TS_ACTIVE:
+		/* a leased task has no process, the signal revokes the lease */
+		if (t->worker) {
+			if (!sig_ends(signo)) return true;
+			workers_unlease(&qu->workers, t->id);
+			t->killed = true;
+			qu_leasedone(qu, t, 128 + signo);
+			return true;
+		}
+		if (task_signal(&qu->tasks, t, signo) == -1) {
+			perror("pidfd_send_signal");
+			return false;
+		}
+		/* whether it was killed is known once it exits, a task that's only probed,
+		   stopped or continued is retried as any other
+		*/
+		if (signo != 0 && (t->killsig == 0 || !sig_ends(t->killsig))) t->killsig = signo;
+		return true;
+	case TS_INACTIVE:
+	case TS_WAITING:
+	case TS_SCHEDULED:
+		qu_cancel(qu, t);
+		return true;
+	default:
+		return false;
+	}
+}
+
+static
+void qu_handlekill(struct qu* qu, struct msgkill* mk, char* payload) {
+	size_t idsz = (size_t)mk->nids * sizeof(uint32_t);
+	if (idsz + mk->queuelen + mk->patternlen != mk->len || mk->signo >= NSIG) {
+		dprintf(qu->clientfd, "error: malformed kill\n");
+		return;
+	}
+
+	const char* queue = NULL;
+	const char* pattern = NULL;
+	if (mk->queuelen > 0) {
+		queue = payload + idsz;
+		if (queue[mk->queuelen - 1] != '\0') {
+			dprintf(qu->clientfd, "error: malformed kill\n");
+			return;
+		}
+	}
+	if (mk->patternlen > 0) {
+		pattern = payload + idsz + mk->queuelen;
+		if (pattern[mk->patternlen - 1] != '\0') {
+			dprintf(qu->clientfd, "error: malformed kill\n");
+			return;
+		}
+	}
+	if (mk->nids == 0 && queue == NULL && pattern == NULL && mk->states == 0 && !mk->all) {
+		dprintf(qu->clientfd, "error: no tasks selected\n");
+		return;
+	}
+
+	size_t nsignalled = 0;
+	size_t ncancelled = 0;
+	/* explicit ids are looked up directly, selectors alone scan the table */
+	size_t n = mk->nids > 0 ? mk->nids : qu->tasks.count;
+	for (size_t i = 0; i < n; i += 1) {
+		struct task* t;
+		if (mk->nids > 0) {
+			uint32_t id;
+			memcpy(&id, payload + i*sizeof(id), sizeof(id));
+			t = qu_gettask(qu, id);
+			if (t == NULL) {
+				dprintf(qu->clientfd, "error: no such task [%u]\n", id);
+				continue;
+			}
+		} else {
+			/* only the state column, the cold task is read for the ones it lets through */
+			if (mk->states != 0 && (mk->states & (UINT32_C(1) << qu->tasks.state[i])) == 0) continue;
+			t = &qu->tasks.items[i];
+		}
+		if (!qu_taskmatches(qu, t, mk, queue, pattern)) continue;
+
+		bool running = task_state(&qu->tasks, t) == TS_ACTIVE;
+		if (qu_killtask(qu, t, mk->signo)) {
+			if (running) nsignalled += 1;
+			else ncancelled += 1;
+		}
+	}
+	dprintf(qu->clientfd, "signalled %zu, cancelled %zu\n", nsignalled, ncancelled);
+}
+
+/* register an environment as a template, the same environment always gets the same id */
+static
+void qu_handleenv(struct qu* qu, struct msgenv* me, char* payload) {
+	uint64_t nstrs = 0;
+	for (size_t i = 0; i < me->len; i += 1) nstrs += payload[i] == '\0';
+	if ((me->len > 0 && payload[me->len - 1] != '\0') || nstrs != me->envc) {
+		dprintf(qu->clientfd, "error: malformed env\n");
+		return;
+	}
+
+	if (!qu_admit(qu)) return;
+	istr env = intern_vec(&qu->strs, payload, me->envc);
+	size_t id = 0;
+	while (id < qu->envs.count && qu->envs.items[id] != env) id += 1;
+	if (id == qu->envs.count) {
+		ASSERT(qu->envs.count < UINT32_MAX, "ran out of env template ids");
+		da_append(&qu->envs, env);
+	}
+	dprintf(qu->clientfd, "env template [%zu]\n", id + 1);
+}
+
+static
+void qu_handlestats(struct qu* qu) {
+	size_t count = qu->tasks.count;
+	dprintf(qu->clientfd, "tasks %zu", count);
+	for (state_t st = 0; st < TS_COUNT; st += 1)
+		if (qu->tasks.nstate[st] > 0) dprintf(qu->clientfd, ", %s %zu", state2str(st), qu->tasks.nstate[st]);
+	dprintf(qu->clientfd, "\n");
+
+	/* per task, what the strings of a task cost on top of its entry in the table */
+	size_t table = tasktab_bytes(&qu->tasks);
+	size_t strs = strtab_bytes(&qu->strs);
+	double n = count > 0 ? count : 1;
+	dprintf(qu->clientfd, "task table %zu bytes, %.0f per task\n", table, table/n);
+	dprintf(qu->clientfd, "strings %zu bytes for %zu unique, %llu without sharing, %.0f per task\n",
+		strs, qu->strs.strs.count, (unsigned long long)qu->strs.requested, strs/n);
+	dprintf(qu->clientfd, "env templates %zu\n", qu->envs.count);
+	dprintf(qu->clientfd, "keys %zu, %llu submits coalesced, %llu reused\n", qu->keys.count,
+		(unsigned long long)qu->ncoalesced, (unsigned long long)qu->nreused);
+	dprintf(qu->clientfd, "memo cache %zu entries, %llu of %llu bytes, %llu hits, %llu misses, %llu evicted\n",
+		qu->memo.count, (unsigned long long)qu->memo.bytes, (unsigned long long)qu->memo.budget,
+		(unsigned long long)qu->memo.hits, (unsigned long long)qu->memo.misses,
+		(unsigned long long)qu->memo.evicted);
+	if (qu->adaptive) {
+		struct adapt* a = &qu->adapt;
+		dprintf(qu->clientfd, "concurrency limit %.2f of %.0f..%.0f, adaptive, %llu up, %llu down\n",
+			a->limit, a->min, a->max, (unsigned long long)a->increases, (unsigned long long)a->decreases);
+		dprintf(qu->clientfd, "last window %.2f tasks/s, runtime %.2fx of %.0fms baseline, pressure ",
+			a->rate, a->inflation, a->baseline);
+		if (a->pressure < 0) dprintf(qu->clientfd, "unavailable\n");
+		else dprintf(qu->clientfd, "%.2f%%\n", a->pressure);
+	} else if (qu->maxjobs > 0) {
+		dprintf(qu->clientfd, "concurrency limit %zu\n", qu->maxjobs);
+	} else {
+		dprintf(qu->clientfd, "concurrency limit none\n");
+	}
+	dprintf(qu->clientfd, "placement %zu cpus on %zu nodes, %llu on cores, %llu of them across nodes, %llu on a node, load",
+		qu->topo.cpus.count, qu->topo.nodes.count, (unsigned long long)qu->topo.placed,
+		(unsigned long long)qu->topo.spanned, (unsigned long long)qu->topo.shared);
+	for (size_t i = 0; i < qu->topo.nodes.count; i += 1)
+		dprintf(qu->clientfd, " %u:%.2f", qu->topo.nodes.items[i].id, topo_nodeload(&qu->topo, i));
+	dprintf(qu->clientfd, "\n");
+	dprintf(qu->clientfd, "background %zu running of %zu, %zu ready\n", qu->nbackground, qu->maxbackground,
+		readyq_count(&qu->bgready));
+	uint64_t dldone = qu->dlmet + qu->dlmissed;
+	dprintf(qu->clientfd, "deadlines %llu met, %llu missed, %.1f%% met, %llu submitted at risk, %llu refused\n",
+		(unsigned long long)qu->dlmet, (unsigned long long)qu->dlmissed, dldone > 0 ? 100.0*qu->dlmet/dldone : 100.0,
+		(unsigned long long)qu->dlatrisk, (unsigned long long)qu->dlrefused);
+	dprintf(qu->clientfd, "resources %llu waits", (unsigned long long)qu->tokens.waits);
+	for (size_t i = 0; i < qu->tokens.count; i += 1)
+		dprintf(qu->clientfd, ", %s %u of %u tokens taken, %u reserved, %zu waiting", qu->tokens.items[i].name,
+			qu->tokens.items[i].used, qu->tokens.items[i].total, qu->tokens.items[i].reserved,
+			tokens_nwaiting(&qu->tokens, i));
+	dprintf(qu->clientfd, "\n");
+	if (qu->js.fd != -1) {
+		size_t free = jobserver_free(&qu->js);
+		size_t jobs = qu->js.tokens - free > qu->js.held ? qu->js.tokens - free - qu->js.held : 0;
+		dprintf(qu->clientfd, "jobserver %zu tokens, %zu held by tasks, %zu by their jobs, %llu tasks started without one\n",
+			qu->js.tokens, qu->js.held, jobs, (unsigned long long)qu->js.missed);
+	}
+	dprintf(qu->clientfd, "hedges %llu copies of straggling tasks, %llu finished first\n",
+		(unsigned long long)qu->nhedged, (unsigned long long)qu->ncopywon);
+	dprintf(qu->clientfd, "templates %zu, %llu starts, %llu skipped while the last run hadn't finished, "
+		"%llu intervals missed\n", qu->tasks.recur.count, (unsigned long long)qu->nrecurred,
+		(unsigned long long)qu->nrecurskipped, (unsigned long long)qu->nrecurmissed);
+	dprintf(qu->clientfd, "workers %zu connected, %zu tasks leased now, %llu ever, %llu done, %llu leases lost\n",
+		qu->workers.connected, qu->workers.leases.count, (unsigned long long)qu->workers.leased,
+		(unsigned long long)qu->workers.done, (unsigned long long)qu->workers.expired);
+	dprintf(qu->clientfd, "runtimes of %zu commands, %zu normalized, ready tasks in %s order\n",
+		qu->runtimes.exact.count, qu->runtimes.norm.count, qu->sjf ? "sjf" : "fifo");
+	dprintf(qu->clientfd, "capacity %.2f of %.2f cpus, %llu of %llu bytes, %zu tasks held now, %llu ever, %llu backfilled\n",
+		qu->cap.used.cpus/1000.0, qu->cap.total.cpus/1000.0, (unsigned long long)qu->cap.used.mem,
+		(unsigned long long)qu->cap.total.mem, qu->held.count, (unsigned long long)qu->cap.held,
+		(unsigned long long)qu->cap.backfilled);
+	dprintf(qu->clientfd, "busy %llu rate limited, %llu over capacity, %llu refused with the tables full\n",
+		(unsigned long long)qu->limit.limited, (unsigned long long)qu->nbusy, (unsigned long long)qu->nfull);
+	dprintf(qu->clientfd, "exec cache %llu hits, %llu misses\n",
+		(unsigned long long)qu->exec.hits, (unsigned long long)qu->exec.misses);
+}
+
+static
+int dlentry_cmp(const void* a, const void* b) {
+	uint64_t x = ((const struct dlentry*)a)->deadline;
+	uint64_t y = ((const struct dlentry*)b)->deadline;
+	return x < y ? -1 : x > y;
+}
+
+/* ready task id of a class starts on the slot that frees up first, out of nslots, or
+   right away with no slots when starts aren't limited. its eta is when it'd be done,
+   if it's known how long it runs
+*/
+static
+void qu_etastart(struct qu* qu, uint32_t id, double* slots, size_t nslots, double* etas) {
+	struct task* task = qu_gettask(qu, id);
+	if (task_state(&qu->tasks, task) != TS_INACTIVE) return;
+	double r = qu_runtime(qu, task);
+	if (nslots == 0) {
+		if (r >= 0) etas[id - 1] = r;
+		return;
+	}
+	size_t first = 0;
+	for (size_t i = 1; i < nslots; i += 1)
+		if (slots[i] < slots[first]) first = i;
+	if (r >= 0) etas[id - 1] = slots[first] + r;
+	/* one that isn't known is taken for short, as sjf does */
+	slots[first] += r > 0 ? r : 0;
+}
+
+/* the etas of the running and ready tasks of a class, with limit slots, 0 for no limit */
+static
+void qu_etaclass(struct qu* qu, bool background, size_t limit, double* etas) {
+	uint64_t now = now_ms();
+	static struct {
+		double* items;
+		size_t count;
+		size_t capacity;
+	} slots = {0};
+	slots.count = 0;
+
+	for (size_t i = 0; i < qu->pids.capacity; i += 1) {
+		if (qu->pids.slots[i].pid == 0) continue;
+		struct task* t = qu_gettask(qu, qu->pids.slots[i].id);
+		if (t->background != background) continue;
+		double r = qu_runtime(qu, t);
+		double left = r - (double)(now - t->started);
+		if (r >= 0) etas[t->id - 1] = left > 0 ? left : 0;
+		/* one whose runtime isn't known is taken to be about done */
+		if (limit > 0) da_append(&slots, left > 0 ? left : 0);
+	}
+	while (slots.count < limit) da_append(&slots, 0.0);
+
+	/* in the order dispatch takes them */
+	struct readyq* q = background ? &qu->bgready : &qu->ready;
+	if (!background)
+		for (size_t i = 0; i < qu->held.count; i += 1) qu_etastart(qu, qu->held.items[i], slots.items, slots.count, etas);
+	struct dlheap* heaps[] = {&q->edf, &q->sjf};
+	for (size_t h = 0; h < 2; h += 1) {
+		struct dlentry* sorted = malloc(heaps[h]->count*sizeof(*sorted) + 1);
+		ASSERT(sorted != NULL, "out of memory");
+		memcpy(sorted, heaps[h]->items, heaps[h]->count*sizeof(*sorted));
+		qsort(sorted, heaps[h]->count, sizeof(*sorted), dlentry_cmp);
+		for (size_t i = 0; i < heaps[h]->count; i += 1) qu_etastart(qu, sorted[i].id, slots.items, slots.count, etas);
+		free(sorted);
+	}
+	for (size_t i = 0; i < q->fifo.count; i += 1)
+		qu_etastart(qu, q->fifo.items[(q->fifo.head + i) % q->fifo.capacity], slots.items, slots.count, etas);
+}
+
+/* ms from now until each task is expected to be done, by id - 1. negative where it
+   can't be told: the task isn't running or ready, or it's not known how long it runs
+*/
+static
+double* qu_etas(struct qu* qu) {
+	double* etas = malloc(qu->tasks.count*sizeof(*etas) + 1);
+	ASSERT(etas != NULL, "out of memory");
+	for (size_t i = 0; i < qu->tasks.count; i += 1) etas[i] = -1;
+	qu_etaclass(qu, false, qu->adaptive ? adapt_limit(&qu->adapt) : qu->maxjobs, etas);
+	qu_etaclass(qu, true, qu->maxbackground, etas);
+	return etas;
+}
+
+void qu_handleclient(struct qu* qu, struct wire_frame* frame, char* payload) {
+	ASSERT(frame != NULL, "got null frame");
+	ASSERT(qu->clientfd > -1, "clientfd is negative");
+
+	switch (frame->kind) {
+	case KIND_KILL:
+		qu_handlekill(qu, &frame->m.kill, payload);
+		break;
+	case KIND_LIST: {
+		/* handle client */
+		double* etas = qu_etas(qu);
+		for (size_t i = 0; i < qu->tasks.count; i += 1) {
+			struct task* t = &qu->tasks.items[i];
+			state_t st = task_state(&qu->tasks, t);
+			dprintf(qu->clientfd, "[%u] %d %s: ", t->id, task_pid(&qu->tasks, t), task_queue(&qu->strs, t));
+			task_printargs(qu->clientfd, &qu->strs, t);
+			dprintf(qu->clientfd, " (%s%s", state2str(st), t->cached ? ", memoized" : "");
+			struct cgstats* stats = side_get(&qu->tasks.stats, t->id);
+			if (stats != NULL) {
+				dprintf(qu->clientfd, ", cpu %.2fs, mem %lluK, io %lluK/%lluK",
+					stats->cpu_usec/1e6, (unsigned long long)stats->mem_peak/1024,
+					(unsigned long long)stats->io_rbytes/1024, (unsigned long long)stats->io_wbytes/1024);
+			}
+			struct attempts* tries = side_get(&qu->tasks.attempts, t->id);
+			if (tries != NULL) {
+				dprintf(qu->clientfd, ", attempt %zu", tries->count + 1);
+				for (size_t a = 0; a < tries->count; a += 1)
+					dprintf(qu->clientfd, "%s%d%s after %.2fs", a == 0 ? ", failed " : ", ", tries->items[a].exitcode,
+						tries->items[a].timedout ? " timedout" : "", tries->items[a].ms/1e3);
+			}
+			uint32_t lessee = t->worker ? workers_lessee(&qu->workers, t->id) : 0;
+			if (lessee != 0) dprintf(qu->clientfd, ", leased by worker %u", lessee);
+			else if (t->worker) dprintf(qu->clientfd, ", for workers");
+			struct hedge* h = side_get(&qu->tasks.hedges, t->id);
+			if (h != NULL && h->copyof != 0) dprintf(qu->clientfd, ", copy of %u", h->copyof);
+			if (h != NULL && h->copy != 0) dprintf(qu->clientfd, ", copied as %u%s", h->copy, h->lost ? " which finished first" : "");
+			if (etas[i] >= 0) dprintf(qu->clientfd, ", eta %.1fs", etas[i]/1e3);
+			dprintf(qu->clientfd, ")\n");
+		}
+		free(etas);
+	} break;
+	case KIND_SUBMIT:
+		qu_handlesubmit(qu, &frame->m.submit, payload);
+		break;
+	case KIND_STATS:
+		qu_handlestats(qu);
+		break;
+	case KIND_ENV:
+		qu_handleenv(qu, &frame->m.env, payload);
+		break;
+	case KIND_WORK: {
+		/* the connection is the worker's from now on, the daemon doesn't close it */
+		setfdflags(qu->clientfd, FD_CLOEXEC, O_NONBLOCK);
+		uint32_t wid = workers_add(&qu->workers, qu->clientfd);
+		qu->clientfd = -1;
+		loginfo("worker %u connected", wid);
+		qu_handlework(qu, wid, &frame->m.work, payload);
+		struct worker* w = workers_get(&qu->workers, wid);
+		if (w != NULL) qu_workerflush(qu, w);
+	} return;
+	default:
+		logerr("unknown command: %u", frame->kind);
+		dprintf(qu->clientfd, "error: unknown command\n");
+	}
+	close(qu->clientfd);
+	qu->clientfd = -1;
+}
+
+///////////////////////////////////
+
+int main(int argc, char* argv[]) {
+	int code;
+	struct qu qu = {0};
+	struct wire_frame frame;
+	static char payload[WIRE_MAX_PAYLOAD];
+	struct config conf = parse_conf(argc, argv);
+
+	qu_init(&qu, &conf);
+	code = 0;
+
+	for (;;) {
+		if (had_sigintr) {
+			code = 1;
+			goto qu_shutdown;
+		}
+		qu_dispatch(&qu);
+		qu_poll(&qu, -1);
+
+		if (qu.clientfd < 0) {
+			continue;
+		}
+
+		/* TODO:
+			the more sensible thing to do here is to block signals that may interrupt
+			this read
+		* see TODO(Thu 19 Jun 23:14:51 WAT 2025)
+		*/
+		ssize_t n = readall(qu.clientfd, (char*)&frame, sizeof(frame));
+		switch (n) {
+		default:
+			printf("got: ");
+			xxd((const uint8_t*)&frame, n);
+			wire_frame_print(&frame);
+
+			if (frame.version != WIRE_VERSION || frame.end != WIRE_END_BYTE) {
+				logerr("malformed frame");
+				dprintf(qu.clientfd, "error: malformed frame\n");
+				close(qu.clientfd);
+				qu.clientfd = -1;
+				continue;
+			}
+
+			uint32_t paylen = wire_frame_paylen(&frame);
+			if (paylen > WIRE_MAX_PAYLOAD || readall(qu.clientfd, payload, paylen) != paylen) {
+				logerr("bad payload");
+				dprintf(qu.clientfd, "error: bad payload\n");
+				close(qu.clientfd);
+				qu.clientfd = -1;
+				continue;
+			}
 
-			qu_handleclient(&qu, frame);
+			qu_handleclient(&qu, &frame, payload);
 			break;
 		case 0:
 			loginfo("client disconnected");
-			 qu.clientfd = -1;
+			close(qu.clientfd);
+			qu.clientfd = -1;
 			continue;
 		case -1:
 			perror("read");
@@ -369,6 +2898,13 @@ int main(int argc, char* argv[]) {
 		}
 	}
 qu_shutdown:
+	zygote_stop(&qu.zy);
+	execcache_fini(&qu.exec);
+	memo_fini(&qu.memo);
+	if (!runtimes_save(&qu.runtimes)) logerr("runtimes %s: %s", qu.runtimes.path, strerror(errno));
+	if (qu.adaptive) psi_close(&qu.psi);
+	jobserver_close(&qu.js);
+	cg_fini(&qu.cg);
 	close(qu.fd);
 	unlink(SOCK_PATH);
 	exit(code);
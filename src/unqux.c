@@ -0,0 +1,342 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "util.h"
+#include "plugin.h"
+#include "pool.h"
+#include "wire.h"
+
+///////////////////////////////////
+
+#define DEFAULT_BATCH 64 /* tasks leased per thread at most */
+#define DEFAULT_HEARTBEAT_MS 2500 /* a quarter of the daemon's default -L */
+
+struct config {
+	bool help;
+	size_t threads;
+	size_t batch;
+	uint64_t heartbeat; /* ms */
+	struct plugins plugins;
+	char** queues;
+	size_t nqueues;
+};
+
+static
+void printusage(int code) {
+	fprintf(stderr,
+	        "run the tasks of plugins on a thread pool, as a worker of the unqu daemon\n"
+	        "\n"
+	        "usage: " UNQUX " [-h] [-t threads] [-b batch] [-H ms] -p name=plugin.so... queue...\n"
+	        "\n"
+	        " -p     load the shared object as the plugin called name, tasks whose command is name\n"
+	        "        run its " PLUGIN_ENTRY "(argc, argv). can be repeated\n"
+	        " -t     run tasks on this many threads, defaults to one per cpu\n"
+	        " -b     lease at most this many tasks per thread at once, defaults to 64\n"
+	        " -H     renew the leases at least this often while tasks run, in ms, defaults to 2500.\n"
+	        "        keep it well under the daemon's -L\n"
+	        " -h     print this help and exit\n"
+	        " queue  lease the tasks submitted with --worker to these queues\n"
+	        "\n"
+	        "a task whose command isn't a plugin exits with 127. a task that's killed has its lease\n"
+	        "revoked, it runs to its end and its exit code is dropped\n"
+	        "\n"
+	);
+	exit(code);
+}
+
+static
+struct config parse_conf(int argc, char* argv[]) {
+	long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+	struct config conf = {
+		.threads = ncpu > 0 ? (size_t)ncpu : 1,
+		.batch = DEFAULT_BATCH,
+		.heartbeat = DEFAULT_HEARTBEAT_MS,
+	};
+
+	int opt;
+	char* end;
+	char err[256];
+	while ((opt = getopt(argc, argv, "ht:b:H:p:")) != -1) {
+		switch (opt) {
+		case 'h':
+			conf.help = true;
+			break;
+		case 't':
+			errno = 0;
+			conf.threads = strtoul(optarg, &end, 10);
+			if (errno > 0 || end == optarg || *end != '\0' || conf.threads == 0) {
+				fprintf(stderr, UNQUX ": '%s' is not a valid number of threads\n", optarg);
+				printusage(1);
+			}
+			break;
+		case 'b':
+			errno = 0;
+			conf.batch = strtoul(optarg, &end, 10);
+			if (errno > 0 || end == optarg || *end != '\0' || conf.batch == 0) {
+				fprintf(stderr, UNQUX ": '%s' is not a valid batch\n", optarg);
+				printusage(1);
+			}
+			break;
+		case 'H':
+			errno = 0;
+			conf.heartbeat = strtoull(optarg, &end, 10);
+			if (errno > 0 || end == optarg || *end != '\0' || conf.heartbeat == 0 || conf.heartbeat > INT32_MAX) {
+				fprintf(stderr, UNQUX ": '%s' is not a valid interval in ms\n", optarg);
+				printusage(1);
+			}
+			break;
+		case 'p': {
+			char* eq = strchr(optarg, '=');
+			if (eq == NULL || eq == optarg || eq[1] == '\0') {
+				fprintf(stderr, UNQUX ": '%s' is not a valid plugin, name=path\n", optarg);
+				printusage(1);
+			}
+			*eq = '\0';
+			if (!plugins_add(&conf.plugins, optarg, eq + 1, err, sizeof(err))) {
+				fprintf(stderr, UNQUX ": plugin %s: %s\n", optarg, err);
+				exit(1);
+			}
+		} break;
+		default: printusage(1);
+		}
+	}
+	if (conf.help) {
+		printusage(0);
+	}
+	if (conf.plugins.count == 0 || optind == argc) {
+		fprintf(stderr, UNQUX ": expected a plugin and the queues to lease tasks of\n");
+		printusage(1);
+	}
+	conf.queues = argv + optind;
+	conf.nqueues = argc - optind;
+	return conf;
+}
+
+static
+uint64_t now_ms(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec*1000 + ts.tv_nsec/1000000;
+}
+
+static
+int clientsock(void) {
+	struct sockaddr_un name;
+	int sockfd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (sockfd == -1) {
+		perror("socket");
+		exit(1);
+	}
+
+	memset(&name, 0, sizeof(name));
+	name.sun_family = AF_UNIX;
+	strncpy(name.sun_path, SOCK_PATH, sizeof(name.sun_path)-1);
+	if (connect(sockfd, (struct sockaddr*)&name, sizeof(name)) == -1) {
+		perror("connect");
+		exit(1);
+	}
+	return sockfd;
+}
+
+/* read exactly n bytes, false if the daemon hung up first */
+static
+bool readall(int fd, void* buf, size_t n) {
+	size_t got = 0;
+	while (got < n) {
+		ssize_t rn = read(fd, (char*)buf + got, n - got);
+		if (rn == -1 && errno == EINTR) continue;
+		if (rn <= 0) return false;
+		got += rn;
+	}
+	return true;
+}
+
+static
+bool writeall(int fd, const void* buf, size_t n) {
+	while (n > 0) {
+		ssize_t wn = write(fd, buf, n);
+		if (wn == -1 && errno == EINTR) continue;
+		if (wn <= 0) return false;
+		buf = (const char*)buf + wn;
+		n -= wn;
+	}
+	return true;
+}
+
+///////////////////////////////////
+
+/* a leased task, its argv points into the strings after it */
+struct job {
+	uint32_t id;
+	plugin_entry entry; /* NULL if no plugin goes by its command */
+	int argc;
+	char* argv[];
+};
+
+/* what the threads finished, for the main thread to report */
+struct finished {
+	pthread_mutex_t mu;
+	struct {
+		struct wire_done* items;
+		size_t count;
+		size_t capacity;
+	} done;
+	int wake[2]; /* a byte is written when done stops being empty */
+};
+
+static
+void job_run(void* arg, void* ctx) {
+	struct job* j = arg;
+	struct finished* f = ctx;
+	int code = j->entry != NULL ? j->entry(j->argc, j->argv) & 0xff : 127;
+	struct wire_done d = {.id = j->id, .exitcode = code};
+	free(j);
+
+	pthread_mutex_lock(&f->mu);
+	bool wake = f->done.count == 0;
+	da_append(&f->done, d);
+	pthread_mutex_unlock(&f->mu);
+	if (wake) (void)!write(f->wake[1], "", 1);
+}
+
+/* report the tasks in done and lease up to max more, naming the queues on the first frame */
+static
+bool sendwork(int fd, uint32_t max, struct wire_done* done, size_t ndone, char** queues, size_t nqueues) {
+	uint32_t len = ndone*sizeof(*done);
+	for (size_t i = 0; i < nqueues; i += 1) len += strlen(queues[i]) + 1;
+	struct wire_frame frame = {
+		.version = WIRE_VERSION,
+		.kind = KIND_WORK,
+		.end = WIRE_END_BYTE,
+	};
+	frame.m.work = (struct msgwork) {.max = max, .ndone = ndone, .nqueues = nqueues, .len = len};
+	if (!writeall(fd, &frame, sizeof(frame)) || !writeall(fd, done, ndone*sizeof(*done))) return false;
+	for (size_t i = 0; i < nqueues; i += 1)
+		if (!writeall(fd, queues[i], strlen(queues[i]) + 1)) return false;
+	return true;
+}
+
+/* read the answer to a frame and queue its tasks, returns how many or -1 if the daemon hung up */
+static
+long readleases(int fd, struct pool* p, struct plugins* ps) {
+	uint32_t n;
+	if (!readall(fd, &n, sizeof(n))) return -1;
+	for (uint32_t i = 0; i < n; i += 1) {
+		struct wire_lease l;
+		if (!readall(fd, &l, sizeof(l)) || l.argc == 0 || l.len == 0) return -1;
+		struct job* j = malloc(sizeof(*j) + (l.argc + 1)*sizeof(char*) + l.len);
+		ASSERT(j != NULL, "out of memory");
+		char* strs = (char*)(j->argv + l.argc + 1);
+		if (!readall(fd, strs, l.len)) return -1;
+		j->id = l.id;
+		j->argc = l.argc;
+		char* s = strs;
+		for (uint32_t a = 0; a < l.argc; a += 1, s += strlen(s) + 1) j->argv[a] = s;
+		j->argv[l.argc] = NULL;
+		j->entry = plugins_find(ps, j->argv[0]);
+		pool_submit(p, j);
+	}
+	return n;
+}
+
+int main(int argc, char* argv[]) {
+	struct config conf = parse_conf(argc, argv);
+	signal(SIGPIPE, SIG_IGN);
+
+	static struct finished fin;
+	pthread_mutex_init(&fin.mu, NULL);
+	if (pipe2(fin.wake, O_CLOEXEC | O_NONBLOCK) == -1) {
+		perror("pipe");
+		exit(1);
+	}
+	struct pool pool;
+	if (!pool_start(&pool, conf.threads, job_run, &fin)) {
+		logerr("couldn't start %zu threads", conf.threads);
+		exit(1);
+	}
+	int fd = clientsock();
+	loginfo("%zu threads run %zu plugins, for %zu queues", conf.threads, conf.plugins.count, conf.nqueues);
+
+	/* leased tasks that weren't reported done, and the tasks frames that weren't answered yet
+	   asked for. together they stay under the pool's room, and the daemon answers in order
+	*/
+	size_t room = conf.threads*conf.batch;
+	size_t inflight = 0;
+	size_t asked = 0;
+	struct {
+		uint32_t* items;
+		size_t count;
+		size_t capacity;
+	} asks = {0};
+	struct {
+		struct wire_done* items;
+		size_t count;
+		size_t capacity;
+	} report = {0};
+	bool first = true;
+	uint64_t lastsent = 0;
+
+	for (;;) {
+		char drain[64];
+		while (read(fin.wake[0], drain, sizeof(drain)) > 0)
+			;
+		pthread_mutex_lock(&fin.mu);
+		da_reserve(&report, report.count + fin.done.count);
+		memcpy(report.items + report.count, fin.done.items, fin.done.count*sizeof(*fin.done.items));
+		report.count += fin.done.count;
+		fin.done.count = 0;
+		pthread_mutex_unlock(&fin.mu);
+
+		/* each frame renews every lease, a frame is due for the reports, to keep the leases
+		   while tasks run, or to ask for tasks when no frame does
+		*/
+		uint64_t now = now_ms();
+		size_t canask = room - (inflight - report.count) - asked;
+		bool beat = inflight > 0 && now - lastsent >= conf.heartbeat;
+		if (first || report.count > 0 || beat || (asked == 0 && canask > 0)) {
+			if (!sendwork(fd, canask, report.items, report.count, conf.queues, first ? conf.nqueues : 0)) {
+				logerr("the daemon hung up");
+				exit(1);
+			}
+			inflight -= report.count;
+			report.count = 0;
+			da_append(&asks, (uint32_t)canask);
+			asked += canask;
+			lastsent = now;
+			first = false;
+		}
+
+		struct pollfd pfds[] = {
+			{.fd = fd, .events = POLLIN},
+			{.fd = fin.wake[0], .events = POLLIN},
+		};
+		if (poll(pfds, 2, inflight > 0 ? (int)conf.heartbeat : -1) == -1 && errno != EINTR) {
+			perror("poll");
+			exit(1);
+		}
+		if (pfds[0].revents != 0) {
+			long n = readleases(fd, &pool, &conf.plugins);
+			if (n < 0) {
+				logerr("the daemon hung up");
+				exit(1);
+			}
+			inflight += n;
+			asked -= asks.items[0];
+			asks.count -= 1;
+			memmove(asks.items, asks.items + 1, asks.count*sizeof(*asks.items));
+		}
+	}
+}
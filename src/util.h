@@ -3,9 +3,11 @@
 #include <stdarg.h>
 #include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
 
 #define UNQU             "unqu"
 #define UNQUD            "unqud"
+#define UNQUX            "unqux"
 #define SOCK_PATH        "unqu.sock"
 #define SOCK_QUEUE_SIZE  44
 
@@ -20,6 +22,26 @@
 	}; \
 } while (0)
 
+/* dynamic arrays: any struct with `items`, `count` and `capacity` fields */
+#define DA_INIT_CAP 16
+#define da_reserve(da, n) do { \
+	if ((n) > (da)->capacity) { \
+		if ((da)->capacity == 0) (da)->capacity = DA_INIT_CAP; \
+		while ((n) > (da)->capacity) (da)->capacity *= 2; \
+		(da)->items = realloc((da)->items, (da)->capacity*sizeof(*(da)->items)); \
+		ASSERT((da)->items != NULL, "out of memory"); \
+	} \
+} while (0)
+#define da_append(da, item) do { \
+	da_reserve((da), (da)->count + 1); \
+	(da)->items[(da)->count++] = (item); \
+} while (0)
+#define da_free(da) do { \
+	free((da)->items); \
+	(da)->items = NULL; \
+	(da)->count = (da)->capacity = 0; \
+} while (0)
+
 
 enum logkind {
 	LOGERR,
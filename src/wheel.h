@@ -0,0 +1,256 @@
+/*
+
+hierarchical timing wheel
+-------------------------
+
+WHEEL_NUM wheels of WHEEL_LEN slots each, wheel n has a resolution of
+WHEEL_LEN^n ticks (a tick is a millisecond for unqud). a timer goes into the
+wheel that matches how far away it is, and is cascaded down into a finer
+wheel when the coarse slot it sits in comes due.
+
+each wheel keeps a bitmap of its non-empty slots, so:
+	- inserting and cancelling are O(1), list operations on a slot
+	- advancing only visits the slots that are due and non-empty
+	- the time to the next expiry is a couple of ctz per wheel, so
+	  the caller can sleep until then instead of ticking
+
+this is the scheme used by William Ahern's timeout.c.
+
+timers live in fixed-size chunks that never move, so a struct timer* stays
+valid until it is handed back with wheel_release().
+
+*/
+
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include "util.h"
+
+#define WHEEL_BIT   6
+#define WHEEL_LEN   (1u << WHEEL_BIT)
+#define WHEEL_MASK  (WHEEL_LEN - 1)
+#define WHEEL_NUM   6
+#define WHEEL_MAX   ((UINT64_C(1) << (WHEEL_BIT*WHEEL_NUM)) - 1)
+
+#define TIMER_CHUNK 4096
+
+struct tlist {
+	struct tlist* next;
+	struct tlist* prev;
+};
+
+struct timer {
+	struct tlist link; /* must be first */
+	struct tlist* pending; /* the list this timer is on, NULL if none */
+	uint64_t expires;
+	uint32_t id;  /* owner's data */
+	uint8_t kind; /* owner's data */
+};
+
+struct timerchunk {
+	struct timerchunk* next;
+	struct timer timers[TIMER_CHUNK];
+};
+
+struct wheel {
+	uint64_t curtime;
+	uint64_t pending[WHEEL_NUM]; /* bitmap of non-empty slots */
+	struct tlist slots[WHEEL_NUM][WHEEL_LEN];
+	struct tlist expired;
+	size_t count; /* scheduled timers */
+	struct timer* freelist;
+	struct timerchunk* chunks;
+};
+
+static inline
+void tlist_init(struct tlist* l) {
+	l->next = l->prev = l;
+}
+
+static inline
+bool tlist_empty(struct tlist* l) {
+	return l->next == l;
+}
+
+static inline
+void tlist_remove(struct tlist* n) {
+	n->prev->next = n->next;
+	n->next->prev = n->prev;
+	n->next = n->prev = n;
+}
+
+static inline
+void tlist_append(struct tlist* l, struct tlist* n) {
+	n->prev = l->prev;
+	n->next = l;
+	l->prev->next = n;
+	l->prev = n;
+}
+
+/* move every node of src to the end of dst */
+static inline
+void tlist_concat(struct tlist* dst, struct tlist* src) {
+	if (tlist_empty(src)) return;
+	src->next->prev = dst->prev;
+	dst->prev->next = src->next;
+	src->prev->next = dst;
+	dst->prev = src->prev;
+	tlist_init(src);
+}
+
+static inline
+uint64_t rotl64(uint64_t v, unsigned c) {
+	c &= 63;
+	return c == 0 ? v : (v << c) | (v >> (64 - c));
+}
+
+static inline
+uint64_t rotr64(uint64_t v, unsigned c) {
+	c &= 63;
+	return c == 0 ? v : (v >> c) | (v << (64 - c));
+}
+
+static inline
+int wheel_level(uint64_t rem) {
+	/* rem is never 0 here */
+	if (rem > WHEEL_MAX) rem = WHEEL_MAX;
+	return (63 - __builtin_clzll(rem)) / WHEEL_BIT;
+}
+
+static inline
+int wheel_slot(int level, uint64_t expires) {
+	/* a coarse slot comes due one rotation early, that's when its timers cascade down */
+	return WHEEL_MASK & ((expires >> (level*WHEEL_BIT)) - !!level);
+}
+
+void wheel_init(struct wheel* w, uint64_t now) {
+	*w = (struct wheel) {.curtime = now};
+	for (int i = 0; i < WHEEL_NUM; i += 1)
+		for (unsigned j = 0; j < WHEEL_LEN; j += 1)
+			tlist_init(&w->slots[i][j]);
+	tlist_init(&w->expired);
+}
+
+static
+void wheel_sched(struct wheel* w, struct timer* t) {
+	if (t->expires > w->curtime) {
+		int level = wheel_level(t->expires - w->curtime);
+		int slot = wheel_slot(level, t->expires);
+		t->pending = &w->slots[level][slot];
+		w->pending[level] |= UINT64_C(1) << slot;
+	} else {
+		t->pending = &w->expired;
+	}
+	tlist_append(t->pending, &t->link);
+}
+
+/* schedule a timer at the absolute time expires, O(1) */
+struct timer* wheel_add(struct wheel* w, uint64_t expires, uint32_t id, uint8_t kind) {
+	if (w->freelist == NULL) {
+		struct timerchunk* c = malloc(sizeof(*c));
+		ASSERT(c != NULL, "out of memory");
+		c->next = w->chunks;
+		w->chunks = c;
+		for (size_t i = 0; i < TIMER_CHUNK; i += 1) {
+			c->timers[i].link.next = (struct tlist*)w->freelist;
+			w->freelist = &c->timers[i];
+		}
+	}
+	struct timer* t = w->freelist;
+	w->freelist = (struct timer*)t->link.next;
+
+	*t = (struct timer) {.expires = expires, .id = id, .kind = kind};
+	wheel_sched(w, t);
+	w->count += 1;
+	return t;
+}
+
+/* give a timer back to the wheel, cancelling it if it is still scheduled, O(1) */
+void wheel_release(struct wheel* w, struct timer* t) {
+	if (t->pending != NULL) {
+		struct tlist* slot = t->pending;
+		tlist_remove(&t->link);
+		if (slot != &w->expired && tlist_empty(slot)) {
+			size_t off = slot - &w->slots[0][0];
+			w->pending[off / WHEEL_LEN] &= ~(UINT64_C(1) << (off % WHEEL_LEN));
+		}
+		t->pending = NULL;
+		w->count -= 1;
+	}
+	t->link.next = (struct tlist*)w->freelist;
+	w->freelist = t;
+}
+
+/* advance the wheel to now, due timers are moved to the expired list */
+void wheel_update(struct wheel* w, uint64_t now) {
+	if (now <= w->curtime) return;
+
+	uint64_t elapsed = now - w->curtime;
+	struct tlist todo;
+	tlist_init(&todo);
+
+	for (int level = 0; level < WHEEL_NUM; level += 1) {
+		uint64_t due;
+		if ((elapsed >> (level*WHEEL_BIT)) > WHEEL_MASK) {
+			due = ~UINT64_C(0);
+		} else {
+			uint64_t n = WHEEL_MASK & (elapsed >> (level*WHEEL_BIT));
+			unsigned oslot = WHEEL_MASK & (w->curtime >> (level*WHEEL_BIT));
+			unsigned nslot = WHEEL_MASK & (now >> (level*WHEEL_BIT));
+			due = rotl64((UINT64_C(1) << n) - 1, oslot);
+			due |= rotr64(rotl64((UINT64_C(1) << n) - 1, nslot), n);
+			due |= UINT64_C(1) << nslot;
+		}
+
+		while ((due & w->pending[level]) != 0) {
+			int slot = __builtin_ctzll(due & w->pending[level]);
+			tlist_concat(&todo, &w->slots[level][slot]);
+			w->pending[level] &= ~(UINT64_C(1) << slot);
+		}
+
+		/* the next wheel only moves if this one wrapped around */
+		if ((due & 1) == 0) break;
+		if (elapsed < ((uint64_t)WHEEL_LEN << (level*WHEEL_BIT)))
+			elapsed = (uint64_t)WHEEL_LEN << (level*WHEEL_BIT);
+	}
+
+	w->curtime = now;
+	while (!tlist_empty(&todo)) {
+		struct timer* t = (struct timer*)todo.next;
+		tlist_remove(&t->link);
+		wheel_sched(w, t);
+	}
+}
+
+/* pop the next expired timer, NULL if there are none. the caller releases it */
+struct timer* wheel_next(struct wheel* w) {
+	if (tlist_empty(&w->expired)) return NULL;
+	struct timer* t = (struct timer*)w->expired.next;
+	tlist_remove(&t->link);
+	t->pending = NULL;
+	w->count -= 1;
+	return t;
+}
+
+/* ticks until the wheel needs to be advanced again, -1 if nothing is scheduled.
+   this can be earlier than the next expiry, when timers have to be cascaded.
+*/
+int64_t wheel_timeout(struct wheel* w) {
+	if (!tlist_empty(&w->expired)) return 0;
+
+	int64_t timeout = -1;
+	uint64_t relmask = 0;
+	for (int level = 0; level < WHEEL_NUM; level += 1) {
+		if (w->pending[level] != 0) {
+			unsigned slot = WHEEL_MASK & (w->curtime >> (level*WHEEL_BIT));
+			uint64_t t = (uint64_t)(__builtin_ctzll(rotr64(w->pending[level], slot)) + !!level) << (level*WHEEL_BIT);
+			t -= relmask & w->curtime;
+			if (timeout == -1 || t < (uint64_t)timeout) timeout = t;
+		}
+		relmask <<= WHEEL_BIT;
+		relmask |= WHEEL_MASK;
+	}
+	return timeout;
+}
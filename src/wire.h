@@ -9,7 +9,16 @@ there's message header for a unit of communication:
 there's an enumeration of commands: each command is 1 byte
 	commands {
 		.LIST
-		.KILL <pid: 4 byte>
+		.KILL <signo: 1 byte> <all: 1 byte> <states: 4 byte> <nids: 4 byte>
+		      <queuelen: 4 byte> <patternlen: 4 byte> <len: 4 byte>
+		.SUBMIT <ndeps: 4 byte> <argc: 4 byte> <queuelen: 4 byte> <len: 4 byte>
+		        <delay ms: 8 byte> <every ms: 8 byte> <timeout ms: 8 byte> <grace ms: 8 byte>
+		        <cpulimit: 4 byte> <memlimit: 8 byte> <cwdlen: 4 byte> <envc: 4 byte> <hasenv: 1 byte>
+		        <envtemplate: 4 byte> <noverrides: 4 byte> <retry: struct wire_retry>
+		        <keylen: 4 byte> <reuse ms: 8 byte> <memo: 1 byte> <ninputs: 4 byte>
+		.STATS
+		.ENV <envc: 4 byte> <len: 4 byte>
+		.WORK <max: 4 byte> <ndone: 4 byte> <nqueues: 4 byte> <len: 4 byte>
 	}
 
 there's message frame as a unit of communication:
@@ -17,6 +26,44 @@ there's message frame as a unit of communication:
 	<command> (1 B)
 	[command args]
 	<end byte: 0x44> (1 B)
+	[payload]
+
+commands whose arguments don't fit in a fixed-size frame carry the payload
+length in their args, and the payload follows the end byte.
+
+the SUBMIT payload is:
+	<ndeps x struct wire_dep>
+	<queue\0: queuelen bytes, absent if queuelen is 0>
+	<cwd\0: cwdlen bytes, absent if cwdlen is 0>
+	<key\0: keylen bytes, absent if keylen is 0>
+	<argv0\0argv1\0...\0: argc null-terminated strings>
+	<NAME=value\0...: envc null-terminated strings>
+	<NAME=value\0 or NAME\0...: noverrides null-terminated strings>
+	</input\0...: ninputs null-terminated absolute paths>
+	<name=tokens\0...: nresources null-terminated strings>
+
+the ENV payload is:
+	<NAME=value\0...: envc null-terminated strings>
+
+the KILL payload is:
+	<nids x task id: 4 byte>
+	<queue\0: queuelen bytes, absent if queuelen is 0>
+	<pattern\0: patternlen bytes, absent if patternlen is 0>
+
+the WORK payload is:
+	<ndone x struct wire_done>
+	<queue\0...: nqueues null-terminated strings, may be absent after the first WORK>
+
+WORK turns the connection into the one of a worker, see workers.h. it stays
+open, and the daemon's reply to each WORK is binary:
+	<n: 4 byte>
+	n x <struct wire_lease> <argv0\0argv1\0...\0: argc null-terminated strings>
+
+to everything else the daemon replies with text and closes the connection. a reply of
+	busy: retry after <ms>ms
+means the request was turned away, by the client's rate limit or because the
+daemon holds as many tasks as it's allowed to, and nothing was done. it may
+come before the daemon read the frame.
 
 */
 
@@ -28,30 +75,233 @@ there's message frame as a unit of communication:
 
 #define WIRE_VERSION 0
 #define WIRE_END_BYTE 0x44
+#define WIRE_MAX_PAYLOAD (1 << 20)
+#define WIRE_BUSY "busy: retry after "
 
-#define KIND_LIST 0
-#define KIND_KILL 1
+#define KIND_LIST   0
+#define KIND_KILL   1
+#define KIND_SUBMIT 2
+#define KIND_STATS  3
+#define KIND_ENV    4
+#define KIND_WORK   5
+
+static const char* wire_kinds[] = {
+	[KIND_LIST] = "LIST",
+	[KIND_KILL] = "KILL",
+	[KIND_SUBMIT] = "SUBMIT",
+	[KIND_STATS] = "STATS",
+	[KIND_ENV] = "ENV",
+	[KIND_WORK] = "WORK",
+};
 
 #define kind2str(kind) ( \
-	(kind) < KIND_LIST || (kind) > KIND_KILL ? \
-		"UNKNOWN" : (kind) == KIND_LIST ? \
-			"LIST" : "KILL" \
+	(kind) >= sizeof(wire_kinds)/sizeof(wire_kinds[0]) ? \
+		"UNKNOWN" : wire_kinds[(kind)] \
 )
 
+/* task states, they're on the wire as KILL selectors */
+typedef int state_t;
+#define TS_INVALID   -1
+#define TS_INACTIVE  0 /* ready, waiting to be dispatched */
+#define TS_ACTIVE    1
+#define TS_EXITED    2
+#define TS_WAITING   3 /* blocked on unfinished dependencies */
+#define TS_CANCELLED 4 /* an after-ok dependency failed, or killed before it started */
+#define TS_SCHEDULED 5 /* waiting for its start time */
+#define TS_TIMEDOUT  6 /* killed for running past its timeout */
+#define TS_COUNT     7
+
+/* unused by the programs that only include it for the frames */
+static const char* task_states[] UNUSED = {
+	[TS_INACTIVE] = "inactive",
+	[TS_ACTIVE] = "running",
+	[TS_EXITED] = "exited",
+	[TS_WAITING] = "waiting",
+	[TS_CANCELLED] = "cancelled",
+	[TS_SCHEDULED] = "scheduled",
+	[TS_TIMEDOUT] = "timedout",
+};
+
+#define state2str(state) ((state) < TS_INACTIVE || (state) >= TS_COUNT ? \
+	"UNKNOWN" : task_states[(state)])
+
+/* kill every task that matches all the given selectors: running tasks get signo,
+   the ones that haven't started yet are cancelled
+*/
 struct msgkill {
-	int32_t pid;
+	uint8_t signo;
+	uint8_t all; /* must be set to select every task when no other selector is given */
+	uint32_t states; /* bitmask of (1 << TS_*), 0 for any state */
+	uint32_t nids; /* 0 for any task id */
+	uint32_t queuelen;
+	uint32_t patternlen; /* fnmatch(3) pattern on the command name */
+	uint32_t len; /* payload length in bytes */
 } attr(packed);
 
 void msgkill_print(struct msgkill* mk) {
 	if (mk == NULL) return;
 
-	printf("  pid %d\n", mk->pid);
+	printf("  signo %u\n"
+		"  all %u\n"
+		"  states %#x\n"
+		"  nids %u\n"
+		"  queuelen %u\n"
+		"  patternlen %u\n"
+		"  len %u\n",
+		mk->signo, mk->all, mk->states, mk->nids, mk->queuelen, mk->patternlen, mk->len
+	);
 }
 
 struct msglist {
 	uint8_t v: 1;
 } attr(packed);
 
+/* dependency kinds */
+#define DEP_AFTEROK  0 /* run only if the dependency exited with 0 */
+#define DEP_AFTERANY 1 /* run once the dependency finished, however it did */
+
+struct wire_dep {
+	uint32_t id;
+	uint8_t kind;
+} attr(packed);
+
+/* rerun a failed task with the same id. the first retry starts backoff ms after the
+   failure, each next one waits twice as long up to backoffmax, and every wait is
+   shortened by a random amount of up to half of it so retries of many tasks that
+   failed together spread out
+*/
+struct wire_retry {
+	uint32_t max; /* retries after the first attempt, 0 to never retry */
+	uint64_t backoff; /* 0 for the daemon's default */
+	uint64_t backoffmax; /* 0 for the daemon's default */
+	uint8_t on[32]; /* bitmap of the exit codes to retry, 128+signo for signals, all zero for any failure */
+} attr(packed);
+
+/* memoization of a deterministic task, see memo.h */
+#define MEMO_NONE    0
+#define MEMO_STAT    1 /* inputs are hashed by size and mtime */
+#define MEMO_CONTENT 2 /* inputs are hashed by their contents */
+
+struct msgsubmit {
+	uint32_t ndeps;
+	uint32_t argc;
+	uint32_t queuelen;
+	uint32_t len; /* payload length in bytes */
+	uint64_t delay; /* start no earlier than delay ms after the daemon got the task */
+	uint64_t every; /* if non-zero, start a copy of the task every `every` ms */
+	uint64_t timeout; /* if non-zero, SIGTERM the task after it ran this many ms */
+	uint64_t grace; /* SIGKILL this many ms after the SIGTERM, 0 for the daemon's default */
+	uint32_t cpulimit; /* thousandths of a cpu the task's tree may use, 0 for no limit */
+	uint64_t memlimit; /* bytes of memory the task's tree may use, 0 for no limit */
+	uint32_t cwdlen; /* 0 to run in the daemon's working directory */
+	uint32_t envc;
+	uint8_t hasenv; /* run with the given environment instead of the daemon's */
+	uint32_t envtemplate; /* run with this registered environment instead, 0 for none */
+	uint32_t noverrides; /* NAME=value sets NAME, NAME unsets it, applied on top of the environment */
+	struct wire_retry retry;
+	uint32_t keylen; /* 0 for no key. a submit with the key of a task that hasn't finished gets that task */
+	uint64_t reuse; /* also get a task with the key that exited with 0 at most this many ms ago */
+	uint8_t memo; /* MEMO_* */
+	uint32_t ninputs; /* files the output of a memoized task depends on */
+	uint16_t cores; /* pin the task to this many cpus of one numa node, 0 to leave it to the daemon */
+	uint32_t cpus; /* thousandths of a cpu the task needs free to start, 0 for none */
+	uint64_t mem; /* bytes of memory the task needs free to start, 0 for none */
+	uint8_t background; /* run with SCHED_IDLE and idle io priority, past the daemon's limit */
+	uint64_t deadline; /* finish within this many ms of the daemon getting the task, 0 for no deadline */
+	uint8_t deadlinestrict; /* don't submit the task if it's expected to miss its deadline */
+	uint8_t hedge; /* the task is idempotent, a copy may run next to it if it straggles */
+	uint32_t nresources; /* named resources the task needs, name=tokens strings after the inputs */
+	uint8_t worker; /* run by a worker that leases it, not as a process, see workers.h */
+} attr(packed);
+
+void msgsubmit_print(struct msgsubmit* ms) {
+	if (ms == NULL) return;
+
+	printf("  ndeps %u\n"
+		"  argc %u\n"
+		"  queuelen %u\n"
+		"  len %u\n"
+		"  delay %llu\n"
+		"  every %llu\n"
+		"  timeout %llu\n"
+		"  grace %llu\n"
+		"  cpulimit %u\n"
+		"  memlimit %llu\n"
+		"  cwdlen %u\n"
+		"  envc %u\n"
+		"  hasenv %u\n"
+		"  envtemplate %u\n"
+		"  noverrides %u\n"
+		"  retry %u, backoff %llu, backoffmax %llu\n"
+		"  keylen %u\n"
+		"  reuse %llu\n"
+		"  memo %u\n"
+		"  ninputs %u\n"
+		"  cores %u\n"
+		"  cpus %u\n"
+		"  mem %llu\n"
+		"  background %u\n"
+		"  deadline %llu%s\n"
+		"  hedge %u\n"
+		"  nresources %u\n"
+		"  worker %u\n",
+		ms->ndeps, ms->argc, ms->queuelen, ms->len,
+		(unsigned long long)ms->delay, (unsigned long long)ms->every,
+		(unsigned long long)ms->timeout, (unsigned long long)ms->grace,
+		ms->cpulimit, (unsigned long long)ms->memlimit,
+		ms->cwdlen, ms->envc, ms->hasenv, ms->envtemplate, ms->noverrides,
+		ms->retry.max, (unsigned long long)ms->retry.backoff, (unsigned long long)ms->retry.backoffmax,
+		ms->keylen, (unsigned long long)ms->reuse, ms->memo, ms->ninputs, ms->cores, ms->cpus, (unsigned long long)ms->mem, ms->background,
+		(unsigned long long)ms->deadline, ms->deadlinestrict ? " strict" : "", ms->hedge, ms->nresources, ms->worker
+	);
+}
+
+/* register an environment, the reply is the id of the template for SUBMIT's envtemplate */
+struct msgenv {
+	uint32_t envc;
+	uint32_t len; /* payload length in bytes */
+} attr(packed);
+
+void msgenv_print(struct msgenv* me) {
+	if (me == NULL) return;
+
+	printf("  envc %u\n"
+		"  len %u\n",
+		me->envc, me->len
+	);
+}
+
+/* a worker reports the tasks it finished and leases more of its queues, see workers.h */
+struct msgwork {
+	uint32_t max; /* tasks to lease, 0 to only report and renew its leases */
+	uint32_t ndone;
+	uint32_t nqueues; /* replaces the queues it takes tasks of, 0 to keep them */
+	uint32_t len; /* payload length in bytes */
+} attr(packed);
+
+void msgwork_print(struct msgwork* mw) {
+	if (mw == NULL) return;
+
+	printf("  max %u\n"
+		"  ndone %u\n"
+		"  nqueues %u\n"
+		"  len %u\n",
+		mw->max, mw->ndone, mw->nqueues, mw->len
+	);
+}
+
+struct wire_done {
+	uint32_t id;
+	int32_t exitcode; /* 0 for success, like a process's */
+} attr(packed);
+
+/* a task leased to a worker, its argv follows */
+struct wire_lease {
+	uint32_t id;
+	uint32_t argc;
+	uint32_t len; /* bytes of argv */
+} attr(packed);
+
 struct wire_frame {
 	uint8_t version;
 	uint8_t kind;
@@ -62,10 +312,29 @@ struct wire_frame {
 	union {
 		struct msgkill kill;
 		struct msglist list;
+		struct msgsubmit submit;
+		struct msgenv env;
+		struct msgwork work;
 	} m;
 	uint8_t end;
 } attr(packed);
 
+/* size of the payload that follows the frame, 0 for fixed-size commands */
+uint32_t wire_frame_paylen(struct wire_frame* frame) {
+	switch (frame->kind) {
+	case KIND_KILL:
+		return frame->m.kill.len;
+	case KIND_SUBMIT:
+		return frame->m.submit.len;
+	case KIND_ENV:
+		return frame->m.env.len;
+	case KIND_WORK:
+		return frame->m.work.len;
+	default:
+		return 0;
+	}
+}
+
 void wire_frame_print(struct wire_frame* frame) {
 	if (frame == NULL) return;
 
@@ -79,7 +348,17 @@ void wire_frame_print(struct wire_frame* frame) {
 	case KIND_KILL:
 		msgkill_print(&frame->m.kill);
 		break;
+	case KIND_SUBMIT:
+		msgsubmit_print(&frame->m.submit);
+		break;
+	case KIND_ENV:
+		msgenv_print(&frame->m.env);
+		break;
+	case KIND_WORK:
+		msgwork_print(&frame->m.work);
+		break;
 	case KIND_LIST:
+	case KIND_STATS:
 		break;
 	default:
 		break;
@@ -0,0 +1,213 @@
+/*
+
+workers
+-------
+
+a task submitted with --worker isn't run as a process of its own, a worker
+runs it: a long-lived process that connects to the daemon, names the queues
+it takes tasks of and leases them in batches, so a task that takes less than
+a fork and exec costs neither.
+
+a worker keeps its connection open and sends WORK frames on it, see wire.h.
+the daemon never waits on a worker: the connection is nonblocking, frames are
+taken as they come in whole and answers are written as the worker reads them.
+a worker that leaves too many answers unread isn't read from until it does.
+each frame reports the exit codes of the tasks it finished since the last
+one and asks for up to max more. the daemon answers every frame, in order,
+with the tasks it leased to the worker: right away if there are any or max
+is 0, otherwise once a task comes in for one of its queues. a frame sent
+while the last one waits for tasks gets that one answered with none first.
+tasks of a queue are leased in the order they became ready.
+
+a lease lasts for as long as the worker is heard from: every frame renews
+all of its leases, and a worker that holds some and stays silent for the
+lease timeout, -L, or hangs up, loses them. a lost lease puts its task back
+in its queue for another worker, a worker that finishes a task it lost is
+ignored. a worker that waits for tasks holds none and has no timeout.
+
+unqux is such a worker, it runs tasks in shared objects loaded as plugins,
+see plugin.h.
+
+a task for workers has a command and nothing of a process: no limits,
+capacity, cores, resources, timeout, hedging or memoization, and it doesn't
+take a slot of -j. killing it with a signal that would end a process revokes
+its lease, it counts as killed by the signal. other signals do nothing.
+
+*/
+
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include "intern.h"
+#include "util.h"
+#include "wheel.h"
+
+#define DEFAULT_LEASE_MS 10000
+#define WORKER_READ_SIZE 65536 /* bytes read off a worker's connection at once */
+#define WORKER_BACKLOG (1 << 20) /* answers a worker leaves unread before its frames are */
+
+/* open addressing task id -> worker map of the leases, so finishing or revoking one
+   doesn't scan what its worker holds
+*/
+struct leaseslot {
+	uint32_t id; /* 0 if the slot is empty */
+	uint32_t worker;
+};
+
+struct leasemap {
+	struct leaseslot* slots;
+	size_t count;
+	size_t capacity; /* always a power of two */
+};
+
+struct worker {
+	int fd; /* -1 for a free slot, nonblocking */
+	istr queues; /* vector of the queues it takes tasks of */
+	uint32_t want; /* tasks it asked for and wasn't answered yet, 0 if it doesn't wait */
+	uint64_t seen; /* ms on the daemon's clock of its last frame */
+	struct timer* timer; /* lease timeout while it holds leases */
+	size_t nleased; /* tasks it holds */
+	struct {
+		char* items; /* what was read of a frame that didn't come in whole yet */
+		size_t count;
+		size_t capacity;
+	} in;
+	struct {
+		char* items; /* answers it wasn't sent yet, from sent on */
+		size_t count;
+		size_t capacity;
+	} out;
+	size_t sent;
+};
+
+struct workers {
+	struct worker* items; /* slot i is worker i + 1 */
+	size_t count;
+	size_t capacity;
+	struct leasemap leases;
+	size_t connected;
+	uint64_t leased; /* leases ever given out */
+	uint64_t done; /* tasks workers finished while they held them */
+	uint64_t expired; /* leases lost to a timeout or a hangup */
+};
+
+static inline
+size_t leasemap_hash(uint32_t id, size_t capacity) {
+	return (id * 2654435761u) & (capacity - 1);
+}
+
+void leasemap_put(struct leasemap* m, uint32_t id, uint32_t worker);
+
+static
+void leasemap_grow(struct leasemap* m) {
+	struct leasemap old = *m;
+	m->capacity = old.capacity == 0 ? DA_INIT_CAP : old.capacity*2;
+	m->slots = calloc(m->capacity, sizeof(*m->slots));
+	ASSERT(m->slots != NULL, "out of memory");
+	m->count = 0;
+	for (size_t i = 0; i < old.capacity; i += 1)
+		if (old.slots[i].id != 0) leasemap_put(m, old.slots[i].id, old.slots[i].worker);
+	free(old.slots);
+}
+
+void leasemap_put(struct leasemap* m, uint32_t id, uint32_t worker) {
+	ASSERT(id > 0, "task ids start at 1");
+	if ((m->count + 1)*2 > m->capacity) leasemap_grow(m);
+
+	size_t i = leasemap_hash(id, m->capacity);
+	while (m->slots[i].id != 0)
+		i = (i + 1) & (m->capacity - 1);
+	m->slots[i] = (struct leaseslot) {.id = id, .worker = worker};
+	m->count += 1;
+}
+
+/* the slot of task id, -1 if it isn't leased */
+static
+ssize_t leasemap_find(struct leasemap* m, uint32_t id) {
+	if (m->count == 0) return -1;
+	size_t i = leasemap_hash(id, m->capacity);
+	while (m->slots[i].id != id) {
+		if (m->slots[i].id == 0) return -1;
+		i = (i + 1) & (m->capacity - 1);
+	}
+	return i;
+}
+
+/* remove task id from the map, returns the worker that held it or 0 */
+uint32_t leasemap_take(struct leasemap* m, uint32_t id) {
+	ssize_t at = leasemap_find(m, id);
+	if (at == -1) return 0;
+	size_t mask = m->capacity - 1;
+	size_t i = at;
+	uint32_t worker = m->slots[i].worker;
+
+	/* backward shift deletion, as pidmap's */
+	for (size_t j = i;;) {
+		j = (j + 1) & mask;
+		if (m->slots[j].id == 0) break;
+		size_t k = leasemap_hash(m->slots[j].id, m->capacity);
+		bool inplace = i <= j ? (i < k && k <= j) : (i < k || k <= j);
+		if (inplace) continue;
+		m->slots[i] = m->slots[j];
+		i = j;
+	}
+	m->slots[i].id = 0;
+	m->count -= 1;
+	return worker;
+}
+
+/* a worker on fd, returns its number */
+uint32_t workers_add(struct workers* ws, int fd) {
+	size_t i = 0;
+	while (i < ws->count && ws->items[i].fd != -1) i += 1;
+	if (i == ws->count) da_append(ws, ((struct worker) {.fd = -1}));
+	struct worker* w = &ws->items[i];
+	w->fd = fd;
+	w->queues = 0;
+	w->want = 0;
+	w->timer = NULL;
+	w->nleased = 0;
+	w->in.count = 0;
+	w->out.count = 0;
+	w->sent = 0;
+	ws->connected += 1;
+	return (uint32_t)i + 1;
+}
+
+/* worker n, NULL if there's none */
+struct worker* workers_get(struct workers* ws, uint32_t n) {
+	if (n == 0 || n > ws->count || ws->items[n - 1].fd == -1) return NULL;
+	return &ws->items[n - 1];
+}
+
+/* whether the worker takes tasks of queue */
+bool worker_takes(struct strtab* tab, struct worker* w, const char* queue) {
+	uint32_t n = ivec_len(tab, w->queues);
+	for (uint32_t i = 0; i < n; i += 1)
+		if (strcmp(ivec_get(tab, w->queues, i), queue) == 0) return true;
+	return false;
+}
+
+/* worker n takes the lease of task id */
+void workers_lease(struct workers* ws, uint32_t n, uint32_t id) {
+	leasemap_put(&ws->leases, id, n);
+	ws->items[n - 1].nleased += 1;
+	ws->leased += 1;
+}
+
+/* the worker that holds the lease of task id, 0 for none */
+uint32_t workers_lessee(struct workers* ws, uint32_t id) {
+	ssize_t at = leasemap_find(&ws->leases, id);
+	return at == -1 ? 0 : ws->leases.slots[at].worker;
+}
+
+/* the lease of task id is given up, returns the worker that held it or 0 */
+uint32_t workers_unlease(struct workers* ws, uint32_t id) {
+	uint32_t n = leasemap_take(&ws->leases, id);
+	if (n != 0) ws->items[n - 1].nleased -= 1;
+	return n;
+}